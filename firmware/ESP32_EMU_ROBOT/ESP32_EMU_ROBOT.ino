@@ -9,6 +9,14 @@
 #include <ESPAsyncWebServer.h>
 #include <WebSocketsServer.h>
 #include <ArduinoJson.h>
+#include <Preferences.h>
+#include <esp_partition.h>
+#include <memory>
+#include <esp_heap_caps.h>
+#include <esp_adc_cal.h>
+#ifdef CONFIG_PM_ENABLE
+#include <esp_pm.h>
+#endif
 
 // Component Libraries
 #include <Adafruit_GFX.h>
@@ -19,6 +27,35 @@
 // --- WIFI CONFIGURATION ---
 const char* ssid = "YOUR_WIFI_SSID";
 const char* password = "YOUR_WIFI_PASSWORD";
+// Fast reconnect: AP channel/BSSID and the last IP lease are cached in NVS
+#define WIFI_FAST_CONNECT_TIMEOUT 3000 // Fall back to scan + DHCP after this (ms)
+#define WIFI_REUSE_IP false            // Skip DHCP on fast connect (the lease is never renewed)
+#define WIFI_CACHE_VERSION 1
+
+// --- SENSOR HISTORY CONFIGURATION ---
+// Compressed samples are appended to a flash partition labelled "history" (or the unused
+// "spiffs" partition from the default table) as a ring of 512-byte blocks.
+#define HISTORY_INTERVAL 1000          // ms between stored samples
+#define HISTORY_FLUSH_INTERVAL 60000   // Write a partial block after this long (ms)
+#define HISTORY_BLOCK_SIZE 512
+#define HISTORY_SECTOR_SIZE 4096
+#define HISTORY_MAX_SECTORS 512        // Caps the RAM index at ~12KB (2MB of flash)
+#define HISTORY_MAGIC 0xE511
+
+// --- POWER MANAGEMENT ---
+// loop() sleeps until its next deadline or an IR receiver edge, never longer than the
+// current state's cap, which is the worst-case delay before a WebSocket command is read.
+// Full clock while the motors run; 80MHz with Wi-Fi modem sleep otherwise.
+#define SENSOR_INTERVAL 250           // sensor_data broadcast period (ms)
+#define IR_REPORT_INTERVAL 50         // Earliest extra frame after IR activity (ms)
+#define NEOPIXEL_FRAME_INTERVAL 33    // Animated modes redraw at ~30 fps
+#define WIFI_POLL_INTERVAL 100        // wifiTick() cadence while not connected
+#define POWER_CPU_ACTIVE 240          // MHz
+#define POWER_CPU_IDLE 80             // MHz, lowest that keeps Wi-Fi running
+#define POWER_ACTIVE_HOLD 2000        // Stay active this long after the motors stop (ms)
+#define POWER_ACTIVE_LATENCY 5        // Max sleep per state (ms)
+#define POWER_IDLE_LATENCY 20
+#define POWER_STANDBY_LATENCY 100
 
 // --- PIN DEFINITIONS ---
 // Motors (L298N or similar)
@@ -29,6 +66,7 @@ const char* password = "YOUR_WIFI_PASSWORD";
 // OLED Display (SSD1306)
 #define OLED_SDA 21
 #define OLED_SCL 22
+#define OLED_I2C_CLOCK 400000 // SSD1306 spec; most panels also run at 1000000 (Fast-mode Plus)
 // Buzzer
 #define BUZZER_PIN 4
 // Ultrasonic Sensor (HC-SR04)
@@ -52,9 +90,10 @@ const char* password = "YOUR_WIFI_PASSWORD";
 // --- GLOBAL OBJECTS ---
 AsyncWebServer server(80);
 WebSocketsServer webSocket(81);
-Adafruit_SSD1306 display(128, 64, &Wire, -1);
+Adafruit_SSD1306 display(128, 64, &Wire, -1, OLED_I2C_CLOCK, OLED_I2C_CLOCK);
 DHT dht(DHT_PIN, DHT_TYPE);
 Adafruit_NeoPixel pixels(NEOPIXEL_COUNT, NEOPIXEL_PIN, NEO_GRB + NEO_KHZ800);
+Preferences preferences;
 
 // --- ROBOT STATE & CONFIGURATION ---
 struct ComponentConfig {
@@ -70,37 +109,412 @@ struct ComponentConfig {
 };
 ComponentConfig components;
 
+// Modes are codes in the state; names only appear in commands
+enum NeoPixelMode : uint8_t { NEOPIXEL_OFF, NEOPIXEL_STATIC, NEOPIXEL_RAINBOW, NEOPIXEL_MODE_COUNT };
+const char* const neopixelModeNames[] = { "off", "static", "rainbow" };
+
 struct NeoPixelState {
-  String mode = "static";
+  NeoPixelMode mode = NEOPIXEL_STATIC;
   uint8_t r = 0, g = 100, b = 255;
   uint8_t brightness = 50;
+  bool dirty = true;            // Static modes are only pushed to the strip when changed
+  unsigned long lastFrame = 0;
 };
 NeoPixelState neopixelState;
 
+// --- ALLOCATION-FREE MESSAGING ---
+// Documents built on every loop pass take their memory from this arena instead of the
+// heap. It is a bump allocator that rewinds once every block has been released, which
+// happens when the document goes out of scope. Only used from the loop task.
+#define JSON_ARENA_SIZE 4096
+#define JSON_BLOCK_HEADER 8 // Block size, padded to keep payloads 8-byte aligned
+
+class JsonArena : public ArduinoJson::Allocator {
+ public:
+  void* allocate(size_t size) override {
+    size_t total = JSON_BLOCK_HEADER + ((size + 7) & ~(size_t)7);
+    if (used + total > sizeof(buffer)) {
+      failures++;
+      return nullptr;
+    }
+    uint8_t* block = buffer + used;
+    *(uint32_t*)block = size;
+    last = used;
+    used += total;
+    live++;
+    if (used > highWater) highWater = used;
+    return block + JSON_BLOCK_HEADER;
+  }
+
+  void deallocate(void* pointer) override {
+    if (pointer == nullptr) return;
+    if (--live == 0) used = 0;
+  }
+
+  void* reallocate(void* pointer, size_t size) override {
+    if (pointer == nullptr) return allocate(size);
+    uint8_t* block = (uint8_t*)pointer - JSON_BLOCK_HEADER;
+    if (block == buffer + last) {
+      // The newest block grows or shrinks in place
+      size_t total = JSON_BLOCK_HEADER + ((size + 7) & ~(size_t)7);
+      if (last + total > sizeof(buffer)) {
+        failures++;
+        return nullptr;
+      }
+      *(uint32_t*)block = size;
+      used = last + total;
+      if (used > highWater) highWater = used;
+      return pointer;
+    }
+    void* moved = allocate(size);
+    if (moved == nullptr) return nullptr;
+    memcpy(moved, pointer, min((size_t)*(uint32_t*)block, size));
+    deallocate(pointer);
+    return moved;
+  }
+
+  size_t highWater = 0;   // Most bytes in use at once
+  uint32_t failures = 0;  // Requests that did not fit; the document reports overflowed()
+
+ private:
+  alignas(8) uint8_t buffer[JSON_ARENA_SIZE];
+  size_t used = 0;
+  size_t last = 0;
+  uint16_t live = 0;
+};
+JsonArena jsonArena;
+
+// --- OLED PIPELINE ---
+// Drawing goes to the Adafruit framebuffer; presentOLED() copies it into oled.pending and
+// wakes oledFlushTask, which owns the I2C bus. A frame presented while a flush is still in
+// flight replaces the pending one, so the loop never waits on the bus.
+#define OLED_FRAME_BYTES (128 * 64 / 8)
+#define OLED_I2C_CHUNK 64 // Data bytes per I2C transaction (the Wire buffer holds 128)
+
+struct OledPipeline {
+  uint8_t pending[OLED_FRAME_BYTES];
+  uint8_t sending[OLED_FRAME_BYTES]; // Flush task only
+  bool framePending = false;
+  SemaphoreHandle_t lock = nullptr;  // Guards pending and framePending
+  TaskHandle_t task = nullptr;
+};
+OledPipeline oled;
+
+// Outbound frames are serialized after WEBSOCKETS_MAX_HEADER_SIZE bytes of headroom so
+// broadcastTXT() writes the header in place instead of allocating a copy
+#define WS_FRAME_CAPACITY 1024
+uint8_t wsFrame[WEBSOCKETS_MAX_HEADER_SIZE + WS_FRAME_CAPACITY];
+uint32_t framesDropped = 0;
+
 unsigned long lastSensorRead = 0;
+bool motorsRunning = false;
+unsigned long buzzerOffAt = 0; // End of a timed beep, 0 = none
+volatile bool irTriggered = false;
+volatile unsigned long lastIrEdge = 0;
+
+enum PowerState : uint8_t {
+  POWER_ACTIVE,   // Motors running
+  POWER_IDLE,     // Stationary with clients connected
+  POWER_STANDBY,  // Stationary, nobody connected
+  POWER_STATE_COUNT
+};
+const char* const powerStateNames[] = { "active", "idle", "standby" };
+const uint16_t powerLatencyBound[] = { POWER_ACTIVE_LATENCY, POWER_IDLE_LATENCY, POWER_STANDBY_LATENCY };
+
+struct PowerStats {
+  PowerState state = POWER_ACTIVE;
+  unsigned long stateSince = 0;
+  unsigned long lastBusy = 0;
+  unsigned long timeIn[POWER_STATE_COUNT] = {};  // ms spent in each state
+  unsigned long sleptIn[POWER_STATE_COUNT] = {}; // ms of that spent blocked in the idle wait
+  volatile uint32_t wakeRequestedAt = 0;         // micros() of a pending wake, 0 = none
+  uint32_t wakeups = 0;
+  uint32_t wakeLatencyMax = 0;                   // us from the wake source to loop() running
+  uint64_t wakeLatencyTotal = 0;
+};
+PowerStats power;
+TaskHandle_t loopTaskHandle = nullptr;
+#ifdef CONFIG_PM_ENABLE
+esp_pm_lock_handle_t cpuMaxLock;
+#endif
 unsigned long uptime_seconds = 0;
 
+struct WifiCache {
+  uint8_t version;
+  int32_t channel;
+  uint8_t bssid[6];
+  uint32_t ip;
+  uint32_t gateway;
+  uint32_t subnet;
+  uint32_t dns;
+};
+WifiCache wifiCache;
+bool wifiFastConnect = false;
+bool wifiOnline = false;
+unsigned long wifiAttemptStarted = 0;
+
+// Sensor history: one compressed block is assembled in RAM, then appended to flash.
+// Block layout: HistoryBlockHeader, then a big-endian bitstream of samples. Per sample:
+//   timestamp - first sample raw (32 bits), then delta-of-delta: '0' = same interval,
+//               '10'+7, '110'+9, '1110'+12 bit signed, or '1111'+32 bits
+//   values    - each channel XORed with its previous value: '0' = unchanged, otherwise
+//               '1' + 5-bit (significant bits - 1) + the significant bits of the XOR
+enum HistoryChannel {
+  CH_ULTRASONIC,   // mm
+  CH_SMOKE,        // 0-100
+  CH_TEMPERATURE,  // 0.1 C
+  CH_HUMIDITY,     // 0.1 %
+  CH_LIGHT,        // 0-100
+  CH_BATTERY,      // 0-100
+  HISTORY_CHANNELS
+};
+const char* const historyChannelNames[HISTORY_CHANNELS] = {
+  "ultrasonic_mm", "smoke", "temperature_dC", "humidity_dpct", "light", "battery"
+};
+const int32_t HISTORY_MISSING = -32768; // Component disabled or reading failed
+
+struct HistorySample {
+  uint32_t timestamp; // millis() in the recording boot
+  int32_t values[HISTORY_CHANNELS];
+};
+
+struct HistoryBlockHeader {
+  uint16_t magic;
+  uint16_t count;          // Samples in the block
+  uint32_t seq;            // Monotonic block number, starts at 1
+  uint16_t bootId;         // Incremented in NVS on every boot
+  uint16_t bits;           // Payload length in bits
+  uint32_t firstTimestamp;
+  uint32_t lastTimestamp;
+};
+#define HISTORY_PAYLOAD_BITS ((HISTORY_BLOCK_SIZE - sizeof(HistoryBlockHeader)) * 8)
+#define HISTORY_SAMPLE_MAX_BITS (36 + HISTORY_CHANNELS * 38)
+
+// Decoder state, advanced one sample at a time so streaming never expands a whole block
+struct HistoryCodec {
+  uint32_t bitPos;
+  uint16_t decoded;
+  uint32_t timestamp;
+  int32_t delta;
+  int32_t values[HISTORY_CHANNELS];
+};
+
+// RAM index: one entry per flash sector, keys are (bootId << 32 | timestamp)
+struct HistorySectorIndex {
+  uint32_t seq;            // seq of the sector's first block, 0 = empty
+  uint64_t firstKey;
+  uint64_t lastKey;
+};
+
+struct HistoryStore {
+  const esp_partition_t* partition = nullptr;
+  SemaphoreHandle_t lock = nullptr;
+  uint16_t sectors = 0;
+  uint16_t blocksPerSector = HISTORY_SECTOR_SIZE / HISTORY_BLOCK_SIZE;
+  uint32_t headBlock = 0;   // Next block slot to write
+  uint32_t nextSeq = 1;
+  uint16_t bootId = 0;
+  uint32_t samplesWritten = 0;
+  HistorySectorIndex* index = nullptr;
+
+  uint8_t block[HISTORY_BLOCK_SIZE]; // Block being assembled
+  HistoryCodec writer;
+  uint32_t blockFirstTimestamp = 0;
+  unsigned long blockStarted = 0;
+};
+HistoryStore history;
+unsigned long lastHistorySample = 0;
+
+// Range query state. Walks the ring oldest-first and holds at most one block in RAM.
+struct HistoryCursor {
+  uint64_t fromKey;
+  uint64_t toKey;
+  bool raw;
+
+  uint16_t sector;
+  uint16_t sectorsLeft;
+  uint16_t blockInSector;
+  uint32_t sectorSeq;
+  bool ramBlockDone;
+  bool headerSent;
+
+  uint8_t block[HISTORY_BLOCK_SIZE];
+  HistoryBlockHeader header;
+  bool blockLoaded;
+  HistoryCodec reader;
+
+  char line[160];
+  const uint8_t* pending;
+  size_t pendingLength;
+  size_t pendingOffset;
+};
+
+// Boot phase timestamps (ms since reset)
+unsigned long bootHardwareReady = 0;
+unsigned long bootWifiConnected = 0;
+unsigned long bootFirstFrame = 0;
+
+// --- SENSOR CONVERSION TABLES ---
+// Raw readings become engineering units through lookup tables with linear interpolation,
+// a few integer operations per sample. The speed of sound, MQ-2 and discharge tables are
+// computed by the compiler from the curves below. The ADC table depends on this chip's
+// eFuse calibration, so startSensorConversion() fills it once at boot.
+#define ADC_TABLE_SHIFT 7         // 128 raw counts per segment
+#define ADC_TABLE_SIZE ((4096 >> ADC_TABLE_SHIFT) + 1)
+#define ADC_DEFAULT_VREF 1100     // mV, for chips without a Vref in eFuse
+
+#define AIR_TEMPERATURE_DEFAULT 20.0 // C, until the DHT gives a reading
+#define SOUND_TABLE_ORIGIN -200   // Tenths of a degree C
+#define SOUND_TABLE_SHIFT 5       // 3.2 C per segment
+#define SOUND_TABLE_SIZE 26       // Up to +60 C
+
+#define MQ2_SUPPLY_MV 5000.0
+#define MQ2_LOAD_KOHM 10.0        // RL on the module
+#define MQ2_R0_KOHM 10.0          // This sensor's Rs in clean air / 9.83
+#define MQ2_DIVIDER_RATIO 1.5     // AO is divided down to SMOKE_PIN (10k over 20k)
+#define MQ2_PPM_LOW 200.0         // Datasheet smoke curve: Rs/R0 = 3.4 at 200ppm...
+#define MQ2_RATIO_LOW 3.4
+#define MQ2_PPM_HIGH 10000.0      // ...and 0.6 at 10000ppm; smokeLevel is log ppm across this span
+#define MQ2_RATIO_HIGH 0.6
+#define SMOKE_TABLE_SHIFT 6       // 64mV at the pin per segment
+#define SMOKE_TABLE_SIZE 53       // Up to 3328mV
+#define SMOKE_ALARM_PPM 1000
+
+#define BATT_CELLS 2
+#define BATT_DIVIDER_RATIO 3      // Pack voltage is divided down to BATT_PIN (20k over 10k)
+#define BATT_TABLE_ORIGIN 3200    // mV per cell
+#define BATT_TABLE_SHIFT 5        // 32mV per segment
+#define BATT_TABLE_SIZE 33        // Up to 4224mV
+
+// Compile-time math for the tables (C++11 constexpr: one return statement each)
+struct ConstMath {
+  static constexpr double square(double x) { return x * x; }
+  static constexpr double sqrtStep(double x, double guess, int steps) {
+    return steps == 0 ? guess : sqrtStep(x, (guess + x / guess) / 2, steps - 1);
+  }
+  static constexpr double sqrt(double x) { return x <= 0 ? 0 : sqrtStep(x, x > 1 ? x : 1, 40); }
+  // 2 atanh(y) = ln((1 + y) / (1 - y)), with y <= 1/3 after range reduction
+  static constexpr double lnSeries(double y, double y2, int k) {
+    return k > 41 ? 0 : y / k + lnSeries(y * y2, y2, k + 2);
+  }
+  static constexpr double ln(double x) {
+    return x >= 2 ? ln(x / 2) + 0.6931471805599453
+         : x < 1 ? ln(x * 2) - 0.6931471805599453
+         : 2 * lnSeries((x - 1) / (x + 1), square((x - 1) / (x + 1)), 1);
+  }
+  static constexpr double expSeries(double x, double term, int k) {
+    return k > 24 ? term : term + expSeries(x, term * x / k, k + 1);
+  }
+  static constexpr double exp(double x) { return x > 0.5 || x < -0.5 ? square(exp(x / 2)) : expSeries(x, 1, 1); }
+  static constexpr double pow(double base, double exponent) { return exp(exponent * ln(base)); }
+  static constexpr uint16_t round(double x, double limit) {
+    return x <= 0 ? 0 : x >= limit ? (uint16_t)limit : (uint16_t)(x + 0.5);
+  }
+};
+
+// Resting voltage of a Li-ion cell against charge left, highest first
+struct DischargePoint {
+  uint16_t millivolts;
+  uint16_t percent;
+};
+constexpr DischargePoint dischargeCurve[] = {
+  { 4200, 100 }, { 4110, 90 }, { 4020, 80 }, { 3950, 70 }, { 3870, 60 }, { 3840, 50 },
+  { 3800, 40 }, { 3770, 30 }, { 3730, 20 }, { 3690, 10 }, { 3610, 5 }, { 3270, 0 }
+};
+#define DISCHARGE_POINTS (sizeof(dischargeCurve) / sizeof(dischargeCurve[0]))
+
+// Table entry i, from the physical models
+struct SensorCurves {
+  // Half the speed of sound in Q16 mm/us at SOUND_TABLE_ORIGIN + i segments
+  static constexpr uint16_t sound(uint16_t i) {
+    return ConstMath::round(0.5 * 0.3313 * ConstMath::sqrt(1 + (SOUND_TABLE_ORIGIN + (i << SOUND_TABLE_SHIFT)) / 2731.5) * 65536, 65535);
+  }
+  
+  // MQ-2: Rs from the RL divider, then ppm = PPM_LOW * (ratio / RATIO_LOW)^b through both datasheet points
+  static constexpr double mq2Exponent() {
+    return ConstMath::ln(MQ2_PPM_HIGH / MQ2_PPM_LOW) / ConstMath::ln(MQ2_RATIO_HIGH / MQ2_RATIO_LOW);
+  }
+  static constexpr double mq2PpmAtOutput(double output) {
+    return output <= 0 ? 0
+         : output >= MQ2_SUPPLY_MV ? MQ2_PPM_HIGH
+         : MQ2_PPM_LOW * ConstMath::pow(MQ2_LOAD_KOHM * (MQ2_SUPPLY_MV - output) / output / MQ2_R0_KOHM / MQ2_RATIO_LOW, mq2Exponent());
+  }
+  static constexpr double mq2Ppm(uint16_t i) { return mq2PpmAtOutput((i << SMOKE_TABLE_SHIFT) * MQ2_DIVIDER_RATIO); }
+  static constexpr uint16_t smokePpm(uint16_t i) { return ConstMath::round(mq2Ppm(i), MQ2_PPM_HIGH); }
+  // Tenths of a percent of the log span between the datasheet points
+  static constexpr uint16_t smokeLevel(uint16_t i) {
+    return mq2Ppm(i) <= MQ2_PPM_LOW ? 0 : ConstMath::round(1000 * ConstMath::ln(mq2Ppm(i) / MQ2_PPM_LOW) / ConstMath::ln(MQ2_PPM_HIGH / MQ2_PPM_LOW), 1000);
+  }
+  
+  // Tenths of a percent of charge at BATT_TABLE_ORIGIN + i segments per cell
+  static constexpr double discharge(double millivolts, size_t k) {
+    return k >= DISCHARGE_POINTS ? 0
+         : millivolts < dischargeCurve[k].millivolts ? discharge(millivolts, k + 1)
+         : k == 0 ? dischargeCurve[0].percent
+         : dischargeCurve[k].percent + (millivolts - dischargeCurve[k].millivolts) *
+             (dischargeCurve[k - 1].percent - dischargeCurve[k].percent) /
+             (dischargeCurve[k - 1].millivolts - dischargeCurve[k].millivolts);
+  }
+  static constexpr uint16_t battery(uint16_t i) {
+    return ConstMath::round(10 * discharge(BATT_TABLE_ORIGIN + (i << BATT_TABLE_SHIFT), 0), 1000);
+  }
+};
+
+template <uint16_t... I> struct TableIndices {};
+template <uint16_t N, uint16_t... I> struct MakeTableIndices : MakeTableIndices<N - 1, N - 1, I...> {};
+template <uint16_t... I> struct MakeTableIndices<0, I...> { typedef TableIndices<I...> type; };
+
+template <size_t N> struct LookupTable {
+  uint16_t values[N];
+};
+
+template <size_t N, uint16_t (*Entry)(uint16_t)> struct BuildTable {
+  template <uint16_t... I> static constexpr LookupTable<N> from(TableIndices<I...>) { return {{ Entry(I)... }}; }
+  static constexpr LookupTable<N> build() { return from(typename MakeTableIndices<N>::type()); }
+};
+
+constexpr LookupTable<SOUND_TABLE_SIZE> soundTable = BuildTable<SOUND_TABLE_SIZE, SensorCurves::sound>::build();
+constexpr LookupTable<SMOKE_TABLE_SIZE> smokePpmTable = BuildTable<SMOKE_TABLE_SIZE, SensorCurves::smokePpm>::build();
+constexpr LookupTable<SMOKE_TABLE_SIZE> smokeLevelTable = BuildTable<SMOKE_TABLE_SIZE, SensorCurves::smokeLevel>::build();
+constexpr LookupTable<BATT_TABLE_SIZE> batteryTable = BuildTable<BATT_TABLE_SIZE, SensorCurves::battery>::build();
+
+struct SensorConversion {
+  uint16_t adcMillivolts[ADC_TABLE_SIZE]; // Calibrated mV at raw = i << ADC_TABLE_SHIFT
+  uint16_t soundScale;                    // soundTable at the last DHT temperature
+};
+SensorConversion conversion;
+
 // --- FUNCTION DECLARATIONS ---
 void handleWebSocketMessage(uint8_t num, WStype_t type, uint8_t * payload, size_t length);
 void sendSensorData();
 void setMotorSpeed(int left, int right);
-void updateOLED(String text, String expression);
+void updateOLED(const char* text);
 void updateNeoPixels();
+void startWiFi();
+void wifiTick();
+void historyBegin();
+void historyAppend(const HistorySample& sample);
+void historyTick();
+void setupHistoryAPI();
+void IRAM_ATTR onIrEdge();
+void startPowerManagement();
+void powerTick();
+void idleUntilNextDeadline();
+void fillPowerReport(JsonObject report);
+void broadcastJson(const JsonDocument& doc);
+void sendTimeSync(uint8_t num, const char* id, int64_t receivedAt);
+void fillHeapReport(JsonObject report);
+void startOLEDFlush();
+void presentOLED();
+void startSensorConversion();
+void updateSoundScale(float celsius);
+uint16_t tableLookup(const uint16_t* table, size_t size, int32_t x, int32_t origin, uint8_t shift);
+uint16_t adcMillivolts(uint16_t raw);
 
 // --- SETUP ---
 void setup() {
   Serial.begin(115200);
-
-  // Initialize WiFi
-  WiFi.begin(ssid, password);
-  Serial.print("Connecting to WiFi...");
-  while (WiFi.status() != WL_CONNECTED) {
-    delay(500);
-    Serial.print(".");
-  }
-  Serial.println("\nConnected!");
-  Serial.print("IP Address: ");
-  Serial.println(WiFi.localIP());
+  startSensorConversion();
 
   // Initialize Components if enabled
   if (components.motors) {
@@ -117,13 +531,16 @@ void setup() {
   if (components.oled) {
     if(!display.begin(SSD1306_SWITCHCAPVCC, 0x3C)) { 
       Serial.println(F("SSD1306 allocation failed"));
+      components.oled = false; // Run headless
+    } else {
+      display.clearDisplay();
+      display.setTextSize(1);
+      display.setTextColor(SSD1306_WHITE);
+      display.setCursor(0,0);
+      display.println("EMU v6.0 Online!");
+      startOLEDFlush();
+      presentOLED();
     }
-    display.clearDisplay();
-    display.setTextSize(1);
-    display.setTextColor(SSD1306_WHITE);
-    display.setCursor(0,0);
-    display.println("EMU v6.0 Online!");
-    display.display();
   }
   if (components.dht) dht.begin();
   if (components.neopixel) {
@@ -131,6 +548,17 @@ void setup() {
     pixels.setBrightness(neopixelState.brightness);
     updateNeoPixels();
   }
+  if (components.irReceiver) {
+    pinMode(IR_PIN, INPUT);
+    attachInterrupt(digitalPinToInterrupt(IR_PIN), onIrEdge, CHANGE);
+  }
+  historyBegin();
+  startPowerManagement();
+  bootHardwareReady = millis();
+
+  // Initialize WiFi in the background; the loop starts without waiting for it
+  startWiFi();
+  Serial.println("Connecting to WiFi...");
 
   // WebSocket Server
   webSocket.begin();
@@ -140,90 +568,206 @@ void setup() {
   server.on("/", HTTP_GET, [](AsyncWebServerRequest *request){
     request->send(200, "text/plain", "EMU Robot is online!");
   });
+  setupHistoryAPI();
+  server.on("/power", HTTP_GET, [](AsyncWebServerRequest *request){
+    JsonDocument doc;
+    fillPowerReport(doc.to<JsonObject>());
+    String output;
+    serializeJson(doc, output);
+    request->send(200, "application/json", output);
+  });
+  // Heap and arena counters, to confirm the loop has stopped allocating
+  server.on("/heap", HTTP_GET, [](AsyncWebServerRequest *request){
+    JsonDocument doc;
+    fillHeapReport(doc.to<JsonObject>());
+    String output;
+    serializeJson(doc, output);
+    request->send(200, "application/json", output);
+  });
   server.begin();
 }
 
 // --- MAIN LOOP ---
 void loop() {
+  wifiTick();
   webSocket.loop();
   
-  // Send sensor data every 250ms
-  if (millis() - lastSensorRead > 250) {
+  // Send sensor data every 250ms, and early when the IR receiver sees activity
+  bool irReport = irTriggered && millis() - lastSensorRead >= IR_REPORT_INTERVAL;
+  if (millis() - lastSensorRead >= SENSOR_INTERVAL || irReport) {
+    irTriggered = false;
     sendSensorData();
     uptime_seconds = millis() / 1000;
     lastSensorRead = millis();
   }
+  historyTick();
 
-  // Update NeoPixels continuously for effects like rainbow
-  if (components.neopixel) {
-    updateNeoPixels();
+  if (buzzerOffAt != 0 && (long)(millis() - buzzerOffAt) >= 0) {
+    buzzerOffAt = 0;
+    digitalWrite(BUZZER_PIN, LOW);
+  }
+
+  // Redraws only on change, or at the frame rate for animated modes
+  updateNeoPixels();
+
+  powerTick();
+  idleUntilNextDeadline();
+}
+
+// --- WIFI ---
+void startWiFi() {
+  WiFi.mode(WIFI_STA);
+  WiFi.persistent(false);
+  WiFi.setAutoReconnect(true);
+
+  preferences.begin("wifi", false);
+  wifiFastConnect = preferences.getBytes("cache", &wifiCache, sizeof(wifiCache)) == sizeof(wifiCache) &&
+                    wifiCache.version == WIFI_CACHE_VERSION;
+
+  if (wifiFastConnect) {
+    // Go straight to the last AP/channel instead of scanning
+    if (WIFI_REUSE_IP) {
+      WiFi.config(IPAddress(wifiCache.ip), IPAddress(wifiCache.gateway),
+                  IPAddress(wifiCache.subnet), IPAddress(wifiCache.dns));
+    }
+    WiFi.begin(ssid, password, wifiCache.channel, wifiCache.bssid);
+  } else {
+    WiFi.begin(ssid, password);
+  }
+  wifiAttemptStarted = millis();
+}
+
+void wifiTick() {
+  bool connected = WiFi.status() == WL_CONNECTED;
+
+  if (connected && !wifiOnline) {
+    wifiOnline = true;
+    if (bootWifiConnected == 0) bootWifiConnected = millis();
+    Serial.print("Connected! IP Address: ");
+    Serial.println(WiFi.localIP());
+
+    WifiCache cache;
+    memset(&cache, 0, sizeof(cache));
+    cache.version = WIFI_CACHE_VERSION;
+    cache.channel = WiFi.channel();
+    memcpy(cache.bssid, WiFi.BSSID(), sizeof(cache.bssid));
+    cache.ip = WiFi.localIP();
+    cache.gateway = WiFi.gatewayIP();
+    cache.subnet = WiFi.subnetMask();
+    cache.dns = WiFi.dnsIP();
+    if (!wifiFastConnect || memcmp(&cache, &wifiCache, sizeof(cache)) != 0) {
+      wifiCache = cache;
+      preferences.putBytes("cache", &cache, sizeof(cache));
+    }
+  } else if (!connected && wifiOnline) {
+    wifiOnline = false;
+    Serial.println("WiFi lost, reconnecting...");
+  } else if (!connected && wifiFastConnect && millis() - wifiAttemptStarted > WIFI_FAST_CONNECT_TIMEOUT) {
+    // Stale cache: forget it and do a normal scan + DHCP
+    Serial.println("Fast connect failed, scanning...");
+    wifiFastConnect = false;
+    preferences.remove("cache");
+    WiFi.disconnect();
+    WiFi.config(INADDR_NONE, INADDR_NONE, INADDR_NONE);
+    WiFi.begin(ssid, password);
+    wifiAttemptStarted = millis();
   }
 }
 
 // --- WEBSOCKET HANDLER ---
+// Only these keys are kept when parsing a command, so unexpected fields cost nothing
+JsonDocument& commandFilter() {
+  static JsonDocument filter;
+  if (filter.isNull()) {
+    filter["type"] = true;
+    filter["id"] = true;
+    JsonObject data = filter["data"].to<JsonObject>();
+    const char* const keys[] = {
+      "action", "direction", "state", "duration", "text", "expression",
+      "component", "enabled", "mode", "brightness", "color"
+    };
+    for (const char* key : keys) data[key] = true;
+  }
+  return filter;
+}
+
 void handleWebSocketMessage(uint8_t num, WStype_t type, uint8_t * payload, size_t length) {
   if (type == WStype_TEXT) {
-    JsonDocument doc;
-    deserializeJson(doc, payload, length);
+    int64_t receivedAt = esp_timer_get_time();
+    JsonDocument doc(&jsonArena);
+    DeserializationError error = deserializeJson(doc, payload, length, DeserializationOption::Filter(commandFilter()));
+    if (error) {
+      Serial.print(F("Bad command JSON: "));
+      Serial.println(error.c_str());
+      return;
+    }
 
-    String messageType = doc["type"];
-    if (messageType == "command") {
+    const char* messageType = doc["type"] | "";
+    if (strcmp(messageType, "command") == 0) {
       JsonObject data = doc["data"];
-      String action = data["action"];
-
-      if (action == "move") {
-        String dir = data["direction"];
-        if (dir == "forward") setMotorSpeed(255, 255);
-        else if (dir == "backward") setMotorSpeed(-255, -255);
-        else if (dir == "left") setMotorSpeed(-200, 200);
-        else if (dir == "right") setMotorSpeed(200, -200);
-        else if (dir == "stop") setMotorSpeed(0, 0);
+      const char* action = data["action"] | "";
+
+      if (strcmp(action, "move") == 0) {
+        const char* dir = data["direction"] | "stop";
+        if (strcmp(dir, "forward") == 0) setMotorSpeed(255, 255);
+        else if (strcmp(dir, "backward") == 0) setMotorSpeed(-255, -255);
+        else if (strcmp(dir, "left") == 0) setMotorSpeed(-200, 200);
+        else if (strcmp(dir, "right") == 0) setMotorSpeed(200, -200);
+        else if (strcmp(dir, "stop") == 0) setMotorSpeed(0, 0);
       } 
-      else if (action == "buzzer" && components.buzzer) {
+      else if (strcmp(action, "buzzer") == 0 && components.buzzer) {
         bool state = data["state"];
         digitalWrite(BUZZER_PIN, state);
-        if (data.containsKey("duration")) {
-          delay(data["duration"]);
-          digitalWrite(BUZZER_PIN, LOW);
-        }
+        // Timed beeps end in loop() instead of blocking it
+        buzzerOffAt = state && data.containsKey("duration") ? millis() + (unsigned long)data["duration"] : 0;
       }
-      else if (action == "oled" && components.oled) {
-        updateOLED(data["text"], "");
+      else if (strcmp(action, "oled") == 0 && components.oled) {
+        updateOLED(data["text"] | "");
       }
-      else if (action == "expression" && components.oled) {
-        updateOLED("", data["expression"]);
+      else if (strcmp(action, "expression") == 0 && components.oled) {
+        updateOLED(""); // Expressions are not drawn by this firmware yet
       }
-      else if (action == "toggle_component") {
-        String comp = data["component"];
+      else if (strcmp(action, "toggle_component") == 0) {
+        const char* comp = data["component"] | "";
         bool enabled = data["enabled"];
-        if (comp == "motors") components.motors = enabled;
-        else if (comp == "buzzer") components.buzzer = enabled;
+        if (strcmp(comp, "motors") == 0) components.motors = enabled;
+        else if (strcmp(comp, "buzzer") == 0) components.buzzer = enabled;
         // ... and so on for all components
       }
-      else if (action == "neopixel" && components.neopixel) {
-        if (data.containsKey("mode")) neopixelState.mode = data["mode"].as<String>();
+      else if (strcmp(action, "neopixel") == 0 && components.neopixel) {
+        const char* mode = data["mode"] | "";
+        for (uint8_t i = 0; i < NEOPIXEL_MODE_COUNT; i++) {
+          if (strcmp(mode, neopixelModeNames[i]) == 0) neopixelState.mode = (NeoPixelMode)i;
+        }
         if (data.containsKey("brightness")) {
           neopixelState.brightness = data["brightness"];
           pixels.setBrightness(neopixelState.brightness);
         }
         if (data.containsKey("color")) {
-          const char* hexColor = data["color"];
+          const char* hexColor = data["color"] | "#000000";
           long number = strtol(&hexColor[1], NULL, 16);
           neopixelState.r = (number >> 16) & 0xFF;
           neopixelState.g = (number >> 8) & 0xFF;
           neopixelState.b = number & 0xFF;
         }
+        neopixelState.dirty = true;
       }
+    } else if (strcmp(messageType, "time_sync") == 0) {
+      sendTimeSync(num, doc["id"] | "", receivedAt);
     }
   }
 }
 
 // --- SENSOR DATA SENDER ---
 void sendSensorData() {
-  JsonDocument doc;
+  JsonDocument doc(&jsonArena);
   doc["type"] = "sensor_data";
   JsonObject data = doc.createNestedObject("data");
 
+  HistorySample sample;
+  sample.timestamp = millis();
+  for (int32_t& value : sample.values) value = HISTORY_MISSING;
+
   // Read from sensors only if enabled
   if (components.ultrasonic) {
     digitalWrite(TRIG_PIN, LOW);
@@ -231,73 +775,756 @@ void sendSensorData() {
     digitalWrite(TRIG_PIN, HIGH);
     delayMicroseconds(10);
     digitalWrite(TRIG_PIN, LOW);
-    long duration = pulseIn(ECHO_PIN, HIGH);
-    data["ultrasonic"] = duration * 0.034 / 2;
+    long duration = pulseIn(ECHO_PIN, HIGH, 30000); // A missing echo must not stall the loop for 1s
+    uint32_t millimetres = ((uint32_t)duration * conversion.soundScale) >> 16;
+    data["ultrasonic"] = millimetres / 10.0f;
+    if (duration != 0) sample.values[CH_ULTRASONIC] = millimetres; // No echo stays HISTORY_MISSING
   }
   if (components.smoke) {
-    int smokeValue = analogRead(SMOKE_PIN);
-    data["smokeLevel"] = map(smokeValue, 0, 4095, 0, 100);
-    data["smoke"] = smokeValue > 1500; // Example threshold
+    uint16_t millivolts = adcMillivolts(analogRead(SMOKE_PIN));
+    uint16_t ppm = tableLookup(smokePpmTable.values, SMOKE_TABLE_SIZE, millivolts, 0, SMOKE_TABLE_SHIFT);
+    uint16_t level = tableLookup(smokeLevelTable.values, SMOKE_TABLE_SIZE, millivolts, 0, SMOKE_TABLE_SHIFT);
+    data["smokeLevel"] = level / 10.0f;
+    data["smokePpm"] = ppm;
+    data["smoke"] = ppm >= SMOKE_ALARM_PPM;
+    sample.values[CH_SMOKE] = level / 10;
   }
   if (components.dht) {
-    data["temperature"] = dht.readTemperature();
-    data["humidity"] = dht.readHumidity();
+    float temperature = dht.readTemperature();
+    float humidity = dht.readHumidity();
+    data["temperature"] = temperature;
+    data["humidity"] = humidity;
+    if (!isnan(temperature)) {
+      sample.values[CH_TEMPERATURE] = lroundf(temperature * 10);
+      updateSoundScale(temperature); // Used from the next ping on
+    }
+    if (!isnan(humidity)) sample.values[CH_HUMIDITY] = lroundf(humidity * 10);
   }
   if (components.ldr) {
     data["lightLevel"] = map(analogRead(LDR_PIN), 0, 4095, 0, 100);
+    sample.values[CH_LIGHT] = data["lightLevel"];
   }
   
-  data["battery"] = map(analogRead(BATT_PIN), 0, 4095, 0, 100); // Simple mapping
-  data["timestamp"] = millis();
+  if (components.irReceiver) {
+    data["ir"] = millis() - lastIrEdge < SENSOR_INTERVAL; // Recent receiver activity
+  }
+  
+  uint16_t batteryMillivolts = adcMillivolts(analogRead(BATT_PIN)) * BATT_DIVIDER_RATIO;
+  uint16_t battery = tableLookup(batteryTable.values, BATT_TABLE_SIZE, batteryMillivolts / BATT_CELLS,
+                                 BATT_TABLE_ORIGIN, BATT_TABLE_SHIFT) / 10;
+  data["battery"] = battery;
+  data["batteryMv"] = batteryMillivolts;
+  sample.values[CH_BATTERY] = battery;
+  data["timestamp"] = sample.timestamp;
   
-  String output;
-  serializeJson(doc, output);
-  webSocket.broadcastTXT(output);
+  broadcastJson(doc);
+
+  // History is recorded whether or not anyone is listening, so outages leave no gaps
+  if (sample.timestamp - lastHistorySample >= HISTORY_INTERVAL) {
+    lastHistorySample = sample.timestamp;
+    historyAppend(sample);
+  }
+
+  if (bootFirstFrame == 0 && webSocket.connectedClients() > 0) {
+    bootFirstFrame = millis();
+    Serial.printf("Boot: hardware %lums, WiFi %lums (%s), first frame %lums\n", bootHardwareReady,
+                  bootWifiConnected, wifiFastConnect ? "fast" : "scan", bootFirstFrame);
+  }
+}
+
+// --- SENSOR CONVERSION ---
+void startSensorConversion() {
+  // analogRead() runs ADC1 at 12 bits and 11dB
+  esp_adc_cal_characteristics_t characteristics;
+  esp_adc_cal_characterize(ADC_UNIT_1, ADC_ATTEN_DB_11, ADC_WIDTH_BIT_12, ADC_DEFAULT_VREF, &characteristics);
+  for (uint16_t i = 0; i < ADC_TABLE_SIZE; i++) {
+    uint32_t raw = min((uint32_t)i << ADC_TABLE_SHIFT, (uint32_t)4095);
+    conversion.adcMillivolts[i] = esp_adc_cal_raw_to_voltage(raw, &characteristics);
+  }
+  updateSoundScale(AIR_TEMPERATURE_DEFAULT);
+}
+
+void updateSoundScale(float celsius) {
+  conversion.soundScale = tableLookup(soundTable.values, SOUND_TABLE_SIZE, lroundf(celsius * 10),
+                                      SOUND_TABLE_ORIGIN, SOUND_TABLE_SHIFT);
+}
+
+// Linear interpolation in a table sampled every 1 << shift units from origin, clamped at both ends
+uint16_t tableLookup(const uint16_t* table, size_t size, int32_t x, int32_t origin, uint8_t shift) {
+  if (x <= origin) return table[0];
+  uint32_t offset = x - origin;
+  size_t i = offset >> shift;
+  if (i >= size - 1) return table[size - 1];
+  int32_t fraction = offset & ((1 << shift) - 1);
+  return table[i] + (((int32_t)table[i + 1] - table[i]) * fraction >> shift);
+}
+
+uint16_t adcMillivolts(uint16_t raw) {
+  return tableLookup(conversion.adcMillivolts, ADC_TABLE_SIZE, raw, 0, ADC_TABLE_SHIFT);
+}
+
+// --- SENSOR HISTORY ---
+uint64_t historyKey(uint16_t bootId, uint32_t timestamp) {
+  return ((uint64_t)bootId << 32) | timestamp;
+}
+
+uint32_t historyTotalBlocks() {
+  return (uint32_t)history.sectors * history.blocksPerSector;
+}
+
+void putBits(uint8_t* payload, uint32_t& bitPos, uint32_t value, uint8_t count) {
+  for (int8_t i = count - 1; i >= 0; i--) {
+    if ((value >> i) & 1) payload[bitPos >> 3] |= 0x80 >> (bitPos & 7);
+    bitPos++;
+  }
+}
+
+uint32_t getBits(const uint8_t* payload, uint32_t& bitPos, uint8_t count) {
+  uint32_t value = 0;
+  for (uint8_t i = 0; i < count; i++) {
+    value = (value << 1) | ((payload[bitPos >> 3] >> (7 - (bitPos & 7))) & 1);
+    bitPos++;
+  }
+  return value;
+}
+
+int32_t signExtend(uint32_t value, uint8_t bits) {
+  return (int32_t)(value << (32 - bits)) >> (32 - bits);
+}
+
+void encodeSample(uint8_t* payload, HistoryCodec& codec, const HistorySample& sample) {
+  if (codec.decoded == 0) {
+    putBits(payload, codec.bitPos, sample.timestamp, 32);
+  } else {
+    int32_t delta = sample.timestamp - codec.timestamp;
+    int32_t dod = delta - codec.delta;
+    if (dod == 0) {
+      putBits(payload, codec.bitPos, 0b0, 1);
+    } else if (dod >= -64 && dod <= 63) {
+      putBits(payload, codec.bitPos, 0b10, 2);
+      putBits(payload, codec.bitPos, dod, 7);
+    } else if (dod >= -256 && dod <= 255) {
+      putBits(payload, codec.bitPos, 0b110, 3);
+      putBits(payload, codec.bitPos, dod, 9);
+    } else if (dod >= -2048 && dod <= 2047) {
+      putBits(payload, codec.bitPos, 0b1110, 4);
+      putBits(payload, codec.bitPos, dod, 12);
+    } else {
+      putBits(payload, codec.bitPos, 0b1111, 4);
+      putBits(payload, codec.bitPos, dod, 32);
+    }
+    codec.delta = delta;
+  }
+  codec.timestamp = sample.timestamp;
+
+  for (uint8_t c = 0; c < HISTORY_CHANNELS; c++) {
+    uint32_t diff = sample.values[c] ^ codec.values[c];
+    if (diff == 0) {
+      putBits(payload, codec.bitPos, 0, 1);
+    } else {
+      uint8_t significant = 32 - __builtin_clz(diff);
+      putBits(payload, codec.bitPos, 1, 1);
+      putBits(payload, codec.bitPos, significant - 1, 5);
+      putBits(payload, codec.bitPos, diff, significant);
+    }
+    codec.values[c] = sample.values[c];
+  }
+  codec.decoded++;
+}
+
+bool decodeSample(const uint8_t* payload, const HistoryBlockHeader& header, HistoryCodec& codec, HistorySample& sample) {
+  if (codec.decoded >= header.count || codec.bitPos >= header.bits) return false;
+
+  if (codec.decoded == 0) {
+    codec.timestamp = getBits(payload, codec.bitPos, 32);
+  } else {
+    int32_t dod;
+    if (!getBits(payload, codec.bitPos, 1)) dod = 0;
+    else if (!getBits(payload, codec.bitPos, 1)) dod = signExtend(getBits(payload, codec.bitPos, 7), 7);
+    else if (!getBits(payload, codec.bitPos, 1)) dod = signExtend(getBits(payload, codec.bitPos, 9), 9);
+    else if (!getBits(payload, codec.bitPos, 1)) dod = signExtend(getBits(payload, codec.bitPos, 12), 12);
+    else dod = (int32_t)getBits(payload, codec.bitPos, 32);
+    codec.delta += dod;
+    codec.timestamp += codec.delta;
+  }
+
+  for (uint8_t c = 0; c < HISTORY_CHANNELS; c++) {
+    if (getBits(payload, codec.bitPos, 1)) {
+      uint8_t significant = getBits(payload, codec.bitPos, 5) + 1;
+      codec.values[c] ^= getBits(payload, codec.bitPos, significant);
+    }
+  }
+  codec.decoded++;
+
+  sample.timestamp = codec.timestamp;
+  memcpy(sample.values, codec.values, sizeof(sample.values));
+  return true;
+}
+
+void historyResetBlock() {
+  memset(history.block, 0, sizeof(history.block));
+  memset(&history.writer, 0, sizeof(history.writer));
+}
+
+void historyFillHeader(HistoryBlockHeader& header) {
+  header.magic = HISTORY_MAGIC;
+  header.count = history.writer.decoded;
+  header.seq = history.nextSeq;
+  header.bootId = history.bootId;
+  header.bits = history.writer.bitPos;
+  header.firstTimestamp = history.blockFirstTimestamp;
+  header.lastTimestamp = history.writer.timestamp;
+}
+
+void historyBegin() {
+  history.partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, "history");
+  if (!history.partition) {
+    history.partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_DATA_SPIFFS, NULL);
+  }
+  if (!history.partition) {
+    Serial.println(F("History: no data partition, recording disabled"));
+    return;
+  }
+
+  history.sectors = min((uint32_t)(history.partition->size / HISTORY_SECTOR_SIZE), (uint32_t)HISTORY_MAX_SECTORS);
+  history.index = (HistorySectorIndex*)calloc(history.sectors, sizeof(HistorySectorIndex));
+  history.lock = xSemaphoreCreateMutex();
+  if (!history.index || !history.lock || history.sectors == 0) {
+    Serial.println(F("History: out of memory, recording disabled"));
+    history.partition = nullptr;
+    return;
+  }
+
+  Preferences historyPrefs;
+  historyPrefs.begin("history", false);
+  history.bootId = historyPrefs.getUShort("boot", 0) + 1;
+  historyPrefs.putUShort("boot", history.bootId);
+  historyPrefs.end();
+
+  // Rebuild the index from block headers; the newest block tells us where to resume.
+  // Blocks within a sector are written in order after an erase, so the first blank ends it.
+  uint32_t newestSeq = 0;
+  for (uint16_t sector = 0; sector < history.sectors; sector++) {
+    HistorySectorIndex& entry = history.index[sector];
+    for (uint16_t b = 0; b < history.blocksPerSector; b++) {
+      uint32_t slot = (uint32_t)sector * history.blocksPerSector + b;
+      HistoryBlockHeader header;
+      if (esp_partition_read(history.partition, slot * HISTORY_BLOCK_SIZE, &header, sizeof(header)) != ESP_OK ||
+          header.magic != HISTORY_MAGIC) break;
+      if (b == 0) {
+        entry.seq = header.seq;
+        entry.firstKey = historyKey(header.bootId, header.firstTimestamp);
+      }
+      entry.lastKey = historyKey(header.bootId, header.lastTimestamp);
+      if (header.seq > newestSeq) {
+        newestSeq = header.seq;
+        history.headBlock = (slot + 1) % historyTotalBlocks();
+      }
+    }
+  }
+  history.nextSeq = newestSeq + 1;
+  historyResetBlock();
+
+  Serial.printf("History: %s, %u sectors, boot %u, resuming at block %lu\n", history.partition->label,
+                history.sectors, history.bootId, (unsigned long)history.headBlock);
+}
+
+// Writes the RAM block to the next flash slot. Caller holds history.lock.
+void historySeal() {
+  HistoryBlockHeader header;
+  historyFillHeader(header);
+  memcpy(history.block, &header, sizeof(header));
+
+  uint32_t slot = history.headBlock;
+  uint16_t sector = slot / history.blocksPerSector;
+  HistorySectorIndex& entry = history.index[sector];
+  if (slot % history.blocksPerSector == 0) {
+    // Entering a sector: erase it (the oldest data in the ring). Each sector is erased once
+    // per lap, which spreads wear evenly across the partition.
+    esp_partition_erase_range(history.partition, (size_t)sector * HISTORY_SECTOR_SIZE, HISTORY_SECTOR_SIZE);
+    entry.seq = header.seq;
+    entry.firstKey = historyKey(header.bootId, header.firstTimestamp);
+  }
+  esp_partition_write(history.partition, slot * HISTORY_BLOCK_SIZE, history.block, HISTORY_BLOCK_SIZE);
+  entry.lastKey = historyKey(header.bootId, header.lastTimestamp);
+
+  history.headBlock = (slot + 1) % historyTotalBlocks();
+  history.nextSeq++;
+  historyResetBlock();
+}
+
+void historyAppend(const HistorySample& sample) {
+  if (!history.partition) return;
+  xSemaphoreTake(history.lock, portMAX_DELAY);
+
+  if (history.writer.decoded > 0 && history.writer.bitPos + HISTORY_SAMPLE_MAX_BITS > HISTORY_PAYLOAD_BITS) {
+    historySeal();
+  }
+  if (history.writer.decoded == 0) {
+    history.blockFirstTimestamp = sample.timestamp;
+    history.blockStarted = millis();
+  }
+  encodeSample(history.block + sizeof(HistoryBlockHeader), history.writer, sample);
+  history.samplesWritten++;
+
+  xSemaphoreGive(history.lock);
+}
+
+// Bounds how much history a reset can lose
+void historyTick() {
+  if (!history.partition || history.writer.decoded == 0) return;
+  if (millis() - history.blockStarted < HISTORY_FLUSH_INTERVAL) return;
+
+  xSemaphoreTake(history.lock, portMAX_DELAY);
+  if (history.writer.decoded > 0) historySeal();
+  xSemaphoreGive(history.lock);
+}
+
+void historyNextSector(HistoryCursor& cursor) {
+  cursor.sector = (cursor.sector + 1) % history.sectors;
+  cursor.blockInSector = 0;
+  cursor.sectorsLeft--;
+}
+
+bool historyBlockInRange(const HistoryCursor& cursor, const HistoryBlockHeader& header) {
+  return historyKey(header.bootId, header.lastTimestamp) >= cursor.fromKey &&
+         historyKey(header.bootId, header.firstTimestamp) <= cursor.toKey;
+}
+
+// Loads the next block overlapping the range: flash blocks first, then the one in RAM
+bool historyLoadBlock(HistoryCursor& cursor) {
+  cursor.blockLoaded = false;
+  xSemaphoreTake(history.lock, portMAX_DELAY);
+
+  while (cursor.sectorsLeft > 0) {
+    const HistorySectorIndex& entry = history.index[cursor.sector];
+    if (cursor.blockInSector == 0) {
+      cursor.sectorSeq = entry.seq;
+      if (entry.seq == 0 || entry.lastKey < cursor.fromKey || entry.firstKey > cursor.toKey) {
+        historyNextSector(cursor);
+        continue;
+      }
+    } else if (entry.seq != cursor.sectorSeq || cursor.blockInSector >= history.blocksPerSector) {
+      // Sector finished, or recycled while we were streaming it
+      historyNextSector(cursor);
+      continue;
+    }
+
+    uint32_t slot = (uint32_t)cursor.sector * history.blocksPerSector + cursor.blockInSector++;
+    if (esp_partition_read(history.partition, slot * HISTORY_BLOCK_SIZE, cursor.block, HISTORY_BLOCK_SIZE) != ESP_OK) {
+      historyNextSector(cursor);
+      continue;
+    }
+    memcpy(&cursor.header, cursor.block, sizeof(cursor.header));
+    if (cursor.header.magic != HISTORY_MAGIC) {
+      historyNextSector(cursor);
+      continue;
+    }
+    if (historyBlockInRange(cursor, cursor.header)) {
+      cursor.blockLoaded = true;
+      break;
+    }
+  }
+
+  if (!cursor.blockLoaded && !cursor.ramBlockDone) {
+    cursor.ramBlockDone = true;
+    if (history.writer.decoded > 0) {
+      memcpy(cursor.block, history.block, HISTORY_BLOCK_SIZE);
+      historyFillHeader(cursor.header);
+      memcpy(cursor.block, &cursor.header, sizeof(cursor.header));
+      cursor.blockLoaded = historyBlockInRange(cursor, cursor.header);
+    }
+  }
+
+  xSemaphoreGive(history.lock);
+  memset(&cursor.reader, 0, sizeof(cursor.reader));
+  return cursor.blockLoaded;
+}
+
+// Chunked response filler: emits CSV rows (or raw blocks) until the buffer is full
+size_t historyFill(HistoryCursor& cursor, uint8_t* buffer, size_t maxLen) {
+  size_t written = 0;
+  while (written < maxLen) {
+    if (cursor.pendingOffset < cursor.pendingLength) {
+      size_t count = min(maxLen - written, cursor.pendingLength - cursor.pendingOffset);
+      memcpy(buffer + written, cursor.pending + cursor.pendingOffset, count);
+      cursor.pendingOffset += count;
+      written += count;
+      continue;
+    }
+    cursor.pendingOffset = 0;
+    cursor.pendingLength = 0;
+
+    if (cursor.raw) {
+      if (!historyLoadBlock(cursor)) break;
+      cursor.pending = cursor.block;
+      cursor.pendingLength = HISTORY_BLOCK_SIZE;
+      continue;
+    }
+
+    if (!cursor.headerSent) {
+      cursor.headerSent = true;
+      int length = snprintf(cursor.line, sizeof(cursor.line), "boot,timestamp");
+      for (const char* name : historyChannelNames) {
+        length += snprintf(cursor.line + length, sizeof(cursor.line) - length, ",%s", name);
+      }
+      length += snprintf(cursor.line + length, sizeof(cursor.line) - length, "\n");
+      cursor.pending = (const uint8_t*)cursor.line;
+      cursor.pendingLength = length;
+      continue;
+    }
+
+    HistorySample sample;
+    if (!cursor.blockLoaded ||
+        !decodeSample(cursor.block + sizeof(HistoryBlockHeader), cursor.header, cursor.reader, sample)) {
+      if (!historyLoadBlock(cursor)) break;
+      continue;
+    }
+    uint64_t key = historyKey(cursor.header.bootId, sample.timestamp);
+    if (key < cursor.fromKey || key > cursor.toKey) continue;
+
+    int length = snprintf(cursor.line, sizeof(cursor.line), "%u,%lu", cursor.header.bootId,
+                          (unsigned long)sample.timestamp);
+    for (int32_t value : sample.values) {
+      if (value == HISTORY_MISSING) length += snprintf(cursor.line + length, sizeof(cursor.line) - length, ",");
+      else length += snprintf(cursor.line + length, sizeof(cursor.line) - length, ",%ld", (long)value);
+    }
+    length += snprintf(cursor.line + length, sizeof(cursor.line) - length, "\n");
+    cursor.pending = (const uint8_t*)cursor.line;
+    cursor.pendingLength = length;
+  }
+  return written;
+}
+
+void setupHistoryAPI() {
+  // Registered before /history, whose handler would also match /history/*
+  server.on("/history/info", HTTP_GET, [](AsyncWebServerRequest *request){
+    JsonDocument doc;
+    doc["enabled"] = history.partition != nullptr;
+    if (history.partition) {
+      xSemaphoreTake(history.lock, portMAX_DELAY);
+      doc["partition"] = history.partition->label;
+      doc["bytes"] = (uint32_t)history.sectors * HISTORY_SECTOR_SIZE;
+      doc["blockSize"] = HISTORY_BLOCK_SIZE;
+      doc["blocksWritten"] = history.nextSeq - 1;
+      doc["bootId"] = history.bootId;
+      doc["samplesThisBoot"] = history.samplesWritten;
+      doc["pendingSamples"] = history.writer.decoded;
+      doc["intervalMs"] = HISTORY_INTERVAL;
+
+      const HistorySectorIndex* oldest = nullptr;
+      const HistorySectorIndex* newest = nullptr;
+      for (uint16_t i = 0; i < history.sectors; i++) {
+        const HistorySectorIndex& entry = history.index[i];
+        if (entry.seq == 0) continue;
+        if (!oldest || entry.seq < oldest->seq) oldest = &entry;
+        if (!newest || entry.seq > newest->seq) newest = &entry;
+      }
+      if (oldest) {
+        doc["oldest"]["boot"] = (uint16_t)(oldest->firstKey >> 32);
+        doc["oldest"]["timestamp"] = (uint32_t)oldest->firstKey;
+        doc["newest"]["boot"] = (uint16_t)(newest->lastKey >> 32);
+        doc["newest"]["timestamp"] = (uint32_t)newest->lastKey;
+      }
+      xSemaphoreGive(history.lock);
+    }
+    String output;
+    serializeJson(doc, output);
+    request->send(200, "application/json", output);
+  });
+
+  // GET /history?from=<ms>&to=<ms>&boot=<id>&format=csv|raw
+  // from/to are millis() timestamps as sent in sensor_data; boot defaults to the current one.
+  // format=raw streams the compressed blocks verbatim (layout documented at HistoryBlockHeader).
+  server.on("/history", HTTP_GET, [](AsyncWebServerRequest *request){
+    if (!history.partition) {
+      request->send(503, "text/plain", "History unavailable");
+      return;
+    }
+
+    std::shared_ptr<HistoryCursor> cursor(new (std::nothrow) HistoryCursor());
+    if (!cursor) {
+      request->send(503, "text/plain", "Out of memory");
+      return;
+    }
+    uint16_t boot = request->hasParam("boot") ? request->getParam("boot")->value().toInt() : history.bootId;
+    uint32_t from = request->hasParam("from") ? strtoul(request->getParam("from")->value().c_str(), NULL, 10) : 0;
+    uint32_t to = request->hasParam("to") ? strtoul(request->getParam("to")->value().c_str(), NULL, 10) : UINT32_MAX;
+    cursor->fromKey = historyKey(boot, from);
+    cursor->toKey = historyKey(boot, to);
+    cursor->raw = request->hasParam("format") && request->getParam("format")->value() == "raw";
+
+    // Oldest sector first: the one holding the head slot is oldest only if nothing was written to it yet
+    xSemaphoreTake(history.lock, portMAX_DELAY);
+    uint16_t headSector = history.headBlock / history.blocksPerSector;
+    bool headSectorStarted = history.headBlock % history.blocksPerSector != 0;
+    xSemaphoreGive(history.lock);
+    cursor->sector = (headSector + (headSectorStarted ? 1 : 0)) % history.sectors;
+    cursor->sectorsLeft = history.sectors;
+
+    AsyncWebServerResponse *response = request->beginChunkedResponse(
+      cursor->raw ? "application/octet-stream" : "text/csv",
+      [cursor](uint8_t *buffer, size_t maxLen, size_t index) -> size_t {
+        return historyFill(*cursor, buffer, maxLen);
+      });
+    request->send(response);
+  });
 }
 
 // --- ACTUATOR FUNCTIONS ---
 void setMotorSpeed(int left, int right) {
   if (!components.motors) return;
-  // Left Motor
+  // Left Motor (0 = both inputs low, coasting stop)
   if (left > 0) {
     digitalWrite(MOTOR_L_IN1, HIGH);
     digitalWrite(MOTOR_L_IN2, LOW);
-  } else {
+  } else if (left < 0) {
     digitalWrite(MOTOR_L_IN1, LOW);
     digitalWrite(MOTOR_L_IN2, HIGH);
+  } else {
+    digitalWrite(MOTOR_L_IN1, LOW);
+    digitalWrite(MOTOR_L_IN2, LOW);
   }
   // Right Motor
   if (right > 0) {
     digitalWrite(MOTOR_R_IN3, HIGH);
     digitalWrite(MOTOR_R_IN4, LOW);
-  } else {
+  } else if (right < 0) {
     digitalWrite(MOTOR_R_IN3, LOW);
     digitalWrite(MOTOR_R_IN4, HIGH);
+  } else {
+    digitalWrite(MOTOR_R_IN3, LOW);
+    digitalWrite(MOTOR_R_IN4, LOW);
   }
+  motorsRunning = left != 0 || right != 0;
 }
 
-void updateOLED(String text, String expression) {
+void updateOLED(const char* text) {
   if (!components.oled) return;
   display.clearDisplay();
   // Drawing expressions would go here...
   display.setCursor(0, 30);
   display.println(text);
-  display.display();
+  presentOLED();
 }
 
 void updateNeoPixels() {
   if (!components.neopixel) return;
+  bool animated = neopixelState.mode == NEOPIXEL_RAINBOW;
+  if (!neopixelState.dirty && !(animated && millis() - neopixelState.lastFrame >= NEOPIXEL_FRAME_INTERVAL)) return;
+  neopixelState.dirty = false;
+  neopixelState.lastFrame = millis();
   
-  if (neopixelState.mode == "off") {
+  if (neopixelState.mode == NEOPIXEL_OFF) {
     pixels.clear();
-  } else if (neopixelState.mode == "static") {
+  } else if (neopixelState.mode == NEOPIXEL_STATIC) {
     for(int i=0; i<NEOPIXEL_COUNT; i++) {
       pixels.setPixelColor(i, pixels.Color(neopixelState.r, neopixelState.g, neopixelState.b));
     }
-  } else if (neopixelState.mode == "rainbow") {
+  } else if (animated) {
     for(int i=0; i<NEOPIXEL_COUNT; i++) {
-      pixels.setPixelColor(i, pixels.gamma32(pixels.ColorHSV((i * 65536 / NEOPIXEL_COUNT) + (millis() * 10)) & 0xFFFF, 255, 255)));
+      uint16_t hue = (i * 65536 / NEOPIXEL_COUNT) + (millis() * 10);
+      pixels.setPixelColor(i, pixels.gamma32(pixels.ColorHSV(hue, 255, 255)));
     }
   }
   pixels.show();
 }
+
+// --- POWER MANAGEMENT ---
+// IR receiver edges wake loop() at once instead of waiting out the current sleep
+void IRAM_ATTR onIrEdge() {
+  lastIrEdge = millis();
+  irTriggered = true;
+  power.wakeRequestedAt = micros() | 1; // Never 0, which means "none pending"
+  BaseType_t woken = pdFALSE;
+  if (loopTaskHandle != nullptr) vTaskNotifyGiveFromISR(loopTaskHandle, &woken);
+  portYIELD_FROM_ISR(woken);
+}
+
+void startPowerManagement() {
+  loopTaskHandle = xTaskGetCurrentTaskHandle(); // setup() runs on the loop task
+  power.stateSince = millis();
+
+#ifdef CONFIG_PM_ENABLE
+  esp_pm_config_esp32_t config = {};
+  config.max_freq_mhz = POWER_CPU_ACTIVE;
+  config.min_freq_mhz = POWER_CPU_IDLE;
+  config.light_sleep_enable = true;
+  esp_pm_configure(&config);
+  esp_pm_lock_create(ESP_PM_CPU_FREQ_MAX, 0, "active", &cpuMaxLock);
+  esp_pm_lock_acquire(cpuMaxLock);
+#else
+  setCpuFrequencyMhz(POWER_CPU_ACTIVE);
+#endif
+}
+
+void setPowerState(PowerState state) {
+  if (state == power.state) return;
+  unsigned long now = millis();
+  power.timeIn[power.state] += now - power.stateSince;
+  power.stateSince = now;
+  bool wasActive = power.state == POWER_ACTIVE;
+  power.state = state;
+
+  if (state == POWER_ACTIVE) {
+#ifdef CONFIG_PM_ENABLE
+    esp_pm_lock_acquire(cpuMaxLock);
+#else
+    setCpuFrequencyMhz(POWER_CPU_ACTIVE);
+#endif
+    WiFi.setSleep(false);
+  } else if (wasActive) {
+#ifdef CONFIG_PM_ENABLE
+    esp_pm_lock_release(cpuMaxLock);
+#else
+    setCpuFrequencyMhz(POWER_CPU_IDLE);
+#endif
+    WiFi.setSleep(true); // Modem sleep: the radio wakes for DTIM beacons only
+  }
+}
+
+void powerTick() {
+  unsigned long now = millis();
+  if (motorsRunning) power.lastBusy = now;
+
+  if (now - power.lastBusy < POWER_ACTIVE_HOLD) {
+    setPowerState(POWER_ACTIVE);
+  } else if (webSocket.connectedClients() > 0) {
+    setPowerState(POWER_IDLE);
+  } else {
+    setPowerState(POWER_STANDBY);
+  }
+}
+
+// Earliest moment loop() has work to do, capped by the current state's latency bound
+unsigned long nextDeadline(unsigned long now) {
+  unsigned long deadline = now + powerLatencyBound[power.state];
+  auto consider = [&deadline](unsigned long at) {
+    if ((long)(at - deadline) < 0) deadline = at;
+  };
+
+  consider(lastSensorRead + SENSOR_INTERVAL);
+  if (buzzerOffAt != 0) consider(buzzerOffAt);
+  if (components.neopixel && neopixelState.mode == NEOPIXEL_RAINBOW) consider(neopixelState.lastFrame + NEOPIXEL_FRAME_INTERVAL);
+  if (!wifiOnline) consider(now + WIFI_POLL_INTERVAL);
+  return deadline;
+}
+
+void idleUntilNextDeadline() {
+  unsigned long now = millis();
+  long wait = (long)(nextDeadline(now) - now);
+  if (wait <= 0) return;
+
+  if (ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(wait)) > 0) {
+    uint32_t requestedAt = power.wakeRequestedAt;
+    if (requestedAt != 0) {
+      power.wakeRequestedAt = 0;
+      uint32_t latency = micros() - requestedAt;
+      power.wakeups++;
+      power.wakeLatencyTotal += latency;
+      if (latency > power.wakeLatencyMax) power.wakeLatencyMax = latency;
+    }
+  }
+  power.sleptIn[power.state] += millis() - now;
+}
+
+void fillPowerReport(JsonObject report) {
+  unsigned long now = millis();
+  report["state"] = powerStateNames[power.state];
+  report["cpuMhz"] = getCpuFrequencyMhz();
+  report["latencyBoundMs"] = powerLatencyBound[power.state];
+  for (uint8_t i = 0; i < POWER_STATE_COUNT; i++) {
+    unsigned long time = power.timeIn[i] + (i == power.state ? now - power.stateSince : 0);
+    report["timeMs"][powerStateNames[i]] = time;
+    report["sleptMs"][powerStateNames[i]] = power.sleptIn[i];
+  }
+  report["wakeups"] = power.wakeups;
+  report["wakeLatencyMaxUs"] = power.wakeLatencyMax;
+  report["wakeLatencyAvgUs"] = power.wakeups ? (uint32_t)(power.wakeLatencyTotal / power.wakeups) : 0;
+}
+
+// --- ALLOCATION-FREE MESSAGING ---
+void broadcastJson(const JsonDocument& doc) {
+  size_t length = serializeJson(doc, (char*)wsFrame + WEBSOCKETS_MAX_HEADER_SIZE, WS_FRAME_CAPACITY);
+  if (length >= WS_FRAME_CAPACITY - 1) {
+    framesDropped++;
+    return;
+  }
+  webSocket.broadcastTXT(wsFrame, length, true);
+}
+
+// Answers a time_sync probe to its sender only: t1 is when the loop read the probe, t2
+// when the reply was composed, both esp_timer microseconds since boot (the clock behind
+// millis() and every "timestamp"). t1 trails arrival by up to the power state's latency
+// bound, so clients should trust the probes with the shortest round trip.
+void sendTimeSync(uint8_t num, const char* id, int64_t receivedAt) {
+  JsonDocument doc(&jsonArena);
+  doc["type"] = "time_sync";
+  doc["data"]["id"] = id;
+  doc["data"]["t1"] = receivedAt;
+  doc["data"]["t2"] = esp_timer_get_time();
+  size_t length = serializeJson(doc, (char*)wsFrame + WEBSOCKETS_MAX_HEADER_SIZE, WS_FRAME_CAPACITY);
+  if (length >= WS_FRAME_CAPACITY - 1) {
+    framesDropped++;
+    return;
+  }
+  webSocket.sendTXT(num, wsFrame, length, true);
+}
+
+void fillHeapReport(JsonObject report) {
+  multi_heap_info_t info;
+  heap_caps_get_info(&info, MALLOC_CAP_DEFAULT);
+  report["free"] = info.total_free_bytes;
+  report["minFree"] = info.minimum_free_bytes;
+  report["largestFreeBlock"] = info.largest_free_block;
+  report["allocatedBlocks"] = info.allocated_blocks;
+  report["jsonArenaHighWater"] = jsonArena.highWater;
+  report["jsonArenaFailures"] = jsonArena.failures;
+  report["framesDropped"] = framesDropped;
+}
+
+// --- OLED PIPELINE ---
+void startOLEDFlush() {
+  oled.lock = xSemaphoreCreateMutex();
+  Wire.setClock(OLED_I2C_CLOCK);
+  xTaskCreatePinnedToCore(oledFlushTask, "oled", 2048, NULL, tskIDLE_PRIORITY + 1, &oled.task, 0);
+}
+
+// Hands the current framebuffer to the flush task; never touches the bus
+void presentOLED() {
+  if (oled.task == nullptr) return;
+  xSemaphoreTake(oled.lock, portMAX_DELAY);
+  memcpy(oled.pending, display.getBuffer(), OLED_FRAME_BYTES);
+  oled.framePending = true;
+  xSemaphoreGive(oled.lock);
+  xTaskNotifyGive(oled.task);
+}
+
+void oledFlushTask(void *arg) {
+  static const uint8_t window[] = {
+    0x00, // Command stream
+    SSD1306_PAGEADDR, 0, 0xFF,
+    SSD1306_COLUMNADDR, 0, 127
+  };
+  for (;;) {
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+    xSemaphoreTake(oled.lock, portMAX_DELAY);
+    bool send = oled.framePending;
+    if (send) memcpy(oled.sending, oled.pending, OLED_FRAME_BYTES);
+    oled.framePending = false;
+    xSemaphoreGive(oled.lock);
+    if (!send) continue;
+
+    // Same transfer as Adafruit_SSD1306::display(), from a buffer the loop can't touch
+    Wire.beginTransmission(0x3C);
+    Wire.write(window, sizeof(window));
+    Wire.endTransmission();
+    for (size_t offset = 0; offset < OLED_FRAME_BYTES; offset += OLED_I2C_CHUNK) {
+      Wire.beginTransmission(0x3C);
+      Wire.write((uint8_t)0x40); // Data stream
+      Wire.write(oled.sending + offset, OLED_I2C_CHUNK);
+      Wire.endTransmission();
+    }
+  }
+}
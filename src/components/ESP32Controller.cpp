@@ -5,21 +5,36 @@
 #include <Adafruit_SSD1306.h>
 #include <Adafruit_GFX.h>
 #include <Wire.h>
+#include <Preferences.h>
+#include <esp_system.h>
+#include <esp_heap_caps.h>
+#include <esp_adc_cal.h>
+#include <lwip/sockets.h>
+#ifdef CONFIG_PM_ENABLE
+#include <esp_pm.h>
+#endif
 
 // WiFi Configuration
 const char* ssid = "YOUR_WIFI_SSID";
 const char* password = "YOUR_WIFI_PASSWORD";
 
+// Fast reconnect: the AP's channel/BSSID and our last IP lease are cached in NVS
+#define WIFI_FAST_CONNECT_TIMEOUT 3000 // Fall back to a full scan + DHCP after this (ms)
+#define WIFI_REUSE_IP false            // Skip DHCP on fast connect (only with a router reservation: the lease is never renewed)
+#define WIFI_CACHE_VERSION 1
+
 // Hardware Configuration
 #define SCREEN_WIDTH 128
 #define SCREEN_HEIGHT 64
 #define OLED_RESET -1
 #define SCREEN_ADDRESS 0x3C
+#define OLED_I2C_CLOCK 400000 // SSD1306 spec; most panels also run at 1000000 (Fast-mode Plus)
 
 // Pin Definitions
 #define TRIG_PIN 5
 #define ECHO_PIN 18
 #define SMOKE_PIN A0
+#define BATT_PIN 39 // VN
 #define BUZZER_PIN 4
 #define MOTOR_LEFT_1 25
 #define MOTOR_LEFT_2 26
@@ -29,28 +44,770 @@ const char* password = "YOUR_WIFI_PASSWORD";
 #define MOTOR_RIGHT_PWM 33
 
 // Objects
-Adafruit_SSD1306 display(SCREEN_WIDTH, SCREEN_HEIGHT, &Wire, OLED_RESET);
+Adafruit_SSD1306 display(SCREEN_WIDTH, SCREEN_HEIGHT, &Wire, OLED_RESET, OLED_I2C_CLOCK, OLED_I2C_CLOCK);
+Preferences preferences;
 AsyncWebServer server(80);
-WebSocketsServer webSocket(81);
+AsyncEventSource telemetryStream("/stream");
+
+// Exposes the client sockets so sends can wait until a client can take more data
+class QueuedWebSocketsServer : public WebSocketsServer {
+ public:
+  using WebSocketsServer::WebSocketsServer;
+  
+  bool canWrite(uint8_t num) {
+    WiFiClient* tcp = _clients[num].tcp;
+    int fd = tcp ? tcp->fd() : -1;
+    if (fd < 0) return false;
+    fd_set writable;
+    FD_ZERO(&writable);
+    FD_SET(fd, &writable);
+    timeval zero = { 0, 0 };
+    return select(fd + 1, nullptr, &writable, nullptr, &zero) > 0;
+  }
+};
+QueuedWebSocketsServer webSocket(81);
+
+// Direction/expression codes shared by the robot state, mission bytecode and binary
+// command frames. Names are only looked up at the protocol edge.
+enum Direction : uint8_t { DIR_STOP, DIR_FORWARD, DIR_BACKWARD, DIR_LEFT, DIR_RIGHT };
+enum Expression : uint8_t {
+  EXPR_NEUTRAL, EXPR_HAPPY, EXPR_SAD, EXPR_SURPRISED, EXPR_ANGRY, EXPR_THINKING, EXPR_EXCITED,
+  EXPR_BLINK // Drawn by the auto-blink only; not settable and never stored in robot.expression
+};
+const char* const directionNames[] = { "stop", "forward", "backward", "left", "right" };
+const char* const expressionNames[] = { "neutral", "happy", "sad", "surprised", "angry", "thinking", "excited" };
+#define DIRECTION_COUNT (sizeof(directionNames) / sizeof(directionNames[0]))
+#define EXPRESSION_COUNT (sizeof(expressionNames) / sizeof(expressionNames[0]))
+#define OLED_TEXT_CAPACITY 64 // Bytes including the terminator; the screen shows 21 characters
 
 // Robot State
+// Fixed-size only: nothing here is reallocated when the state changes.
 struct RobotState {
   bool buzzer = false;
-  String oledText = "Hello! I'm EMU 🤖";
-  String expression = "neutral";
+  char oledText[OLED_TEXT_CAPACITY] = "Hello! I'm EMU 🤖";
+  Expression expression = EXPR_NEUTRAL;
   int leftMotorSpeed = 0;
   int rightMotorSpeed = 0;
-  String direction = "stopped";
+  uint8_t driveSpeed = 200; // PWM for forward/backward; turns use 3/4 of it
+  Direction direction = DIR_STOP;
   bool ultrasonicEnabled = true;
   bool smokeEnabled = true;
   float ultrasonicWarning = 25.0;
   float ultrasonicDanger = 10.0;
   float smokeSensitivity = 50.0;
+  float batteryLow = 20.0;
+  float ultrasonicHysteresis = 3.0; // cm past the threshold before an obstacle event clears
+  float smokeHysteresis = 5.0;      // % below sensitivity before smoke clears
+  float batteryHysteresis = 3.0;    // % above batteryLow before battery_low clears
+  unsigned long eventDebounce = 150; // Condition must hold this long (ms) before an event fires
+  float airTemperature = 20.0; // C, for the speed of sound; no thermometer here, set_thresholds takes one
   unsigned long lastExpressionChange = 0;
-  unsigned long lastBlink = 0;
+  unsigned long nextBlink = 0;
+  unsigned long blinkEnds = 0;
+  unsigned long stopAt = 0; // End of a timed move, 0 = none
   bool isBlinking = false;
+  bool displayReady = false;
 } robot;
 
+struct WifiCache {
+  uint8_t version;
+  int32_t channel;
+  uint8_t bssid[6];
+  uint32_t ip;
+  uint32_t gateway;
+  uint32_t subnet;
+  uint32_t dns;
+};
+
+struct WifiState {
+  WifiCache cache;
+  bool fastConnect = false;
+  bool online = false;
+  unsigned long attemptStarted = 0;
+} wifi;
+
+// Boot phase timestamps (ms since reset), reported in status_update
+struct BootTimings {
+  unsigned long hardwareReady = 0;
+  unsigned long firstControlTick = 0;
+  unsigned long wifiConnected = 0;
+  unsigned long firstTelemetry = 0;
+  bool fastConnect = false;
+} boot;
+
+// Latest sensor readings, each refreshed on its own SensorSchedule
+#define SENSOR_BROADCAST_INTERVAL 500
+
+struct SensorReadings {
+  float distance = 999.0;
+  float smokeLevel = 0.0;
+  float battery = 100.0;
+  uint16_t smokePpm = 0;
+  uint16_t batteryMillivolts = 0;
+  unsigned long timestamp = 0;
+} sensors;
+
+// Sensor conversion
+// Raw readings become engineering units through lookup tables with linear interpolation,
+// a few integer operations per sample. The speed of sound, MQ-2 and discharge tables are
+// computed by the compiler from the curves below. The ADC table depends on this chip's
+// eFuse calibration, so startSensorConversion() fills it once at boot.
+#define ADC_TABLE_SHIFT 7         // 128 raw counts per segment
+#define ADC_TABLE_SIZE ((4096 >> ADC_TABLE_SHIFT) + 1)
+#define ADC_DEFAULT_VREF 1100     // mV, for chips without a Vref in eFuse
+
+#define SOUND_TABLE_ORIGIN -200   // Tenths of a degree C
+#define SOUND_TABLE_SHIFT 5       // 3.2 C per segment
+#define SOUND_TABLE_SIZE 26       // Up to +60 C
+
+#define MQ2_SUPPLY_MV 5000.0
+#define MQ2_LOAD_KOHM 10.0        // RL on the module
+#define MQ2_R0_KOHM 10.0          // This sensor's Rs in clean air / 9.83
+#define MQ2_DIVIDER_RATIO 1.5     // AO is divided down to SMOKE_PIN (10k over 20k)
+#define MQ2_PPM_LOW 200.0         // Datasheet smoke curve: Rs/R0 = 3.4 at 200ppm...
+#define MQ2_RATIO_LOW 3.4
+#define MQ2_PPM_HIGH 10000.0      // ...and 0.6 at 10000ppm; smokeLevel is log ppm across this span
+#define MQ2_RATIO_HIGH 0.6
+#define SMOKE_TABLE_SHIFT 6       // 64mV at the pin per segment
+#define SMOKE_TABLE_SIZE 53       // Up to 3328mV
+
+#define BATT_CELLS 2
+#define BATT_DIVIDER_RATIO 3      // Pack voltage is divided down to BATT_PIN (20k over 10k)
+#define BATT_TABLE_ORIGIN 3200    // mV per cell
+#define BATT_TABLE_SHIFT 5        // 32mV per segment
+#define BATT_TABLE_SIZE 33        // Up to 4224mV
+
+// Compile-time math for the tables (C++11 constexpr: one return statement each)
+struct ConstMath {
+  static constexpr double square(double x) { return x * x; }
+  static constexpr double sqrtStep(double x, double guess, int steps) {
+    return steps == 0 ? guess : sqrtStep(x, (guess + x / guess) / 2, steps - 1);
+  }
+  static constexpr double sqrt(double x) { return x <= 0 ? 0 : sqrtStep(x, x > 1 ? x : 1, 40); }
+  // 2 atanh(y) = ln((1 + y) / (1 - y)), with y <= 1/3 after range reduction
+  static constexpr double lnSeries(double y, double y2, int k) {
+    return k > 41 ? 0 : y / k + lnSeries(y * y2, y2, k + 2);
+  }
+  static constexpr double ln(double x) {
+    return x >= 2 ? ln(x / 2) + 0.6931471805599453
+         : x < 1 ? ln(x * 2) - 0.6931471805599453
+         : 2 * lnSeries((x - 1) / (x + 1), square((x - 1) / (x + 1)), 1);
+  }
+  static constexpr double expSeries(double x, double term, int k) {
+    return k > 24 ? term : term + expSeries(x, term * x / k, k + 1);
+  }
+  static constexpr double exp(double x) { return x > 0.5 || x < -0.5 ? square(exp(x / 2)) : expSeries(x, 1, 1); }
+  static constexpr double pow(double base, double exponent) { return exp(exponent * ln(base)); }
+  static constexpr uint16_t round(double x, double limit) {
+    return x <= 0 ? 0 : x >= limit ? (uint16_t)limit : (uint16_t)(x + 0.5);
+  }
+};
+
+// Resting voltage of a Li-ion cell against charge left, highest first
+struct DischargePoint {
+  uint16_t millivolts;
+  uint16_t percent;
+};
+constexpr DischargePoint dischargeCurve[] = {
+  { 4200, 100 }, { 4110, 90 }, { 4020, 80 }, { 3950, 70 }, { 3870, 60 }, { 3840, 50 },
+  { 3800, 40 }, { 3770, 30 }, { 3730, 20 }, { 3690, 10 }, { 3610, 5 }, { 3270, 0 }
+};
+#define DISCHARGE_POINTS (sizeof(dischargeCurve) / sizeof(dischargeCurve[0]))
+
+// Table entry i, from the physical models
+struct SensorCurves {
+  // Half the speed of sound in Q16 mm/us at SOUND_TABLE_ORIGIN + i segments
+  static constexpr uint16_t sound(uint16_t i) {
+    return ConstMath::round(0.5 * 0.3313 * ConstMath::sqrt(1 + (SOUND_TABLE_ORIGIN + (i << SOUND_TABLE_SHIFT)) / 2731.5) * 65536, 65535);
+  }
+  
+  // MQ-2: Rs from the RL divider, then ppm = PPM_LOW * (ratio / RATIO_LOW)^b through both datasheet points
+  static constexpr double mq2Exponent() {
+    return ConstMath::ln(MQ2_PPM_HIGH / MQ2_PPM_LOW) / ConstMath::ln(MQ2_RATIO_HIGH / MQ2_RATIO_LOW);
+  }
+  static constexpr double mq2PpmAtOutput(double output) {
+    return output <= 0 ? 0
+         : output >= MQ2_SUPPLY_MV ? MQ2_PPM_HIGH
+         : MQ2_PPM_LOW * ConstMath::pow(MQ2_LOAD_KOHM * (MQ2_SUPPLY_MV - output) / output / MQ2_R0_KOHM / MQ2_RATIO_LOW, mq2Exponent());
+  }
+  static constexpr double mq2Ppm(uint16_t i) { return mq2PpmAtOutput((i << SMOKE_TABLE_SHIFT) * MQ2_DIVIDER_RATIO); }
+  static constexpr uint16_t smokePpm(uint16_t i) { return ConstMath::round(mq2Ppm(i), MQ2_PPM_HIGH); }
+  // Tenths of a percent of the log span between the datasheet points
+  static constexpr uint16_t smokeLevel(uint16_t i) {
+    return mq2Ppm(i) <= MQ2_PPM_LOW ? 0 : ConstMath::round(1000 * ConstMath::ln(mq2Ppm(i) / MQ2_PPM_LOW) / ConstMath::ln(MQ2_PPM_HIGH / MQ2_PPM_LOW), 1000);
+  }
+  
+  // Tenths of a percent of charge at BATT_TABLE_ORIGIN + i segments per cell
+  static constexpr double discharge(double millivolts, size_t k) {
+    return k >= DISCHARGE_POINTS ? 0
+         : millivolts < dischargeCurve[k].millivolts ? discharge(millivolts, k + 1)
+         : k == 0 ? dischargeCurve[0].percent
+         : dischargeCurve[k].percent + (millivolts - dischargeCurve[k].millivolts) *
+             (dischargeCurve[k - 1].percent - dischargeCurve[k].percent) /
+             (dischargeCurve[k - 1].millivolts - dischargeCurve[k].millivolts);
+  }
+  static constexpr uint16_t battery(uint16_t i) {
+    return ConstMath::round(10 * discharge(BATT_TABLE_ORIGIN + (i << BATT_TABLE_SHIFT), 0), 1000);
+  }
+};
+
+template <uint16_t... I> struct TableIndices {};
+template <uint16_t N, uint16_t... I> struct MakeTableIndices : MakeTableIndices<N - 1, N - 1, I...> {};
+template <uint16_t... I> struct MakeTableIndices<0, I...> { typedef TableIndices<I...> type; };
+
+template <size_t N> struct LookupTable {
+  uint16_t values[N];
+};
+
+template <size_t N, uint16_t (*Entry)(uint16_t)> struct BuildTable {
+  template <uint16_t... I> static constexpr LookupTable<N> from(TableIndices<I...>) { return {{ Entry(I)... }}; }
+  static constexpr LookupTable<N> build() { return from(typename MakeTableIndices<N>::type()); }
+};
+
+constexpr LookupTable<SOUND_TABLE_SIZE> soundTable = BuildTable<SOUND_TABLE_SIZE, SensorCurves::sound>::build();
+constexpr LookupTable<SMOKE_TABLE_SIZE> smokePpmTable = BuildTable<SMOKE_TABLE_SIZE, SensorCurves::smokePpm>::build();
+constexpr LookupTable<SMOKE_TABLE_SIZE> smokeLevelTable = BuildTable<SMOKE_TABLE_SIZE, SensorCurves::smokeLevel>::build();
+constexpr LookupTable<BATT_TABLE_SIZE> batteryTable = BuildTable<BATT_TABLE_SIZE, SensorCurves::battery>::build();
+
+struct SensorConversion {
+  uint16_t adcMillivolts[ADC_TABLE_SIZE]; // Calibrated mV at raw = i << ADC_TABLE_SHIFT
+  uint16_t soundScale;                    // soundTable at robot.airTemperature
+} conversion;
+
+// Adaptive acquisition: every sensor has its own interval between minInterval and
+// maxInterval (ms). It shortens as the reading changes faster or nears its event
+// threshold, and for the ultrasonic sensor with the commanded drive speed.
+#define ROBOT_MAX_SPEED_CMS 60.0   // Ground speed at PWM 255 (cm/s)
+#define SAMPLE_TRAVEL_CM 2.0       // Ping at least this often (in cm travelled) while driving
+#define SAMPLING_RATE_SMOOTHING 0.3
+#define SAMPLING_MIN_FLOOR 20      // Lowest minInterval a client may configure (ms)
+
+struct SensorSchedule {
+  const char* name;
+  uint16_t minInterval;
+  uint16_t maxInterval;
+  float rateScale;          // Rate of change (units/s) that halves the interval
+  uint16_t interval;        // Current interval
+  unsigned long lastSample;
+  float lastValue;
+  float rate;               // Smoothed |change| per second
+};
+
+SensorSchedule ultrasonicSchedule = { "ultrasonic", 60, 1000, 20.0, 100, 0, 0, 0 };
+SensorSchedule smokeSchedule = { "smoke", 100, 2000, 5.0, 500, 0, 0, 0 };
+SensorSchedule batterySchedule = { "battery", 1000, 10000, 0.5, 1000, 0, 0, 0 };
+SensorSchedule* const schedules[] = { &ultrasonicSchedule, &smokeSchedule, &batterySchedule };
+
+// Edge-triggered threshold events with hysteresis and debounce
+#define EVENT_DEBOUNCE_MAX 10000 // ms, upper bound set_thresholds accepts
+
+struct EventDetector {
+  uint8_t id;
+  const char* onEvent;
+  const char* offEvent;
+  bool below; // Trips when the value drops below the threshold (distance, battery)
+  bool active;
+  bool pending;
+  unsigned long pendingSince;
+};
+
+EventDetector obstacleWarning = { 0, "obstacle_warning", "obstacle_warning_cleared", true, false, false, 0 };
+EventDetector obstacleDanger = { 1, "obstacle_danger", "obstacle_danger_cleared", true, false, false, 0 };
+EventDetector smokeAlarm = { 2, "smoke_detected", "smoke_cleared", false, false, false, 0 };
+EventDetector batteryAlarm = { 3, "battery_low", "battery_ok", true, false, false, 0 };
+
+// Server-Sent Events telemetry: GET /stream?interval=<ms>&fields=ultrasonic,smoke,battery,motion,events
+// Frames are built from the cached readings, so streaming never triggers a sensor read.
+#define STREAM_MAX_CLIENTS 4
+#define STREAM_MIN_INTERVAL 100
+#define STREAM_DEFAULT_INTERVAL 500
+#define STREAM_MAX_INTERVAL 10000
+#define STREAM_MAX_BACKLOG 2 // Skip a frame for clients with more than this many unsent
+
+#define STREAM_FIELD_ULTRASONIC 0x01
+#define STREAM_FIELD_SMOKE 0x02
+#define STREAM_FIELD_BATTERY 0x04
+#define STREAM_FIELD_MOTION 0x08
+#define STREAM_FIELD_EVENTS 0x10 // sensor_event pushes
+#define STREAM_FIELD_ALL 0x1F
+
+struct StreamOptions {
+  AsyncClient* tcp; // Connection the options were requested on
+  uint16_t interval;
+  uint8_t fields;
+};
+
+struct StreamClient {
+  AsyncEventSourceClient* client;
+  uint16_t interval;
+  uint8_t fields;
+  unsigned long lastSent;
+};
+
+StreamOptions pendingStreams[STREAM_MAX_CLIENTS];
+uint8_t nextPendingStream = 0;
+StreamClient streamClients[STREAM_MAX_CLIENTS];
+SemaphoreHandle_t streamLock; // Clients are added/removed on the async TCP task, sent to from loop()
+
+// Inbound commands
+// JSON text frames and binary frames both decode into a Command without touching the
+// heap. JSON is parsed in place (zero-copy), so string fields point into the received
+// payload and are only valid while the frame is being handled.
+#define COMMAND_JSON_CAPACITY 512
+
+// Binary frame: opcode (u8), sequence (u16 LE, 0 = no ack wanted), then fixed fields
+#define BIN_MOVE 0x01          // direction (u8), duration ms (u16 LE)
+#define BIN_SET_SPEED 0x02     // speed (u8)
+#define BIN_BUZZER 0x03        // state (u8)
+#define BIN_EXPRESSION 0x04    // expression (u8)
+#define BIN_MISSION_START 0x05
+#define BIN_MISSION_ABORT 0x06
+#define BIN_TELEOP 0x07        // left, right duty (i16 LE, -255..255), lease ms (u16 LE), setpoint sequence (u16 LE)
+#define BIN_HEADER_SIZE 3
+
+enum CommandAction : uint8_t {
+  CMD_UNKNOWN,
+  CMD_MOVE,
+  CMD_SET_SPEED,
+  CMD_BUZZER,
+  CMD_OLED,
+  CMD_EXPRESSION,
+  CMD_SET_THRESHOLDS,
+  CMD_PATROL,
+  CMD_SCAN,
+  CMD_MISSION_LOAD,
+  CMD_MISSION_START,
+  CMD_MISSION_ABORT,
+  CMD_SET_SAMPLING,
+  CMD_TELEOP
+};
+
+const char* const commandNames[] = {
+  "", "move", "speed", "buzzer", "oled", "expression", "set_thresholds",
+  "patrol", "scan", "mission_load", "mission_start", "mission_abort", "set_sampling", "teleop"
+};
+
+struct Command {
+  CommandAction action;
+  const char* name;   // Action as received, for error replies
+  const char* id;     // Empty = no ack wanted
+  char idBuffer[6];   // Holds the sequence number of binary frames
+  Direction direction;
+  uint16_t duration;
+  uint8_t speed;
+  bool state;
+  const char* text;
+  Expression expression;
+  const char* program;
+  const char* missionName;
+  bool autostart;
+  // set_thresholds: NAN = leave unchanged
+  float ultrasonicWarning;
+  float ultrasonicDanger;
+  float smokeSensitivity;
+  float batteryLow;
+  float ultrasonicHysteresis;
+  float smokeHysteresis;
+  float batteryHysteresis;
+  float eventDebounce;
+  float airTemperature;
+  // set_sampling: 0 = leave unchanged
+  const char* sensor;
+  uint16_t minInterval;
+  uint16_t maxInterval;
+  // teleop
+  int16_t left;
+  int16_t right;
+  uint16_t lease;     // 0 = TELEOP_DEFAULT_LEASE
+  uint16_t sequence;  // 0 = unsequenced
+  uint8_t client;     // WebSocket client it came from, COMMAND_CLIENT_LOCAL otherwise
+  // scan
+  uint16_t turnRate;  // 0 = SCAN_TURN_RATE
+};
+
+#define COMMAND_CLIENT_LOCAL 0xFF
+
+// Teleop
+// Clients stream differential-drive setpoints at 20-50 Hz, as BIN_TELEOP frames or the
+// "teleop" action with left/right duty or linear/angular (-1..1). Each setpoint replaces
+// the previous one outright, and one older than the last taken from the same client is
+// dropped, so only the newest is ever applied. teleopTick() slews the motors toward it.
+// Every setpoint carries a lease; when it runs out with nothing newer, or the client
+// disconnects, the motors ramp down to a stop and a "teleop_expired" safety ack goes out.
+// Setpoints are never acked.
+#define TELEOP_DEFAULT_LEASE 300 // ms
+#define TELEOP_MAX_LEASE 1000
+#define TELEOP_ACCEL 1020        // Duty per second toward a faster setpoint (0 to full in 250ms)
+#define TELEOP_DECEL 2550        // ...and toward a slower one or a stop (full to 0 in 100ms)
+#define TELEOP_TICK 10           // ms between ramp steps
+#define REST_MOVE_DURATION 2000  // ms a REST /move runs before the loop stops it
+
+struct Teleop {
+  bool active = false;       // Owns the motors until the ramp is back at 0
+  int16_t targetLeft = 0;    // Latest setpoint, duty -255..255
+  int16_t targetRight = 0;
+  float left = 0;            // Ramped outputs
+  float right = 0;
+  unsigned long leaseEnds = 0; // 0 = expired, ramping down
+  unsigned long lastTick = 0;
+  uint8_t client = COMMAND_CLIENT_LOCAL;
+  uint16_t sequence = 0;
+  uint32_t applied = 0;
+  uint32_t stale = 0;        // Dropped as older than a setpoint already taken
+  uint32_t expired = 0;
+} teleop;
+
+// REST /move runs on the web server task, which must not touch the motors
+struct RestMove {
+  Direction direction = DIR_STOP;
+  bool requested = false;    // Published with __atomic after direction
+} restMove;
+
+// Polar scan
+// "scan" turns the robot in place while the ultrasonic sensor pings at its minInterval,
+// and bins each reading into one of SCAN_SECTORS sectors by heading. There is no compass
+// or encoder, so the heading is dead-reckoned from the time since the turn started at
+// the turn rate (degrees/s clockwise from the starting heading; the command's "turnRate"
+// overrides SCAN_TURN_RATE once measured on the robot's floor). Every
+// SCAN_PROGRESS_INTERVAL a scan_progress frame carries the sectors finished since the
+// last one; the whole map follows in one scan_map frame when the turn completes or is
+// cut short. Ranges are whole cm, SCAN_RANGE_MAX where nothing echoed and 0 for a sector
+// without readings.
+#define SCAN_SECTORS 36
+#define SCAN_SECTOR_DEGREES (360 / SCAN_SECTORS)
+#define SCAN_SECTOR_SAMPLES 8      // Readings per sector kept for the median
+#define SCAN_TURN_DUTY 140
+#define SCAN_TURN_RATE 90          // deg/s at SCAN_TURN_DUTY
+#define SCAN_MIN_TURN_RATE 10
+#define SCAN_MAX_TURN_RATE 360
+#define SCAN_RANGE_MAX 400         // cm, the sensor's limit
+#define SCAN_PROGRESS_INTERVAL 500 // ms
+
+struct ScanState {
+  bool running = false;
+  unsigned long startedAt = 0;
+  unsigned long endsAt = 0;
+  unsigned long lastProgress = 0;
+  uint16_t turnRate = SCAN_TURN_RATE;
+  uint8_t reported = 0;                                 // Sectors sent in scan_progress so far
+  uint8_t count[SCAN_SECTORS];                          // Readings taken (saturates at 255)
+  uint16_t minimum[SCAN_SECTORS];                       // Over all readings
+  uint16_t samples[SCAN_SECTORS][SCAN_SECTOR_SAMPLES];  // First readings, ascending
+  uint32_t completed = 0;
+} scan;
+
+// Flight recorder
+// Fixed-size binary records in a RAM ring that survives soft resets and panics.
+// logEvent() is lock-free and never touches the UART; an idle-priority task
+// prints new records lazily and GET /log returns the raw ring.
+#define FLIGHT_LOG_RECORDS 1024 // Power of two
+#define FLIGHT_LOG_MAGIC 0x454D5546
+#define FLIGHT_LOG_DRAIN_INTERVAL 20 // ms between drain passes
+#define FLIGHT_LOG_LINE_MAX 64       // Leave this much UART buffer free per printed line
+
+enum FlightEvent : uint16_t {
+  EV_BOOT = 1,          // arg0 = esp_reset_reason()
+  EV_WIFI_UP,           // arg1 = IPv4 address
+  EV_WIFI_DOWN,
+  EV_WS_CONNECT,        // arg0 = client, arg1 = IPv4 address
+  EV_WS_DISCONNECT,     // arg0 = client
+  EV_WS_RECEIVE,        // arg0 = client, arg1 = frame length
+  EV_COMMAND,           // arg1 = first four chars of the action
+  EV_AUTO_STOP,         // arg0 = distance in mm
+  EV_SENSOR_EVENT,      // arg0 = detector id | active << 8, arg1 = value (float bits)
+  EV_MISSION,           // arg0 = step, arg1 = first four chars of the event
+  EV_STREAM_CONNECT,    // arg0 = stream slot
+  EV_STREAM_DISCONNECT, // arg0 = stream slot
+  EV_LOG_OVERRUN,       // arg1 = records overwritten before they were printed
+  EV_POWER,             // arg0 = new PowerState, arg1 = CPU MHz
+  EV_HEAP,              // arg0 = allocated blocks, arg1 = largest free block
+  EV_WS_SLOW,           // arg0 = client, arg1 = messages still queued
+  EV_TELEOP_EXPIRED,    // arg0 = client of the last setpoint
+  EV_WIFI_FALLBACK,     // Fast connect timed out, full scan + DHCP
+  EV_BOOT_PHASE         // arg0 = BootPhase, arg1 = ms since reset; once, with the first telemetry frame
+};
+
+enum BootPhase : uint16_t {
+  BOOT_HARDWARE_READY,
+  BOOT_CONTROL_LOOP,
+  BOOT_WIFI_CONNECTED,  // | BOOT_FAST_CONNECT when the cached AP was used
+  BOOT_FIRST_TELEMETRY,
+  BOOT_FAST_CONNECT = 0x100
+};
+
+const char* const flightEventNames[] = {
+  "?", "boot", "wifi_up", "wifi_down", "ws_connect", "ws_disconnect", "ws_receive", "command",
+  "auto_stop", "sensor_event", "mission", "stream_connect", "stream_disconnect", "log_overrun",
+  "power", "heap", "ws_slow", "teleop_expired", "wifi_fallback", "boot_phase"
+};
+
+struct FlightRecord {
+  uint32_t timestamp; // micros()
+  uint16_t event;
+  uint16_t arg0;
+  uint32_t arg1;
+  uint32_t seq; // Record index + 1 once fully written, 0 while being written
+};
+
+struct FlightLog {
+  uint32_t magic;
+  uint32_t head; // Total records ever written
+  FlightRecord records[FLIGHT_LOG_RECORDS];
+};
+
+__NOINIT_ATTR FlightLog flightLog;
+uint32_t flightLogPrinted = 0;
+
+// Mission bytecode
+// A mission is a flat list of 4-byte steps: opcode, 8-bit arg, 16-bit little-endian arg.
+// The backend uploads it once (hex encoded) and the interpreter runs it from loop().
+#define MISSION_MAX_STEPS 64
+#define MISSION_STEP_SIZE 4
+
+enum MissionOp : uint8_t {
+  OP_END = 0x00,          // -, -          stop motors, mission complete
+  OP_MOVE = 0x01,         // dir, ms       drive and hold for ms before the next step
+  OP_WAIT = 0x02,         // -, ms
+  OP_WAIT_DIST = 0x03,    // cmp, cm       wait until distance < cm (cmp 0) or > cm (cmp 1)
+  OP_EXPRESSION = 0x04,   // expr, -
+  OP_BEEP = 0x05,         // -, ms
+  OP_JUMP_NEAR = 0x06,    // step, cm      jump if distance < cm
+  OP_JUMP_FAR = 0x07,     // step, cm      jump if distance >= cm
+  OP_JUMP_SMOKE = 0x08,   // step, pct     jump if smoke level > pct
+  OP_LOOP = 0x09,         // step, count   jump back so the body runs count times (0 = forever)
+  OP_SHOW_SENSORS = 0x0A  // -, -          print distance/smoke on the OLED
+};
+
+
+struct MissionState {
+  uint8_t program[MISSION_MAX_STEPS * MISSION_STEP_SIZE];
+  uint8_t length = 0; // In steps
+  uint8_t pc = 0;
+  uint16_t loopCount[MISSION_MAX_STEPS];
+  char name[16] = "";
+  bool running = false;
+  bool busy = false; // Current step is still holding (move/wait/beep)
+  unsigned long deadline = 0;
+} mission;
+
+// Power management
+// loop() blocks on a task notification until its next deadline (sensor schedule, broadcast,
+// mission step, timed move, blink, stream frame) or until wakeLoop() is called from another
+// task. The sleep is also capped per state, which bounds how long a WebSocket command (polled
+// by webSocket.loop()) can wait. Driving and missions hold full clock with modem sleep off;
+// otherwise the CPU drops to 80MHz and the radio sleeps between DTIM beacons. With
+// CONFIG_PM_ENABLE the idle task also enters automatic light sleep between deadlines.
+#define POWER_CPU_ACTIVE 240      // MHz
+#define POWER_CPU_IDLE 80         // MHz, lowest that keeps Wi-Fi running
+#define POWER_ACTIVE_HOLD 2000    // Stay active this long after the last motion (ms)
+#define POWER_ACTIVE_LATENCY 5    // Max sleep per state (ms) = worst-case command pickup delay
+#define POWER_IDLE_LATENCY 20
+#define POWER_STANDBY_LATENCY 100
+#define WIFI_POLL_INTERVAL 100    // wifiTick() cadence while not connected
+
+enum PowerState : uint8_t {
+  POWER_ACTIVE,   // Driving or running a mission
+  POWER_IDLE,     // Stationary with clients connected
+  POWER_STANDBY,  // Stationary, nobody connected
+  POWER_STATE_COUNT
+};
+
+const char* const powerStateNames[] = { "active", "idle", "standby" };
+const uint16_t powerLatencyBound[] = { POWER_ACTIVE_LATENCY, POWER_IDLE_LATENCY, POWER_STANDBY_LATENCY };
+
+struct PowerStats {
+  PowerState state = POWER_ACTIVE;
+  unsigned long stateSince = 0;
+  unsigned long lastBusy = 0;
+  unsigned long timeIn[POWER_STATE_COUNT] = {};  // ms spent in each state
+  unsigned long sleptIn[POWER_STATE_COUNT] = {}; // ms of that spent blocked in the idle wait
+  volatile uint32_t wakeRequestedAt = 0;         // micros() of a pending wakeLoop(), 0 = none
+  uint32_t wakeups = 0;
+  uint32_t wakeLatencyMax = 0;                   // us from wakeLoop() to loop() running
+  uint64_t wakeLatencyTotal = 0;
+} power;
+
+TaskHandle_t loopTaskHandle = nullptr;
+unsigned long lastSensorBroadcast = 0;
+#ifdef CONFIG_PM_ENABLE
+esp_pm_lock_handle_t cpuMaxLock;
+esp_pm_lock_handle_t noLightSleepLock;
+#endif
+
+// Outbound WebSocket queues
+// Each message is serialized once into a refcounted pool slot (with header room in front,
+// so sendTXT() writes the header in place) and queued by reference on every connected
+// client. wsSendTick() drains each client highest priority first, and only while its
+// socket can take more data, so a slow client backs up its own queue instead of stalling
+// the loop. A full queue drops its oldest telemetry first, then its oldest status; a new
+// telemetry or status message with nothing at or below its rank to displace is dropped. A
+// client that can't even keep up with safety events and acks, or makes no progress for
+// WS_SLOW_CLIENT_TIMEOUT, is disconnected. Loop task only (webSocket.loop() runs the
+// event handler there too).
+#define WS_MESSAGE_CAPACITY 1536
+#define WS_POOL_SLOTS 12
+#define WS_CLIENT_QUEUE_MAX 6       // Messages queued per client, all priorities together
+#define WS_SEND_BURST 4             // Messages per client per loop pass
+#define WS_SLOW_CLIENT_TIMEOUT 2000 // ms a backed-up client may go without taking data
+#define WS_RETRY_INTERVAL 5         // ms between writability checks while a queue is blocked
+
+enum WsPriority : uint8_t {
+  WS_SAFETY,    // sensor_event, auto-stop
+  WS_ACK,       // command_ack, error
+  WS_STATUS,    // status_update, mission_event
+  WS_TELEMETRY, // sensor_data; stale frames are dropped first
+  WS_PRIORITY_COUNT
+};
+
+const char* const wsPriorityNames[] = { "safety", "ack", "status", "telemetry" };
+
+struct WsMessage {
+  uint8_t refs = 0; // Queue entries plus the composer's while it is being broadcast
+  uint16_t length = 0;
+  uint16_t stampAt = 0; // Text offset of a blank wsSendTick() fills with the send time, 0 = none
+  uint8_t frame[WEBSOCKETS_MAX_HEADER_SIZE + WS_MESSAGE_CAPACITY];
+};
+WsMessage wsPool[WS_POOL_SLOTS];
+
+struct WsClientQueue {
+  uint8_t slot[WS_CLIENT_QUEUE_MAX];        // Arrival order
+  WsPriority priority[WS_CLIENT_QUEUE_MAX];
+  uint8_t count = 0;
+  unsigned long stalledSince = 0;           // 0 = empty or made progress last pass
+  uint32_t sent = 0;
+  uint32_t dropped[WS_PRIORITY_COUNT] = {};
+};
+WsClientQueue wsQueues[WEBSOCKETS_SERVER_CLIENT_MAX];
+
+// The larger frames (status_update, scan_progress, scan_map) are built here rather than
+// on the loop task's 8KB stack, which is already holding the WebSocket callback and
+// command decode. Loop task only, one frame at a time.
+#define WS_LARGE_JSON_CAPACITY 2048
+StaticJsonDocument<WS_LARGE_JSON_CAPACITY> wsLargeDoc;
+
+struct WsStats {
+  uint32_t poolExhausted = 0;   // Messages dropped for lack of a free slot
+  uint32_t slowDisconnects = 0;
+} wsStats;
+
+// Clock sync and round-trip time
+// A client sends {"type":"time_sync","id":...} and keeps its own send (t0) and receive
+// (t3) times. The reply, to that client only, carries t1 (when the loop read the probe)
+// and t2 (written into the frame as it goes to the socket), both esp_timer microseconds
+// since boot: the clock millis() and every frame's "timestamp" count on. The loop reads
+// frames on its own schedule, so t1 trails arrival by up to the power state's latency
+// bound; clients should trust the probes with the shortest t3 - t0.
+// Separately, each client is pinged every WS_PING_INTERVAL with a sequence number as
+// payload, and the pong gives its round-trip time, published in /clients, status_update
+// and each time_sync reply. While a ping is out the loop polls every WS_PONG_POLL_INTERVAL.
+#define WS_STAMP_WIDTH 20          // Digits of the widest int64
+#define WS_STAMP_PLACEHOLDER "                    "
+#define WS_PING_INTERVAL 2000      // ms between pings; one unanswered by the next counts as lost
+#define WS_PONG_POLL_INTERVAL 2    // ms
+
+struct WsLatency {
+  uint32_t sequence = 0;       // Of the ping in flight, 0 = none
+  uint32_t sentAt = 0;         // micros()
+  unsigned long lastPing = 0;
+  uint32_t lastUs = 0;
+  uint32_t minUs = 0;
+  uint32_t averageUs = 0;      // Moves 1/8 of the way to each sample, like TCP's SRTT
+  uint32_t pongs = 0;
+  uint32_t lost = 0;
+};
+WsLatency wsLatency[WEBSOCKETS_SERVER_CLIENT_MAX];
+uint32_t wsPingSequence = 0;
+
+// Heap counters
+// Once connected, the control loop runs without allocating: allocatedBlocks and
+// largestFreeBlock stay flat under steady WebSocket traffic. HTTP requests and SSE
+// frames still allocate inside AsyncWebServer and are freed again.
+#define HEAP_LOG_INTERVAL 60000 // ms between EV_HEAP records
+
+struct HeapStats {
+  uint32_t framesDropped = 0; // Outbound frames larger than WS_MESSAGE_CAPACITY
+  unsigned long lastLog = 0;
+} heapStats;
+
+// OLED pipeline
+// Drawing goes to the Adafruit framebuffer on the loop task. presentOLED() copies the
+// finished frame into oled.pending and wakes oledFlushTask, which owns the I2C bus and
+// sends from its own copy. A frame presented while a flush is in flight replaces the
+// pending one, so callers never wait on the bus and the panel always ends on the newest.
+#define OLED_FRAME_BYTES (SCREEN_WIDTH * SCREEN_HEIGHT / 8)
+#define OLED_I2C_CHUNK 64 // Data bytes per I2C transaction (the Wire buffer holds 128)
+
+struct OledPipeline {
+  uint8_t pending[OLED_FRAME_BYTES];
+  uint8_t sending[OLED_FRAME_BYTES];      // Flush task only
+  bool framePending = false;
+  char requestedText[OLED_TEXT_CAPACITY]; // From REST /oled, applied by the loop
+  volatile bool textRequested = false;
+  uint32_t presented = 0;
+  uint32_t flushed = 0;
+  uint32_t coalesced = 0;                 // Frames replaced before they were sent
+  uint32_t lastFlushUs = 0;
+  uint32_t maxFlushUs = 0;
+  SemaphoreHandle_t lock = nullptr;       // Guards pending, framePending and requestedText
+  TaskHandle_t task = nullptr;
+} oled;
+
+// Capture
+// When armed (GET /capture?arm=1, kept in NVS), each boot records every loop pass with
+// the raw inputs it consumed (echo times, ADC readings, inbound WebSocket frames) and the
+// actuator outputs it produced, until the buffer fills. GET /capture.bin downloads it and
+// tools/replay runs it back through this file compiled natively. Loop task only; REST
+// actions are not recorded.
+#define CAPTURE_BUFFER_SIZE 49152
+#define CAPTURE_MAGIC 0x43554D45 // "EMUC", little-endian
+#define CAPTURE_VERSION 3
+#define CAPTURE_SHORT_TICK 0x80  // 0x80 | ms since the previous pass, for gaps under 128ms
+
+// Log: u32 magic, u8 version, 3 reserved bytes, then records, integers little-endian.
+// Every loop pass starts with a marker (a short tick byte, CAP_TICK or CAP_TICK_FAR);
+// the records after it belong to that pass.
+enum CaptureRecord : uint8_t {
+  CAP_TICK = 1,      // u16 ms since the previous pass
+  CAP_TICK_FAR,      // u32 ms since boot
+  CAP_ECHO,          // u16 echo time (us), 0 = no echo
+  CAP_ADC,           // u8 pin, u16 raw value
+  CAP_WS_CONNECT,    // u8 client
+  CAP_WS_DISCONNECT, // u8 client
+  CAP_WS_TEXT,       // u8 client, u16 length, payload
+  CAP_WS_BIN,        // u8 client, u16 length, payload
+  CAP_MOTOR,         // u8 direction, u8 left PWM, u8 right PWM
+  CAP_BUZZER,        // u8 state
+  CAP_WIFI,          // u8 link up, on each change seen by wifiTick()
+  CAP_WS_BLOCKED,    // u8 client whose socket had no room for the next queued frame
+  CAP_WS_DROPPED,    // u8 client disconnected by the loop (slow client or failed write)
+  CAP_ADC_CAL,       // u8 count, u16 mV per ADC table point; once, before the first pass
+  CAP_WS_PONG,       // u8 client, u16 length, payload
+  CAP_DRIVE          // i16 left duty, i16 right duty, from teleop
+};
+
+struct CaptureLog {
+  uint8_t* buffer = nullptr; // Allocated at boot, only when armed
+  uint32_t length = 0;
+  bool recording = false;
+  bool full = false;
+  unsigned long lastPass = 0;
+  uint32_t passOffset = 0;   // Where the pass in progress starts
+  bool dropping = false;     // The loop itself is sending or disconnecting
+} capture;
+
+// Built-in mission (replaces the old blocking patrol())
+const uint8_t mission_patrol[] PROGMEM = {
+  OP_EXPRESSION, 5, 0x00, 0x00, // thinking
+  OP_MOVE,       1, 0xD0, 0x07, // forward 2000ms
+  OP_JUMP_FAR,   5, 0x14, 0x00, // path clear (>= 20cm)? skip the back-off
+  OP_MOVE,       2, 0xF4, 0x01, // backward 500ms
+  OP_MOVE,       4, 0xE8, 0x03, // right 1000ms
+  OP_MOVE,       4, 0xDC, 0x05, // right 1500ms
+  OP_MOVE,       1, 0xD0, 0x07, // forward 2000ms
+  OP_EXPRESSION, 1, 0x00, 0x00, // happy
+  OP_END,        0, 0x00, 0x00
+};
+
 // OLED Eye Expressions (8x8 bitmaps)
 const unsigned char eye_neutral[] PROGMEM = {
   0x3C, 0x7E, 0xFF, 0xFF, 0xFF, 0xFF, 0x7E, 0x3C
@@ -86,11 +843,14 @@ const unsigned char eye_excited[] PROGMEM = {
 
 void setup() {
   Serial.begin(115200);
+  startFlightLog();
   
   // Initialize pins
   pinMode(TRIG_PIN, OUTPUT);
   pinMode(ECHO_PIN, INPUT);
   pinMode(SMOKE_PIN, INPUT);
+  pinMode(BATT_PIN, INPUT);
+  startSensorConversion();
   pinMode(BUZZER_PIN, OUTPUT);
   pinMode(MOTOR_LEFT_1, OUTPUT);
   pinMode(MOTOR_LEFT_2, OUTPUT);
@@ -103,31 +863,23 @@ void setup() {
   ledcAttachPin(MOTOR_LEFT_PWM, 0);
   ledcAttachPin(MOTOR_RIGHT_PWM, 1);
   
-  // Initialize OLED
-  if(!display.begin(SSD1306_SWITCHCAPVCC, SCREEN_ADDRESS)) {
+  // Initialize OLED (keep running headless if the panel is missing)
+  robot.displayReady = display.begin(SSD1306_SWITCHCAPVCC, SCREEN_ADDRESS);
+  startOLEDFlush();
+  if (robot.displayReady) {
+    display.clearDisplay();
+    display.setTextSize(1);
+    display.setTextColor(SSD1306_WHITE);
+    showBootScreen();
+  } else {
     Serial.println("SSD1306 allocation failed");
-    for(;;);
   }
+  boot.hardwareReady = millis();
+  startPowerManagement();
+  startCapture();
   
-  display.clearDisplay();
-  display.setTextSize(1);
-  display.setTextColor(SSD1306_WHITE);
-  showBootScreen();
-  
-  // Connect to WiFi
-  WiFi.begin(ssid, password);
-  while (WiFi.status() != WL_CONNECTED) {
-    delay(1000);
-    Serial.println("Connecting to WiFi...");
-    updateBootScreen("Connecting WiFi...");
-  }
-  
-  Serial.println("WiFi connected!");
-  Serial.print("IP address: ");
-  Serial.println(WiFi.localIP());
-  
-  updateBootScreen("WiFi Connected!");
-  updateBootScreen("IP: " + WiFi.localIP().toString());
+  // Connect to WiFi in the background; loop() and the safety checks start right away
+  startWiFi();
   
   // Setup WebSocket
   webSocket.begin();
@@ -135,395 +887,2138 @@ void setup() {
   
   // Setup REST API endpoints
   setupRESTAPI();
+  setupTelemetryStream();
   
   server.begin();
   Serial.println("EMU Robot Controller Ready! 🤖");
   
   // Show ready screen
-  displayEyes("happy");
-  robot.oledText = "EMU Ready! 🤖";
+  robot.expression = EXPR_HAPPY;
+  setOledText("Connecting WiFi...");
   updateOLED();
-  
-  delay(2000);
 }
 
 void loop() {
+  if (boot.firstControlTick == 0) boot.firstControlTick = millis();
+  captureTick();
+  
+  wifiTick();
   webSocket.loop();
+  restMoveTick();
+  missionTick();
+  teleopTick();
+  
+  // End of a timed move
+  if (robot.stopAt != 0 && (long)(millis() - robot.stopAt) >= 0) {
+    robot.stopAt = 0;
+    stopMotors();
+  }
   
   // Auto-blink every 3-5 seconds
-  if (millis() - robot.lastBlink > random(3000, 5000)) {
-    robot.lastBlink = millis();
-    robot.isBlinking = true;
-    displayEyes("blink");
-    delay(150);
+  if (robot.isBlinking && (long)(millis() - robot.blinkEnds) >= 0) {
     robot.isBlinking = false;
     displayEyes(robot.expression);
+  } else if (!robot.isBlinking && (long)(millis() - robot.nextBlink) >= 0) {
+    robot.nextBlink = millis() + random(3000, 5000);
+    robot.blinkEnds = millis() + 150;
+    robot.isBlinking = true;
+    displayEyes(EXPR_BLINK);
   }
   
-  // Read sensors and send data every 500ms
-  static unsigned long lastSensorRead = 0;
-  if (millis() - lastSensorRead > 500) {
-    lastSensorRead = millis();
+  // Each sensor is read when its adaptive schedule is due; threshold events go out as soon as they fire
+  sampleSensors();
+  scanTick();
+  
+  // Send sensor data every 500ms
+  if (millis() - lastSensorBroadcast >= SENSOR_BROADCAST_INTERVAL) {
+    lastSensorBroadcast = millis();
     sendSensorData();
-    
-    // Auto safety checks
-    float distance = readUltrasonic();
-    if (distance < robot.ultrasonicDanger && robot.direction != "stopped") {
-      stopMotors();
-      robot.direction = "stopped";
-      robot.expression = "surprised";
-      displayEyes("surprised");
-      sendCommandAck("auto_stop", "Emergency stop - obstacle too close");
-    }
   }
   
-  delay(50);
+  streamTick();
+  wsSendTick();
+  wsPingTick();
+  heapTick();
+  oledTick();
+  
+  powerTick();
+  idleUntilNextDeadline();
 }
 
-void showBootScreen() {
-  display.clearDisplay();
-  display.setCursor(0, 0);
-  display.println("EMU Robot v3.0");
-  display.println("Booting up...");
-  display.display();
+void startPowerManagement() {
+  loopTaskHandle = xTaskGetCurrentTaskHandle(); // setup() runs on the loop task
+  power.stateSince = millis();
+  
+#ifdef CONFIG_PM_ENABLE
+  esp_pm_config_esp32_t config = {};
+  config.max_freq_mhz = POWER_CPU_ACTIVE;
+  config.min_freq_mhz = POWER_CPU_IDLE;
+  config.light_sleep_enable = true;
+  esp_pm_configure(&config);
+  esp_pm_lock_create(ESP_PM_CPU_FREQ_MAX, 0, "active", &cpuMaxLock);
+  // LEDC motor PWM stops in light sleep, so it is held off whenever the motors may run
+  esp_pm_lock_create(ESP_PM_NO_LIGHT_SLEEP, 0, "active", &noLightSleepLock);
+  esp_pm_lock_acquire(cpuMaxLock);
+  esp_pm_lock_acquire(noLightSleepLock);
+#else
+  setCpuFrequencyMhz(POWER_CPU_ACTIVE);
+#endif
 }
 
-void updateBootScreen(String message) {
-  display.clearDisplay();
-  display.setCursor(0, 0);
-  display.println("EMU Robot v3.0");
-  display.println(message);
-  display.display();
-  delay(1000);
+void setPowerState(PowerState state) {
+  if (state == power.state) return;
+  unsigned long now = millis();
+  power.timeIn[power.state] += now - power.stateSince;
+  power.stateSince = now;
+  bool wasActive = power.state == POWER_ACTIVE;
+  power.state = state;
+  
+  if (state == POWER_ACTIVE) {
+#ifdef CONFIG_PM_ENABLE
+    esp_pm_lock_acquire(cpuMaxLock);
+    esp_pm_lock_acquire(noLightSleepLock);
+#else
+    setCpuFrequencyMhz(POWER_CPU_ACTIVE);
+#endif
+    WiFi.setSleep(false);
+  } else if (wasActive) {
+#ifdef CONFIG_PM_ENABLE
+    esp_pm_lock_release(cpuMaxLock);
+    esp_pm_lock_release(noLightSleepLock);
+#else
+    setCpuFrequencyMhz(POWER_CPU_IDLE);
+#endif
+    WiFi.setSleep(true); // Modem sleep: the radio wakes for DTIM beacons only
+  }
+  logEvent(EV_POWER, state, getCpuFrequencyMhz());
 }
 
-void updateOLED() {
-  display.clearDisplay();
-  
-  // Draw eyes at top
-  displayEyes(robot.expression);
-  
-  // Draw text at bottom
-  display.setCursor(0, 48);
-  display.setTextSize(1);
-  display.print(robot.oledText.substring(0, 21)); // Limit to screen width
-  
-  display.display();
+// Stream slots are only read here, so a torn view costs at most one tick of latency
+uint8_t streamClientCount() {
+  uint8_t count = 0;
+  for (int i = 0; i < STREAM_MAX_CLIENTS; i++) {
+    if (streamClients[i].client != nullptr) count++;
+  }
+  return count;
 }
 
-void displayEyes(String expression) {
-  const unsigned char* eyePattern;
-  
-  if (expression == "happy") eyePattern = eye_happy;
-  else if (expression == "sad") eyePattern = eye_sad;
-  else if (expression == "surprised") eyePattern = eye_surprised;
-  else if (expression == "angry") eyePattern = eye_angry;
-  else if (expression == "blink") eyePattern = eye_blink;
-  else if (expression == "thinking") eyePattern = eye_thinking;
-  else if (expression == "excited") eyePattern = eye_excited;
-  else eyePattern = eye_neutral;
+void powerTick() {
+  unsigned long now = millis();
+  if (driveSpeedCms() > 0 || mission.running || scan.running) power.lastBusy = now;
   
-  // Clear eye area
-  display.fillRect(32, 16, 64, 24, SSD1306_BLACK);
-  
-  // Draw left eye
-  display.drawBitmap(40, 20, eyePattern, 8, 8, SSD1306_WHITE);
-  
-  // Draw right eye
-  display.drawBitmap(72, 20, eyePattern, 8, 8, SSD1306_WHITE);
-  
-  // Add special effects for certain expressions
-  if (expression == "excited") {
-    // Add sparkles
-    display.drawPixel(36, 18, SSD1306_WHITE);
-    display.drawPixel(84, 18, SSD1306_WHITE);
-    display.drawPixel(38, 32, SSD1306_WHITE);
-    display.drawPixel(82, 32, SSD1306_WHITE);
-  } else if (expression == "thinking") {
-    // Add thought bubble dots
-    display.drawPixel(88, 16, SSD1306_WHITE);
-    display.drawCircle(92, 14, 1, SSD1306_WHITE);
-    display.drawCircle(96, 12, 2, SSD1306_WHITE);
+  if (now - power.lastBusy < POWER_ACTIVE_HOLD) {
+    setPowerState(POWER_ACTIVE);
+  } else if (webSocket.connectedClients() > 0 || streamClientCount() > 0) {
+    setPowerState(POWER_IDLE);
+  } else {
+    setPowerState(POWER_STANDBY);
   }
-  
-  display.display();
 }
 
-float readUltrasonic() {
-  if (!robot.ultrasonicEnabled) return 999.0;
+// Earliest moment loop() has work to do, capped by the current state's latency bound
+unsigned long nextDeadline(unsigned long now) {
+  unsigned long deadline = now + powerLatencyBound[power.state];
+  auto consider = [&deadline](unsigned long at) {
+    if ((long)(at - deadline) < 0) deadline = at;
+  };
   
-  digitalWrite(TRIG_PIN, LOW);
-  delayMicroseconds(2);
-  digitalWrite(TRIG_PIN, HIGH);
-  delayMicroseconds(10);
-  digitalWrite(TRIG_PIN, LOW);
+  for (const SensorSchedule* schedule : schedules) consider(schedule->lastSample + schedule->interval);
+  consider(lastSensorBroadcast + SENSOR_BROADCAST_INTERVAL);
+  consider(robot.isBlinking ? robot.blinkEnds : robot.nextBlink);
+  if (robot.stopAt != 0) consider(robot.stopAt);
+  if (scan.running) {
+    consider(scan.endsAt);
+    consider(scan.lastProgress + SCAN_PROGRESS_INTERVAL);
+  }
+  if (teleop.active) {
+    bool settled = teleop.left == teleop.targetLeft && teleop.right == teleop.targetRight;
+    consider(settled ? teleop.leaseEnds : now + TELEOP_TICK);
+  }
+  if (!wifi.online) consider(now + WIFI_POLL_INTERVAL);
+  if (wsQueuesPending()) consider(now + WS_RETRY_INTERVAL);
+  if (wsPingsPending()) consider(now + WS_PONG_POLL_INTERVAL);
+  for (uint8_t num = 0; num < WEBSOCKETS_SERVER_CLIENT_MAX; num++) {
+    if (webSocket.clientIsConnected(num)) consider(wsLatency[num].lastPing + WS_PING_INTERVAL);
+  }
   
-  long duration = pulseIn(ECHO_PIN, HIGH, 30000); // Timeout after 30ms
-  if (duration == 0) return 999.0; // No echo received
+  if (mission.running) {
+    // OP_WAIT_DIST steps wake with the ultrasonic schedule
+    bool waitingOnSensor = mission.busy && mission.program[mission.pc * MISSION_STEP_SIZE] == OP_WAIT_DIST;
+    if (!mission.busy) consider(now);
+    else if (!waitingOnSensor) consider(mission.deadline);
+  }
   
-  float distance = (duration * 0.034) / 2;
-  return constrain(distance, 0, 400); // Limit to sensor range
+  for (int i = 0; i < STREAM_MAX_CLIENTS; i++) {
+    const StreamClient& stream = streamClients[i];
+    if (stream.client != nullptr) consider(stream.lastSent + stream.interval);
+  }
+  return deadline;
 }
 
-float readSmoke() {
-  if (!robot.smokeEnabled) return 0.0;
+void idleUntilNextDeadline() {
+  unsigned long now = millis();
+  long wait = (long)(nextDeadline(now) - now);
+  if (wait <= 0) return;
   
-  int sensorValue = analogRead(SMOKE_PIN);
-  float percentage = map(sensorValue, 0, 4095, 0, 100);
-  return constrain(percentage, 0, 100);
+  if (ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(wait)) > 0) {
+    uint32_t requestedAt = power.wakeRequestedAt;
+    if (requestedAt != 0) {
+      power.wakeRequestedAt = 0;
+      uint32_t latency = micros() - requestedAt;
+      power.wakeups++;
+      power.wakeLatencyTotal += latency;
+      if (latency > power.wakeLatencyMax) power.wakeLatencyMax = latency;
+    }
+  }
+  power.sleptIn[power.state] += millis() - now;
 }
 
-void sendSensorData() {
-  float distance = readUltrasonic();
-  float smokeLevel = readSmoke();
-  bool smokeDetected = smokeLevel > robot.smokeSensitivity;
-  
-  DynamicJsonDocument doc(512);
-  doc["type"] = "sensor_data";
-  doc["data"]["ultrasonic"] = distance;
-  doc["data"]["smoke"] = smokeDetected;
-  doc["data"]["smokeLevel"] = smokeLevel;
-  doc["data"]["timestamp"] = millis();
-  
-  String output;
-  serializeJson(doc, output);
-  webSocket.broadcastTXT(output);
+// Safe from any task: cuts the loop's sleep short so a state change takes effect at once
+void wakeLoop() {
+  power.wakeRequestedAt = micros() | 1; // Never 0, which means "none pending"
+  if (loopTaskHandle != nullptr) xTaskNotifyGive(loopTaskHandle);
 }
 
-void sendCommandAck(String commandId, String message = "") {
-  DynamicJsonDocument doc(256);
-  doc["type"] = "command_ack";
-  doc["data"]["commandId"] = commandId;
-  doc["data"]["message"] = message;
-  doc["timestamp"] = millis();
-  
-  String output;
-  serializeJson(doc, output);
-  webSocket.broadcastTXT(output);
+void fillPowerReport(JsonObject report) {
+  unsigned long now = millis();
+  report["state"] = powerStateNames[power.state];
+  report["cpuMhz"] = getCpuFrequencyMhz();
+  report["latencyBoundMs"] = powerLatencyBound[power.state];
+  for (uint8_t i = 0; i < POWER_STATE_COUNT; i++) {
+    unsigned long time = power.timeIn[i] + (i == power.state ? now - power.stateSince : 0);
+    report["timeMs"][powerStateNames[i]] = time;
+    report["sleptMs"][powerStateNames[i]] = power.sleptIn[i];
+  }
+  report["wakeups"] = power.wakeups;
+  report["wakeLatencyMaxUs"] = power.wakeLatencyMax;
+  report["wakeLatencyAvgUs"] = power.wakeups ? (uint32_t)(power.wakeLatencyTotal / power.wakeups) : 0;
 }
 
-void sendError(String commandId, String error) {
-  DynamicJsonDocument doc(256);
-  doc["type"] = "error";
-  doc["data"]["commandId"] = commandId;
-  doc["data"]["message"] = error;
-  doc["timestamp"] = millis();
-  
-  String output;
-  serializeJson(doc, output);
-  webSocket.broadcastTXT(output);
+// Protocol names -> codes. Unknown names map to the safe default, as before.
+Direction directionFromName(const char* name) {
+  for (uint8_t i = 0; i < DIRECTION_COUNT; i++) {
+    if (strcmp(name, directionNames[i]) == 0) return (Direction)i;
+  }
+  return DIR_STOP;
 }
 
-void webSocketEvent(uint8_t num, WStype_t type, uint8_t * payload, size_t length) {
-  switch(type) {
-    case WStype_DISCONNECTED:
-      Serial.printf("[%u] Disconnected!\n", num);
-      break;
-      
-    case WStype_CONNECTED: {
-      IPAddress ip = webSocket.remoteIP(num);
-      Serial.printf("[%u] Connected from %d.%d.%d.%d\n", num, ip[0], ip[1], ip[2], ip[3]);
-      
-      // Send current status
-      sendCurrentStatus();
-      break;
-    }
-    
-    case WStype_TEXT: {
-      Serial.printf("[%u] Received: %s\n", num, payload);
-      
-      DynamicJsonDocument doc(1024);
-      deserializeJson(doc, payload);
-      
-      String commandId = doc["id"].as<String>();
-      String type = doc["type"].as<String>();
-      
-      if (type == "command") {
-        handleCommand(doc["data"], commandId);
-      }
-      break;
-    }
-    
-    default:
-      break;
+Expression expressionFromName(const char* name) {
+  for (uint8_t i = 0; i < EXPRESSION_COUNT; i++) {
+    if (strcmp(name, expressionNames[i]) == 0) return (Expression)i;
   }
+  return EXPR_NEUTRAL;
 }
 
-void handleCommand(JsonObject data, String commandId) {
-  String action = data["action"].as<String>();
-  
-  if (action == "move") {
-    String direction = data["direction"].as<String>();
-    int duration = data["duration"] | 0;
-    
-    moveRobot(direction);
-    
-    if (duration > 0) {
-      delay(duration);
-      stopMotors();
-      robot.direction = "stopped";
-    }
-    
-    sendCommandAck(commandId, "Movement command executed");
-    
-  } else if (action == "buzzer") {
-    bool state = data["state"].as<bool>();
-    robot.buzzer = state;
-    digitalWrite(BUZZER_PIN, state ? HIGH : LOW);
-    
-    sendCommandAck(commandId, state ? "Buzzer ON" : "Buzzer OFF");
-    
-  } else if (action == "oled") {
-    String text = data["text"].as<String>();
-    robot.oledText = text;
-    updateOLED();
-    
-    sendCommandAck(commandId, "OLED updated");
-    
-  } else if (action == "expression") {
-    String expression = data["expression"].as<String>();
-    robot.expression = expression;
-    displayEyes(expression);
-    
-    sendCommandAck(commandId, "Expression changed to " + expression);
-    
-  } else if (action == "patrol") {
-    // Automated patrol behavior
-    patrol();
-    sendCommandAck(commandId, "Patrol completed");
-    
-  } else if (action == "scan") {
-    // Environmental scan
-    scan();
-    sendCommandAck(commandId, "Scan completed");
-    
-  } else {
-    sendError(commandId, "Unknown command: " + action);
-  }
+// The reported motion state says "stopped" rather than the "stop" command
+const char* directionState(Direction direction) {
+  return direction == DIR_STOP ? "stopped" : directionNames[direction];
 }
 
-void moveRobot(String direction) {
-  robot.direction = direction;
+// Copies at most OLED_TEXT_CAPACITY - 1 bytes, cut back to a whole UTF-8 character
+void setOledText(const char* text) {
+  strlcpy(robot.oledText, text, sizeof(robot.oledText));
+  size_t length = strlen(robot.oledText);
+  if (length < sizeof(robot.oledText) - 1) return;
   
-  if (direction == "forward") {
+  size_t start = length;
+  while (start > 0 && (robot.oledText[start - 1] & 0xC0) == 0x80) start--;
+  if (start == 0) return;
+  uint8_t lead = robot.oledText[start - 1];
+  size_t need = lead >= 0xF0 ? 4 : lead >= 0xE0 ? 3 : lead >= 0xC0 ? 2 : 1;
+  if (length - (start - 1) < need) robot.oledText[start - 1] = '\0';
+}
+
+int8_t freeMessageSlot() {
+  for (int8_t i = 0; i < WS_POOL_SLOTS; i++) {
+    if (wsPool[i].refs == 0) return i;
+  }
+  return -1;
+}
+
+void releaseMessage(uint8_t slot) {
+  if (wsPool[slot].refs > 0) wsPool[slot].refs--;
+}
+
+void removeQueued(WsClientQueue& queue, uint8_t index) {
+  queue.count--;
+  memmove(&queue.slot[index], &queue.slot[index + 1], queue.count - index);
+  memmove(&queue.priority[index], &queue.priority[index + 1], (queue.count - index) * sizeof(WsPriority));
+}
+
+bool dropOldest(WsClientQueue& queue, WsPriority priority) {
+  for (uint8_t i = 0; i < queue.count; i++) {
+    if (queue.priority[i] != priority) continue;
+    releaseMessage(queue.slot[i]);
+    removeQueued(queue, i);
+    queue.dropped[priority]++;
+    return true;
+  }
+  return false;
+}
+
+void clearQueue(uint8_t num) {
+  WsClientQueue& queue = wsQueues[num];
+  for (uint8_t i = 0; i < queue.count; i++) releaseMessage(queue.slot[i]);
+  queue.count = 0;
+  queue.stalledSince = 0;
+}
+
+void disconnectSlowClient(uint8_t num) {
+  logEvent(EV_WS_SLOW, num, wsQueues[num].count);
+  wsStats.slowDisconnects++;
+  clearQueue(num);
+  capture.dropping = true;
+  webSocket.disconnect(num);
+  capture.dropping = false;
+}
+
+// Serializes into a pool slot and returns it with one reference held; -1 = dropped.
+// With the pool full, queued telemetry is given up to make room.
+int8_t composeMessage(const JsonDocument& doc) {
+  int8_t slot = freeMessageSlot();
+  while (slot < 0) {
+    bool dropped = false;
+    for (uint8_t num = 0; num < WEBSOCKETS_SERVER_CLIENT_MAX && slot < 0; num++) {
+      dropped |= dropOldest(wsQueues[num], WS_TELEMETRY);
+      slot = freeMessageSlot();
+    }
+    if (!dropped) break;
+  }
+  if (slot < 0) {
+    wsStats.poolExhausted++;
+    return -1;
+  }
+  
+  WsMessage& message = wsPool[slot];
+  size_t length = serializeJson(doc, (char *)message.frame + WEBSOCKETS_MAX_HEADER_SIZE, WS_MESSAGE_CAPACITY);
+  if (length >= WS_MESSAGE_CAPACITY - 1) {
+    heapStats.framesDropped++;
+    return -1;
+  }
+  message.length = length;
+  message.stampAt = 0;
+  message.refs = 1;
+  return slot;
+}
+
+const char* messageText(int8_t slot) {
+  return (const char *)wsPool[slot].frame + WEBSOCKETS_MAX_HEADER_SIZE;
+}
+
+void enqueueMessage(uint8_t num, uint8_t slot, WsPriority priority) {
+  WsClientQueue& queue = wsQueues[num];
+  if (queue.count == WS_CLIENT_QUEUE_MAX) {
+    bool room = dropOldest(queue, WS_TELEMETRY);
+    if (!room && priority == WS_TELEMETRY) {
+      queue.dropped[WS_TELEMETRY]++;
+      return;
+    }
+    if (!room) room = dropOldest(queue, WS_STATUS);
+    if (!room && priority == WS_STATUS) {
+      // The next status_update supersedes this one
+      queue.dropped[WS_STATUS]++;
+      return;
+    }
+    if (!room) {
+      // Nothing left to shed but safety events and acks
+      disconnectSlowClient(num);
+      return;
+    }
+  }
+  queue.slot[queue.count] = slot;
+  queue.priority[queue.count] = priority;
+  queue.count++;
+  wsPool[slot].refs++;
+}
+
+// Queues the message on every connected client and drops the composer's reference
+void broadcastMessage(int8_t slot, WsPriority priority) {
+  for (uint8_t num = 0; num < WEBSOCKETS_SERVER_CLIENT_MAX; num++) {
+    if (webSocket.clientIsConnected(num)) enqueueMessage(num, slot, priority);
+  }
+  releaseMessage(slot);
+}
+
+void broadcastJson(const JsonDocument& doc, WsPriority priority) {
+  int8_t slot = composeMessage(doc);
+  if (slot >= 0) broadcastMessage(slot, priority);
+}
+
+// canWrite() with a "no" recorded, so replay hands out the same answer
+bool clientWritable(uint8_t num) {
+  if (webSocket.canWrite(num)) return true;
+  captureFrame(CAP_WS_BLOCKED, num);
+  return false;
+}
+
+void stampTransmitTime(WsMessage& message) {
+  char digits[WS_STAMP_WIDTH + 1];
+  int length = snprintf(digits, sizeof(digits), "%lld", (long long)esp_timer_get_time());
+  char* field = (char *)message.frame + WEBSOCKETS_MAX_HEADER_SIZE + message.stampAt;
+  memset(field, ' ', WS_STAMP_WIDTH);
+  memcpy(field, digits, length);
+}
+
+void wsSendTick() {
+  unsigned long now = millis();
+  for (uint8_t num = 0; num < WEBSOCKETS_SERVER_CLIENT_MAX; num++) {
+    WsClientQueue& queue = wsQueues[num];
+    if (queue.count == 0) continue;
+    
+    uint8_t burst = 0;
+    while (queue.count > 0 && burst < WS_SEND_BURST) {
+      if (!clientWritable(num)) break;
+      uint8_t next = 0;
+      for (uint8_t i = 1; i < queue.count; i++) {
+        if (queue.priority[i] < queue.priority[next]) next = i;
+      }
+      // Dequeued before sending: a failed write disconnects the client and clears its queue
+      uint8_t slot = queue.slot[next];
+      removeQueued(queue, next);
+      if (wsPool[slot].stampAt != 0) stampTransmitTime(wsPool[slot]);
+      capture.dropping = true;
+      webSocket.sendTXT(num, wsPool[slot].frame, wsPool[slot].length, true);
+      capture.dropping = false;
+      releaseMessage(slot);
+      queue.sent++;
+      burst++;
+    }
+    
+    if (burst > 0 || queue.count == 0) {
+      queue.stalledSince = 0;
+    } else if (queue.stalledSince == 0) {
+      queue.stalledSince = now;
+    } else if (now - queue.stalledSince >= WS_SLOW_CLIENT_TIMEOUT) {
+      disconnectSlowClient(num);
+    }
+  }
+}
+
+// Pings go straight to the socket, ahead of anything queued, so the pong times the link
+// and the client rather than this queue. A blocked socket is skipped until the next interval.
+void wsPingTick() {
+  unsigned long now = millis();
+  for (uint8_t num = 0; num < WEBSOCKETS_SERVER_CLIENT_MAX; num++) {
+    WsLatency& latency = wsLatency[num];
+    if (!webSocket.clientIsConnected(num) || now - latency.lastPing < WS_PING_INTERVAL) continue;
+    latency.lastPing = now;
+    if (latency.sequence != 0) {
+      latency.lost++;
+      latency.sequence = 0;
+    }
+    if (!clientWritable(num)) continue;
+    
+    if (++wsPingSequence == 0) wsPingSequence = 1;
+    latency.sequence = wsPingSequence;
+    latency.sentAt = micros();
+    uint8_t payload[sizeof(latency.sequence)];
+    memcpy(payload, &latency.sequence, sizeof(payload));
+    capture.dropping = true; // A failed write disconnects the client
+    webSocket.sendPing(num, payload, sizeof(payload));
+    capture.dropping = false;
+  }
+}
+
+// Pongs that don't answer the ping in flight (late, or unsolicited) are ignored
+void handlePong(uint8_t num, const uint8_t* payload, size_t length) {
+  WsLatency& latency = wsLatency[num];
+  uint32_t sequence;
+  if (latency.sequence == 0 || length != sizeof(sequence)) return;
+  memcpy(&sequence, payload, sizeof(sequence));
+  if (sequence != latency.sequence) return;
+  
+  latency.sequence = 0;
+  latency.lastUs = micros() - latency.sentAt;
+  if (latency.pongs == 0) {
+    latency.minUs = latency.averageUs = latency.lastUs;
+  } else {
+    latency.minUs = min(latency.minUs, latency.lastUs);
+    latency.averageUs = latency.averageUs - latency.averageUs / 8 + latency.lastUs / 8;
+  }
+  latency.pongs++;
+}
+
+bool wsPingsPending() {
+  for (uint8_t num = 0; num < WEBSOCKETS_SERVER_CLIENT_MAX; num++) {
+    if (wsLatency[num].sequence != 0) return true;
+  }
+  return false;
+}
+
+bool wsQueuesPending() {
+  for (const WsClientQueue& queue : wsQueues) {
+    if (queue.count > 0) return true;
+  }
+  return false;
+}
+
+// Read from the web server task too; counters may be a pass behind
+void fillClientReport(JsonArray report) {
+  for (uint8_t num = 0; num < WEBSOCKETS_SERVER_CLIENT_MAX; num++) {
+    if (!webSocket.clientIsConnected(num)) continue;
+    const WsClientQueue& queue = wsQueues[num];
+    JsonObject client = report.createNestedObject();
+    client["num"] = num;
+    client["queued"] = queue.count;
+    client["sent"] = queue.sent;
+    for (uint8_t i = 0; i < WS_PRIORITY_COUNT; i++) client["dropped"][wsPriorityNames[i]] = queue.dropped[i];
+    const WsLatency& latency = wsLatency[num];
+    client["rttUs"] = latency.lastUs;
+    client["rttAvgUs"] = latency.averageUs;
+    client["rttMinUs"] = latency.minUs;
+    client["pongs"] = latency.pongs;
+    client["pingsLost"] = latency.lost;
+  }
+}
+
+void fillHeapReport(JsonObject report) {
+  multi_heap_info_t info;
+  heap_caps_get_info(&info, MALLOC_CAP_DEFAULT);
+  report["free"] = info.total_free_bytes;
+  report["minFree"] = info.minimum_free_bytes;
+  report["largestFreeBlock"] = info.largest_free_block;
+  report["allocatedBlocks"] = info.allocated_blocks;
+  report["framesDropped"] = heapStats.framesDropped;
+}
+
+void heapTick() {
+  if (millis() - heapStats.lastLog < HEAP_LOG_INTERVAL) return;
+  heapStats.lastLog = millis();
+  
+  multi_heap_info_t info;
+  heap_caps_get_info(&info, MALLOC_CAP_DEFAULT);
+  logEvent(EV_HEAP, min(info.allocated_blocks, (size_t)0xFFFF), info.largest_free_block);
+}
+
+void startCapture() {
+  Preferences store;
+  store.begin("capture", true);
+  bool armed = store.getBool("armed", false);
+  store.end();
+  if (!armed) return;
+  
+  capture.buffer = (uint8_t *)malloc(CAPTURE_BUFFER_SIZE);
+  if (capture.buffer == nullptr) return;
+  uint32_t magic = CAPTURE_MAGIC;
+  memcpy(capture.buffer, &magic, sizeof(magic));
+  capture.buffer[4] = CAPTURE_VERSION;
+  memset(capture.buffer + 5, 0, 3);
+  capture.length = 8;
+  capture.recording = true;
+  
+  // The chip's eFuse calibration, so a replay converts readings the same way
+  uint8_t head[2] = { CAP_ADC_CAL, ADC_TABLE_SIZE };
+  captureWrite(head, sizeof(head), conversion.adcMillivolts, sizeof(conversion.adcMillivolts));
+}
+
+// Starts each loop pass with its marker; a replay runs one loop() per marker at that time
+void captureTick() {
+  if (!capture.recording) return;
+  unsigned long now = millis();
+  unsigned long gap = now - capture.lastPass;
+  uint8_t marker[5];
+  size_t size;
+  if (gap < 0x80) {
+    marker[0] = CAPTURE_SHORT_TICK | gap;
+    size = 1;
+  } else if (gap <= 0xFFFF) {
+    marker[0] = CAP_TICK;
+    memcpy(&marker[1], &gap, 2);
+    size = 3;
+  } else {
+    uint32_t at = now;
+    marker[0] = CAP_TICK_FAR;
+    memcpy(&marker[1], &at, 4);
+    size = 5;
+  }
+  capture.lastPass = now;
+  capture.passOffset = capture.length;
+  captureWrite(marker, size, nullptr, 0);
+}
+
+// When a record doesn't fit, the unfinished pass is dropped too and recording stops, so
+// the log always ends on a whole pass.
+void captureWrite(const uint8_t* head, size_t headSize, const void* data, size_t dataSize) {
+  size_t size = headSize + dataSize;
+  if (capture.length + size > CAPTURE_BUFFER_SIZE) {
+    capture.recording = false;
+    capture.full = true;
+    __atomic_store_n(&capture.length, capture.passOffset, __ATOMIC_RELEASE);
+    return;
+  }
+  memcpy(capture.buffer + capture.length, head, headSize);
+  if (dataSize > 0) memcpy(capture.buffer + capture.length + headSize, data, dataSize);
+  __atomic_store_n(&capture.length, capture.length + size, __ATOMIC_RELEASE); // Published to /capture.bin
+}
+
+void captureRecord(CaptureRecord type, const void* fields, size_t fieldsSize, const void* data = nullptr, size_t dataSize = 0) {
+  if (!capture.recording || capture.passOffset == 0 || xTaskGetCurrentTaskHandle() != loopTaskHandle) return;
+  uint8_t head[5];
+  head[0] = type;
+  memcpy(head + 1, fields, fieldsSize);
+  captureWrite(head, 1 + fieldsSize, data, dataSize);
+}
+
+void captureFrame(CaptureRecord type, uint8_t num, const uint8_t* payload = nullptr, size_t length = 0) {
+  if (!capture.recording) return;
+  if (type == CAP_WS_TEXT || type == CAP_WS_BIN || type == CAP_WS_PONG) {
+    uint8_t fields[3] = { num, (uint8_t)(length & 0xFF), (uint8_t)(length >> 8) };
+    captureRecord(type, fields, sizeof(fields), payload, length);
+  } else {
+    captureRecord(type, &num, 1);
+  }
+}
+
+void captureAdc(uint8_t pin, uint16_t value) {
+  if (!capture.recording) return;
+  uint8_t fields[3] = { pin, (uint8_t)(value & 0xFF), (uint8_t)(value >> 8) };
+  captureRecord(CAP_ADC, fields, sizeof(fields));
+}
+
+void captureMotor(Direction direction, uint8_t left, uint8_t right) {
+  if (!capture.recording) return;
+  uint8_t fields[3] = { direction, left, right };
+  captureRecord(CAP_MOTOR, fields, sizeof(fields));
+}
+
+void captureDrive(int16_t left, int16_t right) {
+  if (!capture.recording) return;
+  int16_t fields[2] = { left, right };
+  captureRecord(CAP_DRIVE, fields, sizeof(fields));
+}
+
+void writeBuzzer(bool on) {
+  digitalWrite(BUZZER_PIN, on ? HIGH : LOW);
+  if (!capture.recording) return;
+  uint8_t state = on;
+  captureRecord(CAP_BUZZER, &state, 1);
+}
+
+void startFlightLog() {
+  // Keep the previous run's history across a crash/soft reset; power-on leaves garbage
+  if (flightLog.magic != FLIGHT_LOG_MAGIC) {
+    memset(&flightLog, 0, sizeof(flightLog));
+    flightLog.magic = FLIGHT_LOG_MAGIC;
+  }
+  flightLogPrinted = flightLog.head;
+  logEvent(EV_BOOT, esp_reset_reason());
+  
+  xTaskCreatePinnedToCore(flightLogTask, "flightlog", 3072, NULL, tskIDLE_PRIORITY + 1, NULL, 0);
+}
+
+// Safe from any task; writers claim a slot with one atomic add and publish it via seq
+void logEvent(uint16_t event, uint16_t arg0 = 0, uint32_t arg1 = 0) {
+  uint32_t index = __atomic_fetch_add(&flightLog.head, 1, __ATOMIC_RELAXED);
+  FlightRecord& record = flightLog.records[index & (FLIGHT_LOG_RECORDS - 1)];
+  
+  __atomic_store_n(&record.seq, 0, __ATOMIC_RELAXED);
+  record.timestamp = micros();
+  record.event = event;
+  record.arg0 = arg0;
+  record.arg1 = arg1;
+  __atomic_store_n(&record.seq, index + 1, __ATOMIC_RELEASE);
+}
+
+// Copies record `index` out of the ring; returns false (zeroed record) if it is being
+// rewritten or has already been overwritten
+bool readFlightRecord(uint32_t index, FlightRecord& out) {
+  const FlightRecord& record = flightLog.records[index & (FLIGHT_LOG_RECORDS - 1)];
+  if (__atomic_load_n(&record.seq, __ATOMIC_ACQUIRE) == index + 1) {
+    out = record;
+    if (__atomic_load_n(&record.seq, __ATOMIC_ACQUIRE) == index + 1) return true;
+  }
+  memset(&out, 0, sizeof(out));
+  return false;
+}
+
+// Packs the first four characters of a name into a record argument
+uint32_t packTag(const char* name) {
+  uint32_t tag = 0;
+  for (int i = 0; i < 4 && name[i] != '\0'; i++) tag |= (uint32_t)(uint8_t)name[i] << (i * 8);
+  return tag;
+}
+
+// Drains new records to Serial, only as fast as the UART buffer has room
+void flightLogTask(void *arg) {
+  for (;;) {
+    uint32_t head = __atomic_load_n(&flightLog.head, __ATOMIC_ACQUIRE);
+    if (head - flightLogPrinted > FLIGHT_LOG_RECORDS) {
+      uint32_t lost = head - flightLogPrinted - FLIGHT_LOG_RECORDS;
+      flightLogPrinted = head - FLIGHT_LOG_RECORDS;
+      logEvent(EV_LOG_OVERRUN, 0, lost);
+    }
+    
+    while (flightLogPrinted != head && Serial.availableForWrite() > FLIGHT_LOG_LINE_MAX) {
+      FlightRecord record;
+      if (readFlightRecord(flightLogPrinted, record)) {
+        const char* name = record.event < sizeof(flightEventNames) / sizeof(flightEventNames[0])
+                           ? flightEventNames[record.event] : "?";
+        Serial.printf("[%10lu] %-17s %5u %lu\n", (unsigned long)record.timestamp, name, record.arg0,
+                      (unsigned long)record.arg1);
+      }
+      flightLogPrinted++;
+    }
+    
+    vTaskDelay(pdMS_TO_TICKS(FLIGHT_LOG_DRAIN_INTERVAL));
+  }
+}
+
+void startWiFi() {
+  WiFi.mode(WIFI_STA);
+  WiFi.persistent(false); // We keep our own cache; don't rewrite the SDK config on every begin()
+  WiFi.setAutoReconnect(true);
+  
+  preferences.begin("wifi", false);
+  wifi.fastConnect = preferences.getBytes("cache", &wifi.cache, sizeof(wifi.cache)) == sizeof(wifi.cache) &&
+                     wifi.cache.version == WIFI_CACHE_VERSION;
+  
+  if (wifi.fastConnect) {
+    // Skip the channel scan (and DHCP, if WIFI_REUSE_IP) by going straight to the last AP
+    if (WIFI_REUSE_IP) {
+      WiFi.config(IPAddress(wifi.cache.ip), IPAddress(wifi.cache.gateway),
+                  IPAddress(wifi.cache.subnet), IPAddress(wifi.cache.dns));
+    }
+    WiFi.begin(ssid, password, wifi.cache.channel, wifi.cache.bssid);
+  } else {
+    WiFi.begin(ssid, password);
+  }
+  
+  boot.fastConnect = wifi.fastConnect;
+  wifi.attemptStarted = millis();
+}
+
+void wifiTick() {
+  bool connected = WiFi.status() == WL_CONNECTED;
+  if (connected != wifi.online) captureRecord(CAP_WIFI, &connected, 1);
+  
+  if (connected && !wifi.online) {
+    wifi.online = true;
+    if (boot.wifiConnected == 0) boot.wifiConnected = millis();
+    
+    logEvent(EV_WIFI_UP, 0, WiFi.localIP());
+    saveWifiCache();
+    
+    IPAddress ip = WiFi.localIP();
+    snprintf(robot.oledText, sizeof(robot.oledText), "IP: %u.%u.%u.%u", ip[0], ip[1], ip[2], ip[3]);
+    updateOLED();
+    
+  } else if (!connected && wifi.online) {
+    // The SDK reconnects on its own
+    wifi.online = false;
+    logEvent(EV_WIFI_DOWN);
+    
+  } else if (!connected && wifi.fastConnect && millis() - wifi.attemptStarted > WIFI_FAST_CONNECT_TIMEOUT) {
+    // AP moved channel or the lease is gone: forget the cache and do a normal connect
+    logEvent(EV_WIFI_FALLBACK);
+    wifi.fastConnect = false;
+    preferences.remove("cache");
+    WiFi.disconnect();
+    WiFi.config(INADDR_NONE, INADDR_NONE, INADDR_NONE);
+    WiFi.begin(ssid, password);
+    wifi.attemptStarted = millis();
+  }
+}
+
+void saveWifiCache() {
+  WifiCache cache;
+  memset(&cache, 0, sizeof(cache));
+  cache.version = WIFI_CACHE_VERSION;
+  cache.channel = WiFi.channel();
+  memcpy(cache.bssid, WiFi.BSSID(), sizeof(cache.bssid));
+  cache.ip = WiFi.localIP();
+  cache.gateway = WiFi.gatewayIP();
+  cache.subnet = WiFi.subnetMask();
+  cache.dns = WiFi.dnsIP();
+  
+  // Only touch NVS when something changed
+  if (wifi.fastConnect && memcmp(&cache, &wifi.cache, sizeof(cache)) == 0) return;
+  wifi.cache = cache;
+  preferences.putBytes("cache", &cache, sizeof(cache));
+}
+
+void showBootScreen() {
+  display.clearDisplay();
+  display.setCursor(0, 0);
+  display.println("EMU Robot v3.0");
+  display.println("Booting up...");
+  presentOLED();
+}
+
+void startOLEDFlush() {
+  oled.lock = xSemaphoreCreateMutex();
+  if (!robot.displayReady) return;
+  Wire.setClock(OLED_I2C_CLOCK);
+  xTaskCreatePinnedToCore(oledFlushTask, "oled", 2048, NULL, tskIDLE_PRIORITY + 1, &oled.task, 0);
+}
+
+// Hands the current framebuffer to the flush task; never touches the bus
+void presentOLED() {
+  if (!robot.displayReady) return;
+  
+  xSemaphoreTake(oled.lock, portMAX_DELAY);
+  memcpy(oled.pending, display.getBuffer(), OLED_FRAME_BYTES);
+  if (oled.framePending) oled.coalesced++;
+  oled.framePending = true;
+  oled.presented++;
+  xSemaphoreGive(oled.lock);
+  xTaskNotifyGive(oled.task);
+}
+
+void oledFlushTask(void *arg) {
+  for (;;) {
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    
+    xSemaphoreTake(oled.lock, portMAX_DELAY);
+    bool send = oled.framePending;
+    if (send) memcpy(oled.sending, oled.pending, OLED_FRAME_BYTES);
+    oled.framePending = false;
+    xSemaphoreGive(oled.lock);
+    if (!send) continue;
+    
+    uint32_t started = micros();
+    sendOLEDFrame(oled.sending);
+    oled.lastFlushUs = micros() - started;
+    if (oled.lastFlushUs > oled.maxFlushUs) oled.maxFlushUs = oled.lastFlushUs;
+    oled.flushed++;
+  }
+}
+
+// Same transfer as Adafruit_SSD1306::display(), from a buffer the loop can't touch
+void sendOLEDFrame(const uint8_t* frame) {
+  static const uint8_t window[] = {
+    0x00, // Command stream
+    SSD1306_PAGEADDR, 0, 0xFF,
+    SSD1306_COLUMNADDR, 0, SCREEN_WIDTH - 1
+  };
+  Wire.beginTransmission(SCREEN_ADDRESS);
+  Wire.write(window, sizeof(window));
+  Wire.endTransmission();
+  
+  for (size_t offset = 0; offset < OLED_FRAME_BYTES; offset += OLED_I2C_CHUNK) {
+    Wire.beginTransmission(SCREEN_ADDRESS);
+    Wire.write((uint8_t)0x40); // Data stream
+    Wire.write(frame + offset, OLED_I2C_CHUNK);
+    Wire.endTransmission();
+  }
+}
+
+// Applies text posted by REST /oled, which must not draw from the web server task
+void oledTick() {
+  if (!oled.textRequested) return;
+  
+  xSemaphoreTake(oled.lock, portMAX_DELAY);
+  setOledText(oled.requestedText);
+  oled.textRequested = false;
+  xSemaphoreGive(oled.lock);
+  updateOLED();
+}
+
+void updateOLED() {
+  if (!robot.displayReady) return;
+  
+  display.clearDisplay();
+  
+  // Draw eyes at top
+  displayEyes(robot.expression);
+  
+  // Draw text at bottom
+  display.setCursor(0, 48);
+  display.setTextSize(1);
+  display.write((const uint8_t *)robot.oledText, min(strlen(robot.oledText), (size_t)21)); // Limit to screen width
+  
+  presentOLED();
+}
+
+void displayEyes(Expression expression) {
+  if (!robot.displayReady) return;
+  
+  static const unsigned char* const eyePatterns[] = {
+    eye_neutral, eye_happy, eye_sad, eye_surprised, eye_angry, eye_thinking, eye_excited, eye_blink
+  };
+  const unsigned char* eyePattern = eyePatterns[expression];
+  
+  // Clear eye area
+  display.fillRect(32, 16, 64, 24, SSD1306_BLACK);
+  
+  // Draw left eye
+  display.drawBitmap(40, 20, eyePattern, 8, 8, SSD1306_WHITE);
+  
+  // Draw right eye
+  display.drawBitmap(72, 20, eyePattern, 8, 8, SSD1306_WHITE);
+  
+  // Add special effects for certain expressions
+  if (expression == EXPR_EXCITED) {
+    // Add sparkles
+    display.drawPixel(36, 18, SSD1306_WHITE);
+    display.drawPixel(84, 18, SSD1306_WHITE);
+    display.drawPixel(38, 32, SSD1306_WHITE);
+    display.drawPixel(82, 32, SSD1306_WHITE);
+  } else if (expression == EXPR_THINKING) {
+    // Add thought bubble dots
+    display.drawPixel(88, 16, SSD1306_WHITE);
+    display.drawCircle(92, 14, 1, SSD1306_WHITE);
+    display.drawCircle(96, 12, 2, SSD1306_WHITE);
+  }
+  
+  presentOLED();
+}
+
+void startSensorConversion() {
+  // analogRead() runs ADC1 at 12 bits and 11dB
+  esp_adc_cal_characteristics_t characteristics;
+  esp_adc_cal_characterize(ADC_UNIT_1, ADC_ATTEN_DB_11, ADC_WIDTH_BIT_12, ADC_DEFAULT_VREF, &characteristics);
+  for (uint16_t i = 0; i < ADC_TABLE_SIZE; i++) {
+    uint32_t raw = min((uint32_t)i << ADC_TABLE_SHIFT, (uint32_t)4095);
+    conversion.adcMillivolts[i] = esp_adc_cal_raw_to_voltage(raw, &characteristics);
+  }
+  updateSoundScale();
+}
+
+void updateSoundScale() {
+  conversion.soundScale = tableLookup(soundTable.values, SOUND_TABLE_SIZE, lroundf(robot.airTemperature * 10),
+                                      SOUND_TABLE_ORIGIN, SOUND_TABLE_SHIFT);
+}
+
+// Linear interpolation in a table sampled every 1 << shift units from origin, clamped at both ends
+uint16_t tableLookup(const uint16_t* table, size_t size, int32_t x, int32_t origin, uint8_t shift) {
+  if (x <= origin) return table[0];
+  uint32_t offset = x - origin;
+  size_t i = offset >> shift;
+  if (i >= size - 1) return table[size - 1];
+  int32_t fraction = offset & ((1 << shift) - 1);
+  return table[i] + (((int32_t)table[i + 1] - table[i]) * fraction >> shift);
+}
+
+uint16_t adcMillivolts(uint16_t raw) {
+  return tableLookup(conversion.adcMillivolts, ADC_TABLE_SIZE, raw, 0, ADC_TABLE_SHIFT);
+}
+
+float readUltrasonic() {
+  if (!robot.ultrasonicEnabled) return 999.0;
+  
+  digitalWrite(TRIG_PIN, LOW);
+  delayMicroseconds(2);
+  digitalWrite(TRIG_PIN, HIGH);
+  delayMicroseconds(10);
+  digitalWrite(TRIG_PIN, LOW);
+  
+  long duration = pulseIn(ECHO_PIN, HIGH, 30000); // Timeout after 30ms
+  if (capture.recording) {
+    uint16_t echo = duration;
+    captureRecord(CAP_ECHO, &echo, sizeof(echo));
+  }
+  if (duration == 0) return 999.0; // No echo received
+  
+  uint32_t millimetres = ((uint32_t)duration * conversion.soundScale) >> 16;
+  return min(millimetres, (uint32_t)4000) / 10.0f; // Limit to sensor range
+}
+
+float readSmoke() {
+  if (!robot.smokeEnabled) return 0.0;
+  
+  int sensorValue = analogRead(SMOKE_PIN);
+  captureAdc(SMOKE_PIN, sensorValue);
+  uint16_t millivolts = adcMillivolts(sensorValue);
+  sensors.smokePpm = tableLookup(smokePpmTable.values, SMOKE_TABLE_SIZE, millivolts, 0, SMOKE_TABLE_SHIFT);
+  return tableLookup(smokeLevelTable.values, SMOKE_TABLE_SIZE, millivolts, 0, SMOKE_TABLE_SHIFT) / 10.0f;
+}
+
+float readBattery() {
+  int sensorValue = analogRead(BATT_PIN);
+  captureAdc(BATT_PIN, sensorValue);
+  sensors.batteryMillivolts = adcMillivolts(sensorValue) * BATT_DIVIDER_RATIO;
+  uint16_t cell = sensors.batteryMillivolts / BATT_CELLS;
+  return tableLookup(batteryTable.values, BATT_TABLE_SIZE, cell, BATT_TABLE_ORIGIN, BATT_TABLE_SHIFT) / 10.0f;
+}
+
+bool sampleDue(const SensorSchedule& schedule, unsigned long now) {
+  return schedule.lastSample == 0 || now - schedule.lastSample >= schedule.interval;
+}
+
+// Updates the smoothed rate of change and returns the interval it calls for
+float adaptInterval(SensorSchedule& schedule, float value, unsigned long now) {
+  if (schedule.lastSample != 0 && now > schedule.lastSample) {
+    float rate = fabs(value - schedule.lastValue) * 1000.0 / (now - schedule.lastSample);
+    schedule.rate += SAMPLING_RATE_SMOOTHING * (rate - schedule.rate);
+  }
+  schedule.lastValue = value;
+  schedule.lastSample = now;
+  return schedule.maxInterval / (1.0 + schedule.rate / schedule.rateScale);
+}
+
+void setInterval(SensorSchedule& schedule, float interval) {
+  schedule.interval = constrain(interval, schedule.minInterval, schedule.maxInterval);
+}
+
+// Commanded ground speed estimated from the faster side's PWM (cm/s); 0 when stopped
+float driveSpeedCms() {
+  return max(abs(robot.leftMotorSpeed), abs(robot.rightMotorSpeed)) * ROBOT_MAX_SPEED_CMS / 255;
+}
+
+void sampleSensors() {
+  unsigned long now = millis();
+  bool sampled = false;
+  
+  if (sampleDue(ultrasonicSchedule, now)) {
+    sensors.distance = readUltrasonic();
+    float interval = adaptInterval(ultrasonicSchedule, min(sensors.distance, 400.0f), now);
+    float speed = driveSpeedCms();
+    if (speed > 0) {
+      // Bound the travel between pings, and tighten further as the gap to the danger line closes
+      float gap = max(sensors.distance - robot.ultrasonicDanger, 0.0f);
+      interval = min(interval, (float)(SAMPLE_TRAVEL_CM * 1000 / speed));
+      interval = min(interval, gap * 1000 / speed / 4);
+    }
+    if (scan.running) {
+      scanSample(sensors.distance, now);
+      interval = ultrasonicSchedule.minInterval; // As fast as the sensor allows while turning
+    }
+    setInterval(ultrasonicSchedule, interval);
+    
+    checkEvent(obstacleWarning, sensors.distance, robot.ultrasonicWarning, robot.ultrasonicHysteresis);
+    checkEvent(obstacleDanger, sensors.distance, robot.ultrasonicDanger, robot.ultrasonicHysteresis);
+    checkAutoStop();
+    sampled = true;
+  }
+  
+  if (sampleDue(smokeSchedule, now)) {
+    sensors.smokeLevel = readSmoke();
+    float interval = adaptInterval(smokeSchedule, sensors.smokeLevel, now);
+    if (fabs(sensors.smokeLevel - robot.smokeSensitivity) <= robot.smokeHysteresis * 2) {
+      interval = smokeSchedule.minInterval;
+    }
+    setInterval(smokeSchedule, interval);
+    
+    checkEvent(smokeAlarm, sensors.smokeLevel, robot.smokeSensitivity, robot.smokeHysteresis);
+    sampled = true;
+  }
+  
+  if (sampleDue(batterySchedule, now)) {
+    sensors.battery = readBattery();
+    float interval = adaptInterval(batterySchedule, sensors.battery, now);
+    if (fabs(sensors.battery - robot.batteryLow) <= robot.batteryHysteresis * 2) {
+      interval = batterySchedule.minInterval;
+    }
+    setInterval(batterySchedule, interval);
+    
+    checkEvent(batteryAlarm, sensors.battery, robot.batteryLow, robot.batteryHysteresis);
+    sampled = true;
+  }
+  
+  if (sampled) sensors.timestamp = now;
+}
+
+SensorSchedule* findSchedule(const char* name) {
+  for (SensorSchedule* schedule : schedules) {
+    if (strcmp(schedule->name, name) == 0) return schedule;
+  }
+  return nullptr;
+}
+
+void checkAutoStop() {
+  // Teleop and scans may still back away or turn in place
+  bool differential = teleop.active || scan.running;
+  bool approaching = differential ? robot.leftMotorSpeed + robot.rightMotorSpeed > 0 : robot.direction != DIR_STOP;
+  if (sensors.distance < robot.ultrasonicDanger && approaching) {
+    logEvent(EV_AUTO_STOP, sensors.distance * 10);
+    if (mission.running) abortMission("obstacle");
+    stopMotors();
+    robot.expression = EXPR_SURPRISED;
+    displayEyes(EXPR_SURPRISED);
+    sendCommandAck("auto_stop", "Emergency stop - obstacle too close", WS_SAFETY);
+  }
+}
+
+// Trips past the threshold, clears only once the value is back by the hysteresis
+// margin, and either edge must hold for robot.eventDebounce before it is reported.
+void checkEvent(EventDetector& detector, float value, float threshold, float hysteresis) {
+  bool tripped = detector.below ? value < threshold : value > threshold;
+  bool cleared = detector.below ? value > threshold + hysteresis : value < threshold - hysteresis;
+  bool wantActive = detector.active ? !cleared : tripped;
+  
+  if (wantActive == detector.active) {
+    detector.pending = false;
+    return;
+  }
+  
+  if (!detector.pending) {
+    detector.pending = true;
+    detector.pendingSince = millis();
+  }
+  if (millis() - detector.pendingSince < robot.eventDebounce) return;
+  
+  detector.active = wantActive;
+  detector.pending = false;
+  
+  uint32_t valueBits;
+  memcpy(&valueBits, &value, sizeof(valueBits));
+  logEvent(EV_SENSOR_EVENT, detector.id | (detector.active << 8), valueBits);
+  sendSensorEvent(detector.active ? detector.onEvent : detector.offEvent, detector.active, value, threshold);
+}
+
+void sendSensorEvent(const char* event, bool active, float value, float threshold) {
+  StaticJsonDocument<256> doc;
+  doc["type"] = "sensor_event";
+  doc["data"]["event"] = event;
+  doc["data"]["active"] = active;
+  doc["data"]["value"] = value;
+  doc["data"]["threshold"] = threshold;
+  doc["timestamp"] = millis();
+  
+  int8_t slot = composeMessage(doc);
+  if (slot < 0) return;
+  streamEvent("sensor_event", messageText(slot));
+  broadcastMessage(slot, WS_SAFETY);
+}
+
+void sendSensorData() {
+  StaticJsonDocument<512> doc;
+  doc["type"] = "sensor_data";
+  doc["data"]["ultrasonic"] = sensors.distance;
+  doc["data"]["smoke"] = smokeAlarm.active;
+  doc["data"]["smokeLevel"] = sensors.smokeLevel;
+  doc["data"]["smokePpm"] = sensors.smokePpm;
+  doc["data"]["battery"] = sensors.battery;
+  doc["data"]["batteryMv"] = sensors.batteryMillivolts;
+  doc["data"]["timestamp"] = sensors.timestamp;
+  for (const SensorSchedule* schedule : schedules) {
+    doc["data"]["sampling"][schedule->name] = schedule->interval;
+  }
+  broadcastJson(doc, WS_TELEMETRY);
+  
+  if (boot.firstTelemetry == 0 && webSocket.connectedClients() > 0) {
+    boot.firstTelemetry = millis();
+    logEvent(EV_BOOT_PHASE, BOOT_HARDWARE_READY, boot.hardwareReady);
+    logEvent(EV_BOOT_PHASE, BOOT_CONTROL_LOOP, boot.firstControlTick);
+    logEvent(EV_BOOT_PHASE, BOOT_WIFI_CONNECTED | (boot.fastConnect ? BOOT_FAST_CONNECT : 0), boot.wifiConnected);
+    logEvent(EV_BOOT_PHASE, BOOT_FIRST_TELEMETRY, boot.firstTelemetry);
+  }
+}
+
+void sendCommandAck(const char* commandId, const char* message = "", WsPriority priority = WS_ACK) {
+  StaticJsonDocument<256> doc;
+  doc["type"] = "command_ack";
+  doc["data"]["commandId"] = commandId;
+  doc["data"]["message"] = message;
+  doc["timestamp"] = millis();
+  broadcastJson(doc, priority);
+}
+
+void sendError(const char* commandId, const char* error) {
+  StaticJsonDocument<256> doc;
+  doc["type"] = "error";
+  doc["data"]["commandId"] = commandId;
+  doc["data"]["message"] = error;
+  doc["timestamp"] = millis();
+  broadcastJson(doc, WS_ACK);
+}
+
+// Answers a time_sync probe to its sender only; see "Clock sync and round-trip time"
+void sendTimeSync(uint8_t num, const char* id, int64_t receivedAt) {
+  StaticJsonDocument<256> doc;
+  doc["type"] = "time_sync";
+  doc["data"]["id"] = id;
+  doc["data"]["t1"] = receivedAt;
+  doc["data"]["t2"] = serialized(WS_STAMP_PLACEHOLDER); // Blank until wsSendTick() sends it
+  doc["data"]["rttUs"] = wsLatency[num].averageUs;
+  
+  int8_t slot = composeMessage(doc);
+  if (slot < 0) return;
+  // Strings are escaped, so the first unescaped "t2": is the key
+  const char* field = strstr(messageText(slot), "\"t2\":");
+  if (field != nullptr) wsPool[slot].stampAt = field + 5 - messageText(slot);
+  enqueueMessage(num, slot, WS_ACK);
+  releaseMessage(slot);
+}
+
+void webSocketEvent(uint8_t num, WStype_t type, uint8_t * payload, size_t length) {
+  switch(type) {
+    case WStype_DISCONNECTED:
+      logEvent(EV_WS_DISCONNECT, num);
+      captureFrame(capture.dropping ? CAP_WS_DROPPED : CAP_WS_DISCONNECT, num);
+      clearQueue(num);
+      if (teleop.active && teleop.client == num && teleop.leaseEnds != 0) teleop.leaseEnds = millis() | 1; // Expires next pass
+      break;
+      
+    case WStype_CONNECTED: {
+      logEvent(EV_WS_CONNECT, num, webSocket.remoteIP(num));
+      captureFrame(CAP_WS_CONNECT, num);
+      clearQueue(num);
+      wsQueues[num] = WsClientQueue();
+      wsLatency[num] = WsLatency();
+      
+      // Send current status
+      sendCurrentStatus();
+      break;
+    }
+    
+    case WStype_TEXT: {
+      int64_t receivedAt = esp_timer_get_time();
+      logEvent(EV_WS_RECEIVE, num, length);
+      captureFrame(CAP_WS_TEXT, num, payload, length); // Before parsing rewrites the payload in place
+      
+      StaticJsonDocument<COMMAND_JSON_CAPACITY> doc;
+      // Non-const input puts ArduinoJson in zero-copy mode: strings stay in the payload
+      DeserializationError error = deserializeJson(doc, (char *)payload, length,
+                                                   DeserializationOption::Filter(commandFilter()));
+      if (error) {
+        char message[48];
+        snprintf(message, sizeof(message), "Invalid JSON: %s", error.c_str());
+        sendError("", message);
+        break;
+      }
+      
+      const char* messageType = doc["type"] | "";
+      if (strcmp(messageType, "command") == 0) {
+        Command command;
+        const char* invalid = decodeJsonCommand(doc, command);
+        if (invalid) {
+          sendError(command.id, invalid);
+          break;
+        }
+        command.client = num;
+        handleCommand(command);
+      } else if (strcmp(messageType, "time_sync") == 0) {
+        sendTimeSync(num, doc["id"] | "", receivedAt);
+      }
+      break;
+    }
+    
+    case WStype_BIN: {
+      logEvent(EV_WS_RECEIVE, num, length);
+      captureFrame(CAP_WS_BIN, num, payload, length);
+      
+      Command command;
+      if (!decodeBinaryCommand(payload, length, command)) {
+        sendError("", "Malformed binary command");
+        break;
+      }
+      command.client = num;
+      handleCommand(command);
+      break;
+    }
+    
+    case WStype_PONG:
+      captureFrame(CAP_WS_PONG, num, payload, length);
+      handlePong(num, payload, length);
+      break;
+    
+    default:
+      break;
+  }
+}
+
+// Only these keys are kept when parsing a command frame
+const JsonDocument& commandFilter() {
+  static StaticJsonDocument<768> filter; // One slot per key
+  if (filter.isNull()) {
+    filter["type"] = true;
+    filter["id"] = true;
+    JsonObject data = filter.createNestedObject("data");
+    const char* const keys[] = {
+      "action", "direction", "duration", "speed", "state", "text", "expression", "program", "name",
+      "autostart", "ultrasonicWarning", "ultrasonicDanger", "smokeSensitivity", "batteryLow",
+      "ultrasonicHysteresis", "smokeHysteresis", "batteryHysteresis", "eventDebounce", "airTemperature",
+      "sensor", "minInterval", "maxInterval", "left", "right", "linear", "angular", "lease", "seq",
+      "turnRate"
+    };
+    for (const char* key : keys) data[key] = true;
+  }
+  return filter;
+}
+
+void clearCommand(Command& command) {
+  memset(&command, 0, sizeof(command));
+  command.name = "";
+  command.id = "";
+  command.direction = DIR_STOP;
+  command.text = "";
+  command.expression = EXPR_NEUTRAL;
+  command.program = "";
+  command.missionName = "Mission";
+  command.sensor = "";
+  command.ultrasonicWarning = NAN;
+  command.ultrasonicDanger = NAN;
+  command.smokeSensitivity = NAN;
+  command.batteryLow = NAN;
+  command.ultrasonicHysteresis = NAN;
+  command.smokeHysteresis = NAN;
+  command.batteryHysteresis = NAN;
+  command.eventDebounce = NAN;
+  command.airTemperature = NAN;
+  command.client = COMMAND_CLIENT_LOCAL;
+}
+
+// Returns why the command was rejected, or nullptr
+const char* decodeJsonCommand(JsonDocument& doc, Command& command) {
+  clearCommand(command);
+  JsonObject data = doc["data"];
+  
+  command.id = doc["id"] | "";
+  command.name = data["action"] | "";
+  for (uint8_t i = 1; i < sizeof(commandNames) / sizeof(commandNames[0]); i++) {
+    if (strcmp(command.name, commandNames[i]) == 0) {
+      command.action = (CommandAction)i;
+      break;
+    }
+  }
+  
+  command.direction = directionFromName(data["direction"] | "stop");
+  if (data.containsKey("duration")) {
+    // Range-check it wide: 70000 or -1 would otherwise wrap into the u16 field
+    long duration = data["duration"] | -1L; // Non-integers and values past a long come back as -1 too
+    if (duration < 0 || duration > UINT16_MAX) return "Invalid duration";
+    command.duration = duration;
+  }
+  command.speed = data["speed"] | robot.driveSpeed;
+  command.state = data["state"] | false;
+  command.text = data["text"] | command.text;
+  command.expression = expressionFromName(data["expression"] | "neutral");
+  command.program = data["program"] | command.program;
+  command.missionName = data["name"] | command.missionName;
+  command.autostart = data["autostart"] | false;
+  command.ultrasonicWarning = data["ultrasonicWarning"] | NAN;
+  command.ultrasonicDanger = data["ultrasonicDanger"] | NAN;
+  command.smokeSensitivity = data["smokeSensitivity"] | NAN;
+  command.batteryLow = data["batteryLow"] | NAN;
+  command.ultrasonicHysteresis = data["ultrasonicHysteresis"] | NAN;
+  command.smokeHysteresis = data["smokeHysteresis"] | NAN;
+  command.batteryHysteresis = data["batteryHysteresis"] | NAN;
+  command.eventDebounce = data["eventDebounce"] | NAN;
+  command.airTemperature = data["airTemperature"] | NAN;
+  command.sensor = data["sensor"] | command.sensor;
+  command.minInterval = data["minInterval"] | 0;
+  command.maxInterval = data["maxInterval"] | 0;
+  command.left = constrain(data["left"] | 0, -255, 255);
+  command.right = constrain(data["right"] | 0, -255, 255);
+  if (data.containsKey("linear") || data.containsKey("angular")) {
+    // Differential drive mix, scaled down so neither side passes full duty; positive angular turns left
+    float linear = data["linear"] | 0.0f;
+    float angular = data["angular"] | 0.0f;
+    float scale = 255 / max(1.0f, fabsf(linear) + fabsf(angular));
+    command.left = lroundf((linear - angular) * scale);
+    command.right = lroundf((linear + angular) * scale);
+  }
+  command.lease = data["lease"] | 0;
+  command.sequence = data["seq"] | 0;
+  command.turnRate = data["turnRate"] | 0;
+  return nullptr;
+}
+
+bool decodeBinaryCommand(const uint8_t* payload, size_t length, Command& command) {
+  clearCommand(command);
+  if (length < BIN_HEADER_SIZE) return false;
+  
+  uint16_t seq = payload[1] | (payload[2] << 8);
+  if (seq != 0) {
+    snprintf(command.idBuffer, sizeof(command.idBuffer), "%u", seq);
+    command.id = command.idBuffer;
+  }
+  const uint8_t* fields = payload + BIN_HEADER_SIZE;
+  size_t fieldsLength = length - BIN_HEADER_SIZE;
+  
+  switch (payload[0]) {
+    case BIN_MOVE:
+      if (fieldsLength < 3 || fields[0] >= DIRECTION_COUNT) return false;
+      command.action = CMD_MOVE;
+      command.direction = (Direction)fields[0];
+      command.duration = fields[1] | (fields[2] << 8);
+      break;
+    case BIN_SET_SPEED:
+      if (fieldsLength < 1) return false;
+      command.action = CMD_SET_SPEED;
+      command.speed = fields[0];
+      break;
+    case BIN_BUZZER:
+      if (fieldsLength < 1) return false;
+      command.action = CMD_BUZZER;
+      command.state = fields[0] != 0;
+      break;
+    case BIN_EXPRESSION:
+      if (fieldsLength < 1 || fields[0] >= EXPRESSION_COUNT) return false;
+      command.action = CMD_EXPRESSION;
+      command.expression = (Expression)fields[0];
+      break;
+    case BIN_MISSION_START:
+      command.action = CMD_MISSION_START;
+      break;
+    case BIN_MISSION_ABORT:
+      command.action = CMD_MISSION_ABORT;
+      break;
+    case BIN_TELEOP:
+      if (fieldsLength < 8) return false;
+      command.action = CMD_TELEOP;
+      command.left = (int16_t)(fields[0] | (fields[1] << 8));
+      command.right = (int16_t)(fields[2] | (fields[3] << 8));
+      command.lease = fields[4] | (fields[5] << 8);
+      command.sequence = fields[6] | (fields[7] << 8);
+      break;
+    default:
+      return false;
+  }
+  
+  command.name = commandNames[command.action];
+  return true;
+}
+
+void applyThreshold(float& target, float value) {
+  if (!isnan(value)) target = value;
+}
+
+// Checks a set_thresholds command against the current values before any of it is applied
+const char* checkThresholds(const Command& command) {
+  if (command.ultrasonicHysteresis < 0 || command.smokeHysteresis < 0 || command.batteryHysteresis < 0) {
+    return "Hysteresis must not be negative";
+  }
+  if (command.eventDebounce < 0 || command.eventDebounce > EVENT_DEBOUNCE_MAX) {
+    return "Invalid event debounce";
+  }
+  float warning = isnan(command.ultrasonicWarning) ? robot.ultrasonicWarning : command.ultrasonicWarning;
+  float danger = isnan(command.ultrasonicDanger) ? robot.ultrasonicDanger : command.ultrasonicDanger;
+  if (!(danger < warning)) return "Ultrasonic danger must be below warning";
+  return nullptr;
+}
+
+// Commands without an id (binary frames sent with sequence 0) are not acked
+void handleCommand(const Command& command) {
+  const char* commandId = command.id;
+  bool ack = commandId[0] != '\0';
+  char message[48];
+  logEvent(EV_COMMAND, command.action, packTag(command.name));
+  
+  switch (command.action) {
+    case CMD_MOVE:
+      if (mission.running) abortMission("manual override");
+      if (scan.running) abortScan("manual override");
+      moveRobot(command.direction);
+      if (command.duration > 0) robot.stopAt = millis() + command.duration; // loop() stops it
+      
+      if (ack) sendCommandAck(commandId, "Movement command executed");
+      break;
+      
+    case CMD_SET_SPEED:
+      robot.driveSpeed = command.speed;
+      // Re-apply so a moving robot picks up the new speed immediately. Teleop duties are
+      // absolute, and a scan's heading estimate assumes SCAN_TURN_DUTY throughout.
+      if (robot.direction != DIR_STOP && !teleop.active && !scan.running) {
+        unsigned long stopAt = robot.stopAt; // A timed move still ends on time
+        moveRobot(robot.direction);
+        robot.stopAt = stopAt;
+      }
+      snprintf(message, sizeof(message), "Speed set to %u", robot.driveSpeed);
+      if (ack) sendCommandAck(commandId, message);
+      break;
+      
+    case CMD_BUZZER:
+      robot.buzzer = command.state;
+      writeBuzzer(command.state);
+      
+      if (ack) sendCommandAck(commandId, command.state ? "Buzzer ON" : "Buzzer OFF");
+      break;
+      
+    case CMD_OLED:
+      setOledText(command.text);
+      updateOLED();
+      
+      if (ack) sendCommandAck(commandId, "OLED updated");
+      break;
+      
+    case CMD_EXPRESSION:
+      robot.expression = command.expression;
+      displayEyes(robot.expression);
+      
+      snprintf(message, sizeof(message), "Expression changed to %s", expressionNames[robot.expression]);
+      if (ack) sendCommandAck(commandId, message);
+      break;
+      
+    case CMD_SET_THRESHOLDS: {
+      const char* error = checkThresholds(command);
+      if (error) {
+        sendError(commandId, error);
+        break;
+      }
+      applyThreshold(robot.ultrasonicWarning, command.ultrasonicWarning);
+      applyThreshold(robot.ultrasonicDanger, command.ultrasonicDanger);
+      applyThreshold(robot.smokeSensitivity, command.smokeSensitivity);
+      applyThreshold(robot.batteryLow, command.batteryLow);
+      applyThreshold(robot.ultrasonicHysteresis, command.ultrasonicHysteresis);
+      applyThreshold(robot.smokeHysteresis, command.smokeHysteresis);
+      applyThreshold(robot.batteryHysteresis, command.batteryHysteresis);
+      if (!isnan(command.eventDebounce)) robot.eventDebounce = command.eventDebounce;
+      if (!isnan(command.airTemperature)) {
+        robot.airTemperature = command.airTemperature;
+        updateSoundScale();
+      }
+      
+      if (ack) sendCommandAck(commandId, "Thresholds updated");
+      sendCurrentStatus();
+      break;
+    }
+      
+    case CMD_PATROL:
+      // Automated patrol behavior
+      loadMission(mission_patrol, sizeof(mission_patrol), "Patrol");
+      startMission();
+      if (ack) sendCommandAck(commandId, "Patrol started");
+      break;
+      
+    case CMD_SCAN:
+      if (!robot.ultrasonicEnabled) {
+        sendError(commandId, "Ultrasonic sensor disabled");
+        break;
+      }
+      startScan(command.turnRate);
+      if (ack) sendCommandAck(commandId, "Scan started");
+      break;
+      
+    case CMD_MISSION_LOAD: {
+      const char* error = loadMissionHex(command.program, command.missionName);
+      if (error) {
+        sendError(commandId, error);
+        return;
+      }
+      if (command.autostart) startMission();
+      snprintf(message, sizeof(message), "Mission loaded (%u steps)", mission.length);
+      if (ack) sendCommandAck(commandId, message);
+      break;
+    }
+      
+    case CMD_MISSION_START:
+      if (mission.length == 0) {
+        sendError(commandId, "No mission loaded");
+        return;
+      }
+      startMission();
+      if (ack) sendCommandAck(commandId, "Mission started");
+      break;
+      
+    case CMD_MISSION_ABORT:
+      abortMission("aborted");
+      if (ack) sendCommandAck(commandId, "Mission aborted");
+      break;
+      
+    case CMD_SET_SAMPLING: {
+      SensorSchedule* schedule = findSchedule(command.sensor);
+      if (!schedule) {
+        snprintf(message, sizeof(message), "Unknown sensor: %s", command.sensor);
+        sendError(commandId, message);
+        break;
+      }
+      uint16_t minInterval = command.minInterval ? command.minInterval : schedule->minInterval;
+      uint16_t maxInterval = command.maxInterval ? command.maxInterval : schedule->maxInterval;
+      if (minInterval < SAMPLING_MIN_FLOOR || minInterval > maxInterval) {
+        sendError(commandId, "Invalid sampling bounds");
+        break;
+      }
+      schedule->minInterval = minInterval;
+      schedule->maxInterval = maxInterval;
+      setInterval(*schedule, schedule->interval);
+      
+      snprintf(message, sizeof(message), "Sampling bounds updated for %s", schedule->name);
+      if (ack) sendCommandAck(commandId, message);
+      sendCurrentStatus();
+      break;
+    }
+      
+    case CMD_TELEOP:
+      applyTeleop(command); // Not acked: at 20-50 Hz acks would crowd out everything else
+      break;
+      
+    default:
+      snprintf(message, sizeof(message), "Unknown command: %s", command.name);
+      sendError(commandId, message);
+      break;
+  }
+}
+
+void moveRobot(Direction direction) {
+  endTeleop();
+  robot.direction = direction;
+  robot.stopAt = 0;
+  ultrasonicSchedule.interval = ultrasonicSchedule.minInterval; // Re-plan for the new motion at once
+  uint8_t turnSpeed = robot.driveSpeed * 3 / 4;
+  
+  if (direction == DIR_FORWARD) {
     digitalWrite(MOTOR_LEFT_1, HIGH);
     digitalWrite(MOTOR_LEFT_2, LOW);
     digitalWrite(MOTOR_RIGHT_1, HIGH);
     digitalWrite(MOTOR_RIGHT_2, LOW);
-    ledcWrite(0, 200); // Left motor PWM
-    ledcWrite(1, 200); // Right motor PWM
+    ledcWrite(0, robot.driveSpeed); // Left motor PWM
+    ledcWrite(1, robot.driveSpeed); // Right motor PWM
     
-  } else if (direction == "backward") {
+  } else if (direction == DIR_BACKWARD) {
     digitalWrite(MOTOR_LEFT_1, LOW);
     digitalWrite(MOTOR_LEFT_2, HIGH);
     digitalWrite(MOTOR_RIGHT_1, LOW);
     digitalWrite(MOTOR_RIGHT_2, HIGH);
-    ledcWrite(0, 200);
-    ledcWrite(1, 200);
+    ledcWrite(0, robot.driveSpeed);
+    ledcWrite(1, robot.driveSpeed);
     
-  } else if (direction == "left") {
+  } else if (direction == DIR_LEFT) {
     digitalWrite(MOTOR_LEFT_1, LOW);
     digitalWrite(MOTOR_LEFT_2, HIGH);
     digitalWrite(MOTOR_RIGHT_1, HIGH);
     digitalWrite(MOTOR_RIGHT_2, LOW);
-    ledcWrite(0, 150);
-    ledcWrite(1, 150);
+    ledcWrite(0, turnSpeed);
+    ledcWrite(1, turnSpeed);
     
-  } else if (direction == "right") {
+  } else if (direction == DIR_RIGHT) {
     digitalWrite(MOTOR_LEFT_1, HIGH);
     digitalWrite(MOTOR_LEFT_2, LOW);
     digitalWrite(MOTOR_RIGHT_1, LOW);
     digitalWrite(MOTOR_RIGHT_2, HIGH);
-    ledcWrite(0, 150);
-    ledcWrite(1, 150);
+    ledcWrite(0, turnSpeed);
+    ledcWrite(1, turnSpeed);
     
   } else {
     stopMotors();
+    return;
   }
+  uint8_t pwm = (direction == DIR_LEFT || direction == DIR_RIGHT) ? turnSpeed : robot.driveSpeed;
+  robot.leftMotorSpeed = direction == DIR_BACKWARD || direction == DIR_LEFT ? -pwm : pwm;
+  robot.rightMotorSpeed = direction == DIR_BACKWARD || direction == DIR_RIGHT ? -pwm : pwm;
+  captureMotor(direction, pwm, pwm);
 }
 
 void stopMotors() {
+  endTeleop();
   digitalWrite(MOTOR_LEFT_1, LOW);
   digitalWrite(MOTOR_LEFT_2, LOW);
   digitalWrite(MOTOR_RIGHT_1, LOW);
   digitalWrite(MOTOR_RIGHT_2, LOW);
   ledcWrite(0, 0);
   ledcWrite(1, 0);
-  robot.direction = "stopped";
+  robot.direction = DIR_STOP;
+  robot.leftMotorSpeed = 0;
+  robot.rightMotorSpeed = 0;
+  captureMotor(DIR_STOP, 0, 0);
 }
 
-void patrol() {
-  robot.expression = "thinking";
-  displayEyes("thinking");
-  robot.oledText = "Patrolling...";
-  updateOLED();
+// Forward when positive, on the same pins moveRobot() uses
+void writeMotorSide(uint8_t forwardPin, uint8_t backwardPin, uint8_t channel, int duty) {
+  digitalWrite(forwardPin, duty > 0 ? HIGH : LOW);
+  digitalWrite(backwardPin, duty < 0 ? HIGH : LOW);
+  ledcWrite(channel, abs(duty));
+}
+
+// Signed duty per side. robot.direction follows for status and auto-stop: the larger of
+// the common and differential parts decides between a drive and a turn.
+void driveMotors(int left, int right) {
+  if (left == robot.leftMotorSpeed && right == robot.rightMotorSpeed) return;
+  writeMotorSide(MOTOR_LEFT_1, MOTOR_LEFT_2, 0, left);
+  writeMotorSide(MOTOR_RIGHT_1, MOTOR_RIGHT_2, 1, right);
+  robot.leftMotorSpeed = left;
+  robot.rightMotorSpeed = right;
+  
+  int common = left + right;
+  int differential = right - left;
+  if (left == 0 && right == 0) robot.direction = DIR_STOP;
+  else if (abs(common) >= abs(differential)) robot.direction = common > 0 ? DIR_FORWARD : DIR_BACKWARD;
+  else robot.direction = differential > 0 ? DIR_LEFT : DIR_RIGHT;
+  captureDrive(left, right);
+}
+
+void endTeleop() {
+  teleop.active = false;
+  teleop.targetLeft = teleop.targetRight = 0;
+  teleop.left = teleop.right = 0;
+  teleop.leaseEnds = 0;
+}
+
+void applyTeleop(const Command& command) {
+  bool sameClient = teleop.active && command.client == teleop.client;
+  if (command.sequence != 0 && sameClient && (int16_t)(command.sequence - teleop.sequence) <= 0) {
+    teleop.stale++;
+    return;
+  }
+  
+  unsigned long now = millis();
+  if (mission.running) abortMission("manual override");
+  if (scan.running) abortScan("manual override");
+  robot.stopAt = 0;
+  if (!teleop.active) {
+    // Ramp from wherever a discrete move left the motors
+    teleop.active = true;
+    teleop.left = robot.leftMotorSpeed;
+    teleop.right = robot.rightMotorSpeed;
+    teleop.lastTick = now;
+  }
+  
+  int16_t left = constrain(command.left, -255, 255);
+  int16_t right = constrain(command.right, -255, 255);
+  if (sensors.distance < robot.ultrasonicDanger && left + right > 0) left = right = 0; // Not into the obstacle
+  teleop.targetLeft = left;
+  teleop.targetRight = right;
+  uint16_t lease = command.lease ? min(command.lease, (uint16_t)TELEOP_MAX_LEASE) : TELEOP_DEFAULT_LEASE;
+  teleop.leaseEnds = (now + lease) | 1; // Never 0, which means expired
+  teleop.client = command.client;
+  teleop.sequence = command.sequence;
+  teleop.applied++;
+}
+
+// Moves toward the target at TELEOP_DECEL when that means slowing down or reversing, else TELEOP_ACCEL
+float rampToward(float current, int16_t target, float seconds) {
+  bool slowing = current != 0 && (current * target < 0 || fabsf(target) < fabsf(current));
+  float step = (slowing ? TELEOP_DECEL : TELEOP_ACCEL) * seconds;
+  return target > current ? min(current + step, (float)target) : max(current - step, (float)target);
+}
+
+void teleopTick() {
+  if (!teleop.active) return;
+  unsigned long now = millis();
+  float seconds = (now - teleop.lastTick) / 1000.0f;
+  teleop.lastTick = now;
   
-  // Simple patrol pattern
-  moveRobot("forward");
-  delay(2000);
+  if (teleop.leaseEnds != 0 && (long)(now - teleop.leaseEnds) >= 0) {
+    teleop.leaseEnds = 0;
+    teleop.targetLeft = teleop.targetRight = 0;
+    teleop.expired++;
+    logEvent(EV_TELEOP_EXPIRED, teleop.client);
+    sendCommandAck("teleop_expired", "Teleop lease expired - stopping", WS_SAFETY);
+  }
   
-  float distance = readUltrasonic();
-  if (distance < 20) {
-    moveRobot("backward");
-    delay(500);
-    moveRobot("right");
-    delay(1000);
+  teleop.left = rampToward(teleop.left, teleop.targetLeft, seconds);
+  teleop.right = rampToward(teleop.right, teleop.targetRight, seconds);
+  if (teleop.leaseEnds == 0 && teleop.left == 0 && teleop.right == 0) {
+    stopMotors();
+    return;
   }
+  driveMotors(lroundf(teleop.left), lroundf(teleop.right));
+}
+
+// Runs a REST /move the way a timed "move" command would
+void restMoveTick() {
+  if (!__atomic_load_n(&restMove.requested, __ATOMIC_ACQUIRE)) return;
+  Command command;
+  clearCommand(command);
+  command.action = CMD_MOVE;
+  command.name = commandNames[CMD_MOVE];
+  command.direction = restMove.direction;
+  command.duration = restMove.direction != DIR_STOP ? REST_MOVE_DURATION : 0;
+  __atomic_store_n(&restMove.requested, false, __ATOMIC_RELEASE);
+  handleCommand(command);
+}
+
+// Turns right in place; sampleSensors() feeds each reading to scanSample()
+void startScan(uint16_t turnRate) {
+  if (mission.running) abortMission("scan");
+  abortScan("restarted");
+  endTeleop();
+  robot.stopAt = 0;
   
-  moveRobot("right");
-  delay(1500);
-  moveRobot("forward");
-  delay(2000);
+  unsigned long now = millis();
+  memset(scan.count, 0, sizeof(scan.count));
+  scan.turnRate = turnRate ? constrain(turnRate, SCAN_MIN_TURN_RATE, SCAN_MAX_TURN_RATE) : SCAN_TURN_RATE;
+  scan.startedAt = now;
+  scan.endsAt = now + 360000UL / scan.turnRate;
+  scan.lastProgress = now;
+  scan.reported = 0;
+  scan.running = true;
+  ultrasonicSchedule.interval = ultrasonicSchedule.minInterval;
   
+  robot.expression = EXPR_THINKING;
+  setOledText("Scanning...");
+  updateOLED();
+  driveMotors(SCAN_TURN_DUTY, -SCAN_TURN_DUTY);
+}
+
+// Stops the turn and sends what was mapped so far
+void abortScan(const char* reason) {
+  if (!scan.running) return;
+  
+  scan.running = false;
   stopMotors();
-  robot.expression = "happy";
-  displayEyes("happy");
-  robot.oledText = "Patrol done!";
+  sendScanMap(reason);
+}
+
+void finishScan() {
+  scan.running = false;
+  scan.completed++;
+  stopMotors();
+  
+  int8_t nearest = -1;
+  for (uint8_t sector = 0; sector < SCAN_SECTORS; sector++) {
+    if (scan.count[sector] > 0 && (nearest < 0 || scan.minimum[sector] < scan.minimum[nearest])) nearest = sector;
+  }
+  robot.expression = EXPR_NEUTRAL;
+  if (nearest < 0) {
+    setOledText("Scan: no readings");
+  } else {
+    snprintf(robot.oledText, sizeof(robot.oledText), "Near %ucm @%udeg", scan.minimum[nearest],
+             nearest * SCAN_SECTOR_DEGREES + SCAN_SECTOR_DEGREES / 2);
+  }
   updateOLED();
+  sendScanMap("");
+}
+
+void scanSample(float distance, unsigned long now) {
+  uint32_t heading = (now - scan.startedAt) * scan.turnRate / 1000;
+  if (heading >= 360) return;
+  uint8_t sector = heading / SCAN_SECTOR_DEGREES;
+  uint16_t range = lroundf(min(distance, (float)SCAN_RANGE_MAX));
+  uint8_t count = scan.count[sector];
+  
+  if (count == 0 || range < scan.minimum[sector]) scan.minimum[sector] = range;
+  if (count < SCAN_SECTOR_SAMPLES) {
+    // Insertion sort, so the median is just the middle
+    uint16_t* samples = scan.samples[sector];
+    uint8_t i = count;
+    for (; i > 0 && samples[i - 1] > range; i--) samples[i] = samples[i - 1];
+    samples[i] = range;
+  }
+  if (count < 255) scan.count[sector]++;
+}
+
+// Of an even count, the nearer of the middle two: a no-echo reading never pulls a sector clear
+uint16_t scanMedian(uint8_t sector) {
+  uint8_t count = min(scan.count[sector], (uint8_t)SCAN_SECTOR_SAMPLES);
+  return count > 0 ? scan.samples[sector][(count - 1) / 2] : 0;
+}
+
+uint16_t scanMinimum(uint8_t sector) {
+  return scan.count[sector] > 0 ? scan.minimum[sector] : 0;
+}
+
+void scanTick() {
+  if (!scan.running) return;
+  unsigned long now = millis();
+  
+  if (!robot.ultrasonicEnabled) {
+    abortScan("ultrasonic disabled");
+    return;
+  }
+  if ((long)(now - scan.endsAt) >= 0) {
+    finishScan();
+    return;
+  }
+  if (now - scan.lastProgress < SCAN_PROGRESS_INTERVAL) return;
+  scan.lastProgress = now;
+  
+  // Sectors the heading has fully passed
+  uint8_t finished = (now - scan.startedAt) * scan.turnRate / 1000 / SCAN_SECTOR_DEGREES;
+  if (finished > scan.reported) sendScanProgress(finished);
+}
+
+void sendScanProgress(uint8_t finished) {
+  JsonDocument& doc = wsLargeDoc;
+  doc.clear();
+  doc["type"] = "scan_progress";
+  doc["data"]["first"] = scan.reported;
+  JsonArray minimum = doc["data"].createNestedArray("min");
+  JsonArray median = doc["data"].createNestedArray("median");
+  for (uint8_t sector = scan.reported; sector < finished; sector++) {
+    minimum.add(scanMinimum(sector));
+    median.add(scanMedian(sector));
+  }
+  doc["timestamp"] = millis();
+  broadcastJson(doc, WS_TELEMETRY);
+  scan.reported = finished;
+}
+
+// The whole map in one frame; reason is empty for a completed turn
+void sendScanMap(const char* reason) {
+  JsonDocument& doc = wsLargeDoc;
+  doc.clear();
+  doc["type"] = "scan_map";
+  doc["data"]["complete"] = reason[0] == '\0';
+  if (reason[0] != '\0') doc["data"]["reason"] = reason;
+  doc["data"]["sectorDegrees"] = SCAN_SECTOR_DEGREES;
+  doc["data"]["turnRate"] = scan.turnRate;
+  doc["data"]["durationMs"] = millis() - scan.startedAt;
+  JsonArray minimum = doc["data"].createNestedArray("min");
+  JsonArray median = doc["data"].createNestedArray("median");
+  JsonArray samples = doc["data"].createNestedArray("samples");
+  for (uint8_t sector = 0; sector < SCAN_SECTORS; sector++) {
+    minimum.add(scanMinimum(sector));
+    median.add(scanMedian(sector));
+    samples.add(scan.count[sector]);
+  }
+  doc["timestamp"] = millis();
+  broadcastJson(doc, WS_STATUS);
+}
+
+bool loadMission(const uint8_t* program, size_t size, const char* name) {
+  if (size == 0 || size % MISSION_STEP_SIZE != 0 || size > sizeof(mission.program)) return false;
+  
+  abortMission("replaced");
+  memcpy(mission.program, program, size);
+  mission.length = size / MISSION_STEP_SIZE;
+  strncpy(mission.name, name, sizeof(mission.name) - 1);
+  mission.name[sizeof(mission.name) - 1] = '\0';
+  return true;
+}
+
+int hexNibble(char c) {
+  if (c >= '0' && c <= '9') return c - '0';
+  if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+  return -1;
+}
+
+// Returns an error message, or nullptr when the program was loaded
+const char* loadMissionHex(const char* hex, const char* name) {
+  static char error[32];
+  size_t hexLength = strlen(hex);
+  if (hexLength == 0 || hexLength % (MISSION_STEP_SIZE * 2) != 0) return "Program must be whole 4-byte steps";
+  if (hexLength / 2 > MISSION_MAX_STEPS * MISSION_STEP_SIZE) return "Program too long";
+  
+  uint8_t program[MISSION_MAX_STEPS * MISSION_STEP_SIZE];
+  size_t size = hexLength / 2;
+  for (size_t i = 0; i < size; i++) {
+    int high = hexNibble(hex[i * 2]);
+    int low = hexNibble(hex[i * 2 + 1]);
+    if (high < 0 || low < 0) return "Program is not valid hex";
+    program[i] = (high << 4) | low;
+  }
+  
+  uint8_t steps = size / MISSION_STEP_SIZE;
+  for (uint8_t i = 0; i < steps; i++) {
+    const uint8_t* step = &program[i * MISSION_STEP_SIZE];
+    switch (step[0]) {
+      case OP_MOVE:
+        if (step[1] >= DIRECTION_COUNT) {
+          snprintf(error, sizeof(error), "Bad direction at step %u", i);
+          return error;
+        }
+        break;
+      case OP_EXPRESSION:
+        if (step[1] >= EXPRESSION_COUNT) {
+          snprintf(error, sizeof(error), "Bad expression at step %u", i);
+          return error;
+        }
+        break;
+      case OP_JUMP_NEAR:
+      case OP_JUMP_FAR:
+      case OP_JUMP_SMOKE:
+      case OP_LOOP:
+        if (step[1] >= steps) {
+          snprintf(error, sizeof(error), "Bad jump target at step %u", i);
+          return error;
+        }
+        break;
+      case OP_END:
+      case OP_WAIT:
+      case OP_WAIT_DIST:
+      case OP_BEEP:
+      case OP_SHOW_SENSORS:
+        break;
+      default:
+        snprintf(error, sizeof(error), "Unknown opcode at step %u", i);
+        return error;
+    }
+  }
+  
+  loadMission(program, size, name);
+  return nullptr;
 }
 
-void scan() {
-  robot.expression = "thinking";
-  displayEyes("thinking");
-  robot.oledText = "Scanning...";
+void startMission() {
+  if (mission.length == 0) return;
+  
+  abortScan("mission started");
+  memset(mission.loopCount, 0, sizeof(mission.loopCount));
+  mission.pc = 0;
+  mission.busy = false;
+  mission.running = true;
+  snprintf(robot.oledText, sizeof(robot.oledText), "%s...", mission.name);
   updateOLED();
+  sendMissionEvent("started");
+}
+
+void abortMission(const char* reason) {
+  if (!mission.running) return;
   
-  // Rotate and scan
-  moveRobot("right");
-  delay(500);
+  mission.running = false;
+  mission.busy = false;
+  stopMotors();
+  writeBuzzer(robot.buzzer);
+  sendMissionEvent("aborted", reason);
+}
+
+void finishMission() {
+  mission.running = false;
+  mission.busy = false;
   stopMotors();
+  snprintf(robot.oledText, sizeof(robot.oledText), "%s done!", mission.name);
+  updateOLED();
+  sendMissionEvent("completed");
+}
+
+// Called every loop; never blocks. Holding steps are polled until their deadline
+// (or distance condition) is met, then instant steps run until the next holding one.
+void missionTick() {
+  if (!mission.running) return;
+  
+  if (mission.busy) {
+    const uint8_t* step = &mission.program[mission.pc * MISSION_STEP_SIZE];
+    uint16_t arg = step[2] | (step[3] << 8);
+    
+    if (step[0] == OP_WAIT_DIST) {
+      bool met = step[1] == 0 ? sensors.distance < arg : sensors.distance > arg;
+      if (!met) return;
+    } else {
+      if ((long)(millis() - mission.deadline) < 0) return;
+      if (step[0] == OP_BEEP) writeBuzzer(robot.buzzer);
+    }
+    
+    mission.busy = false;
+    mission.pc++;
+  }
   
-  float distance = readUltrasonic();
-  float smoke = readSmoke();
+  // Bounded so a program that loops without holding can't starve the control loop
+  for (uint8_t budget = MISSION_MAX_STEPS; budget > 0 && mission.running && !mission.busy; budget--) {
+    executeMissionStep();
+  }
+}
+
+void executeMissionStep() {
+  if (mission.pc >= mission.length) {
+    finishMission();
+    return;
+  }
   
-  robot.oledText = "D:" + String(distance, 1) + " S:" + String(smoke, 1);
-  updateOLED();
+  const uint8_t* step = &mission.program[mission.pc * MISSION_STEP_SIZE];
+  uint8_t op = step[0];
+  uint8_t arg8 = step[1];
+  uint16_t arg = step[2] | (step[3] << 8);
   
-  delay(2000);
+  sendMissionEvent("step");
   
-  robot.expression = "neutral";
-  displayEyes("neutral");
-  robot.oledText = "Scan complete";
-  updateOLED();
+  switch (op) {
+    case OP_END:
+      finishMission();
+      return;
+      
+    case OP_MOVE:
+      moveRobot((Direction)arg8);
+      mission.deadline = millis() + arg;
+      mission.busy = arg > 0;
+      break;
+      
+    case OP_WAIT:
+      mission.deadline = millis() + arg;
+      mission.busy = true;
+      break;
+      
+    case OP_WAIT_DIST:
+      mission.busy = true;
+      break;
+      
+    case OP_EXPRESSION:
+      robot.expression = (Expression)arg8;
+      displayEyes(robot.expression);
+      break;
+      
+    case OP_BEEP:
+      writeBuzzer(true);
+      mission.deadline = millis() + arg;
+      mission.busy = true;
+      break;
+      
+    case OP_JUMP_NEAR:
+    case OP_JUMP_FAR: {
+      bool near = sensors.distance < arg;
+      if (near == (op == OP_JUMP_NEAR)) {
+        mission.pc = arg8;
+        return;
+      }
+      break;
+    }
+      
+    case OP_JUMP_SMOKE:
+      if (sensors.smokeLevel > arg) {
+        mission.pc = arg8;
+        return;
+      }
+      break;
+      
+    case OP_LOOP:
+      if (arg == 0 || ++mission.loopCount[mission.pc] < arg) {
+        mission.pc = arg8;
+        return;
+      }
+      mission.loopCount[mission.pc] = 0;
+      break;
+      
+    case OP_SHOW_SENSORS:
+      snprintf(robot.oledText, sizeof(robot.oledText), "D:%.1f S:%.1f", sensors.distance, sensors.smokeLevel);
+      updateOLED();
+      break;
+      
+    default:
+      abortMission("bad opcode");
+      return;
+  }
+  
+  if (!mission.busy) mission.pc++;
+}
+
+void sendMissionEvent(const char* event, const char* reason = "") {
+  logEvent(EV_MISSION, mission.pc, packTag(event));
+  
+  StaticJsonDocument<256> doc;
+  doc["type"] = "mission_event";
+  doc["data"]["event"] = event;
+  doc["data"]["name"] = mission.name;
+  doc["data"]["step"] = mission.pc;
+  doc["data"]["steps"] = mission.length;
+  if (mission.pc < mission.length) doc["data"]["op"] = mission.program[mission.pc * MISSION_STEP_SIZE];
+  if (reason[0] != '\0') doc["data"]["reason"] = reason;
+  doc["timestamp"] = millis();
+  broadcastJson(doc, WS_STATUS);
 }
 
 void sendCurrentStatus() {
-  DynamicJsonDocument doc(512);
+  JsonDocument& doc = wsLargeDoc;
+  doc.clear();
   doc["type"] = "status_update";
   doc["data"]["buzzer"] = robot.buzzer;
-  doc["data"]["motors"]["direction"] = robot.direction;
+  doc["data"]["motors"]["direction"] = directionState(robot.direction);
+  doc["data"]["motors"]["left"] = robot.leftMotorSpeed;
+  doc["data"]["motors"]["right"] = robot.rightMotorSpeed;
+  doc["data"]["teleop"]["active"] = teleop.active;
+  doc["data"]["teleop"]["applied"] = teleop.applied;
+  doc["data"]["teleop"]["stale"] = teleop.stale;
+  doc["data"]["teleop"]["expired"] = teleop.expired;
+  doc["data"]["scan"]["running"] = scan.running;
+  doc["data"]["scan"]["completed"] = scan.completed;
   doc["data"]["oled"]["text"] = robot.oledText;
-  doc["data"]["oled"]["expression"] = robot.expression;
+  doc["data"]["oled"]["expression"] = expressionNames[robot.expression];
+  doc["data"]["oled"]["presented"] = oled.presented;
+  doc["data"]["oled"]["flushed"] = oled.flushed;
+  doc["data"]["oled"]["coalesced"] = oled.coalesced;
+  doc["data"]["oled"]["lastFlushUs"] = oled.lastFlushUs;
+  doc["data"]["oled"]["maxFlushUs"] = oled.maxFlushUs;
   doc["data"]["sensors"]["ultrasonic"] = robot.ultrasonicEnabled;
   doc["data"]["sensors"]["smoke"] = robot.smokeEnabled;
   doc["data"]["thresholds"]["ultrasonicWarning"] = robot.ultrasonicWarning;
   doc["data"]["thresholds"]["ultrasonicDanger"] = robot.ultrasonicDanger;
   doc["data"]["thresholds"]["smokeSensitivity"] = robot.smokeSensitivity;
+  doc["data"]["thresholds"]["batteryLow"] = robot.batteryLow;
+  doc["data"]["thresholds"]["ultrasonicHysteresis"] = robot.ultrasonicHysteresis;
+  doc["data"]["thresholds"]["smokeHysteresis"] = robot.smokeHysteresis;
+  doc["data"]["thresholds"]["batteryHysteresis"] = robot.batteryHysteresis;
+  doc["data"]["thresholds"]["eventDebounce"] = robot.eventDebounce;
+  doc["data"]["thresholds"]["airTemperature"] = robot.airTemperature;
+  for (const SensorSchedule* schedule : schedules) {
+    JsonObject sampling = doc["data"]["sampling"].createNestedObject(schedule->name);
+    sampling["min"] = schedule->minInterval;
+    sampling["max"] = schedule->maxInterval;
+    sampling["interval"] = schedule->interval;
+  }
+  doc["data"]["boot"]["hardwareReady"] = boot.hardwareReady;
+  doc["data"]["boot"]["firstControlTick"] = boot.firstControlTick;
+  doc["data"]["boot"]["wifiConnected"] = boot.wifiConnected;
+  doc["data"]["boot"]["firstTelemetry"] = boot.firstTelemetry;
+  doc["data"]["boot"]["fastConnect"] = boot.fastConnect;
+  fillPowerReport(doc["data"].createNestedObject("power"));
+  fillHeapReport(doc["data"].createNestedObject("heap"));
+  doc["data"]["ws"]["slowDisconnects"] = wsStats.slowDisconnects;
+  doc["data"]["ws"]["poolExhausted"] = wsStats.poolExhausted;
+  JsonArray rtt = doc["data"]["ws"].createNestedArray("rttUs"); // Smoothed, by client number; 0 = none
+  for (const WsLatency& latency : wsLatency) rtt.add(latency.averageUs);
   doc["timestamp"] = millis();
-  
-  String output;
-  serializeJson(doc, output);
-  webSocket.broadcastTXT(output);
+  broadcastJson(doc, WS_STATUS);
 }
 
 void setupRESTAPI() {
@@ -534,12 +3029,12 @@ void setupRESTAPI() {
   
   // Status endpoint
   server.on("/status", HTTP_GET, [](AsyncWebServerRequest *request){
-    DynamicJsonDocument doc(512);
-    doc["distance"] = readUltrasonic();
-    doc["smoke"] = readSmoke();
+    StaticJsonDocument<512> doc;
+    doc["distance"] = sensors.distance;
+    doc["smoke"] = sensors.smokeLevel;
     doc["buzzer"] = robot.buzzer;
-    doc["direction"] = robot.direction;
-    doc["expression"] = robot.expression;
+    doc["direction"] = directionState(robot.direction);
+    doc["expression"] = expressionNames[robot.expression];
     doc["oled_text"] = robot.oledText;
     doc["timestamp"] = millis();
     
@@ -550,10 +3045,13 @@ void setupRESTAPI() {
   
   // Sensor endpoint
   server.on("/sensor", HTTP_GET, [](AsyncWebServerRequest *request){
-    DynamicJsonDocument doc(256);
-    doc["ultrasonic"] = readUltrasonic();
-    doc["smoke"] = readSmoke();
-    doc["timestamp"] = millis();
+    StaticJsonDocument<256> doc;
+    doc["ultrasonic"] = sensors.distance;
+    doc["smoke"] = sensors.smokeLevel;
+    doc["smokePpm"] = sensors.smokePpm;
+    doc["battery"] = sensors.battery;
+    doc["batteryMv"] = sensors.batteryMillivolts;
+    doc["timestamp"] = sensors.timestamp;
     
     String output;
     serializeJson(doc, output);
@@ -565,7 +3063,8 @@ void setupRESTAPI() {
     if (request->hasParam("state")) {
       String state = request->getParam("state")->value();
       robot.buzzer = (state == "on");
-      digitalWrite(BUZZER_PIN, robot.buzzer ? HIGH : LOW);
+      writeBuzzer(robot.buzzer);
+      wakeLoop();
       
       request->send(200, "text/plain", "Buzzer " + state);
     } else {
@@ -576,25 +3075,119 @@ void setupRESTAPI() {
   // OLED control
   server.on("/oled", HTTP_GET, [](AsyncWebServerRequest *request){
     if (request->hasParam("text")) {
-      robot.oledText = request->getParam("text")->value();
-      updateOLED();
+      xSemaphoreTake(oled.lock, portMAX_DELAY);
+      strlcpy(oled.requestedText, request->getParam("text")->value().c_str(), sizeof(oled.requestedText));
+      oled.textRequested = true;
+      xSemaphoreGive(oled.lock);
+      wakeLoop(); // The loop redraws; this task never touches the display
       request->send(200, "text/plain", "OLED updated");
     } else {
       request->send(400, "text/plain", "Missing text parameter");
     }
   });
   
-  // Movement control
+  // Power state, time per state and measured wake-up latency
+  server.on("/power", HTTP_GET, [](AsyncWebServerRequest *request){
+    StaticJsonDocument<512> doc;
+    fillPowerReport(doc.to<JsonObject>());
+    
+    String output;
+    serializeJson(doc, output);
+    request->send(200, "application/json", output);
+  });
+  
+  // Per-client WebSocket queue depth, drop counters and round-trip time
+  server.on("/clients", HTTP_GET, [](AsyncWebServerRequest *request){
+    static StaticJsonDocument<2048> doc; // Off the async_tcp stack; handlers run one at a time there
+    doc.clear();
+    fillClientReport(doc.createNestedArray("clients"));
+    doc["slowDisconnects"] = wsStats.slowDisconnects;
+    doc["poolExhausted"] = wsStats.poolExhausted;
+    
+    String output;
+    serializeJson(doc, output);
+    request->send(200, "application/json", output);
+  });
+  
+  // Heap counters, to confirm the loop has stopped allocating
+  server.on("/heap", HTTP_GET, [](AsyncWebServerRequest *request){
+    StaticJsonDocument<256> doc;
+    fillHeapReport(doc.to<JsonObject>());
+    
+    String output;
+    serializeJson(doc, output);
+    request->send(200, "application/json", output);
+  });
+  
+  // Flight recorder dump: the ring in write order, FlightRecord layout (16 bytes, little-endian)
+  server.on("/log", HTTP_GET, [](AsyncWebServerRequest *request){
+    uint32_t end = __atomic_load_n(&flightLog.head, __ATOMIC_ACQUIRE);
+    uint32_t start = end > FLIGHT_LOG_RECORDS ? end - FLIGHT_LOG_RECORDS : 0;
+    size_t size = (end - start) * sizeof(FlightRecord);
+    
+    AsyncWebServerResponse *response = request->beginResponse("application/octet-stream", size,
+      [start, size](uint8_t *buffer, size_t maxLen, size_t index) -> size_t {
+        size_t written = 0;
+        while (written < maxLen && index + written < size) {
+          size_t offset = index + written;
+          FlightRecord record;
+          readFlightRecord(start + offset / sizeof(FlightRecord), record);
+          size_t skip = offset % sizeof(FlightRecord);
+          size_t count = min(sizeof(FlightRecord) - skip, maxLen - written);
+          memcpy(buffer + written, (uint8_t *)&record + skip, count);
+          written += count;
+        }
+        return written;
+      });
+    response->addHeader("Content-Disposition", "attachment; filename=flight.log");
+    request->send(response);
+  });
+  
+  // Capture: ?arm=1 records from the next boot on, ?arm=0 stops that
+  server.on("/capture", HTTP_GET, [](AsyncWebServerRequest *request){
+    StaticJsonDocument<192> doc;
+    if (request->hasParam("arm")) {
+      Preferences store;
+      store.begin("capture", false);
+      store.putBool("armed", request->getParam("arm")->value() == "1");
+      doc["armed"] = store.getBool("armed", false);
+      store.end();
+    }
+    doc["recording"] = capture.recording;
+    doc["full"] = capture.full;
+    doc["bytes"] = __atomic_load_n(&capture.length, __ATOMIC_ACQUIRE);
+    doc["capacity"] = capture.buffer != nullptr ? CAPTURE_BUFFER_SIZE : 0;
+    
+    String output;
+    serializeJson(doc, output);
+    request->send(200, "application/json", output);
+  });
+  
+  // Capture download, up to the last complete record; feed it to tools/replay
+  server.on("/capture.bin", HTTP_GET, [](AsyncWebServerRequest *request){
+    size_t size = __atomic_load_n(&capture.length, __ATOMIC_ACQUIRE);
+    if (size == 0) {
+      request->send(404, "text/plain", "Capture not armed at boot");
+      return;
+    }
+    
+    AsyncWebServerResponse *response = request->beginResponse("application/octet-stream", size,
+      [size](uint8_t *buffer, size_t maxLen, size_t index) -> size_t {
+        size_t count = min(maxLen, size - index);
+        memcpy(buffer, capture.buffer + index, count); // Bytes below a published length never change
+        return count;
+      });
+    response->addHeader("Content-Disposition", "attachment; filename=capture.bin");
+    request->send(response);
+  });
+  
+  // Movement control; the loop runs it and stops it after REST_MOVE_DURATION for safety
   server.on("/move", HTTP_GET, [](AsyncWebServerRequest *request){
     if (request->hasParam("direction")) {
       String direction = request->getParam("direction")->value();
-      moveRobot(direction);
-      
-      // Auto-stop after 2 seconds for safety
-      if (direction != "stop") {
-        delay(2000);
-        stopMotors();
-      }
+      restMove.direction = directionFromName(direction.c_str());
+      __atomic_store_n(&restMove.requested, true, __ATOMIC_RELEASE);
+      wakeLoop(); // Switch to full clock and tight sensor timing now
       
       request->send(200, "text/plain", "Moving " + direction);
     } else {
@@ -602,3 +3195,120 @@ void setupRESTAPI() {
     }
   });
 }
+
+void setupTelemetryStream() {
+  streamLock = xSemaphoreCreateMutex();
+  
+  // onConnect() only sees the event source client, which is created after the
+  // response headers are acked, so stash the query options by TCP connection here.
+  telemetryStream.setFilter([](AsyncWebServerRequest *request){
+    if (request->url() != "/stream") return true;
+    
+    StreamOptions& options = pendingStreams[nextPendingStream];
+    nextPendingStream = (nextPendingStream + 1) % STREAM_MAX_CLIENTS;
+    options.tcp = request->client();
+    options.interval = STREAM_DEFAULT_INTERVAL;
+    options.fields = STREAM_FIELD_ALL;
+    
+    if (request->hasParam("interval")) {
+      long interval = request->getParam("interval")->value().toInt();
+      options.interval = constrain(interval, STREAM_MIN_INTERVAL, STREAM_MAX_INTERVAL);
+    }
+    if (request->hasParam("fields")) {
+      const char* fields = request->getParam("fields")->value().c_str();
+      options.fields = 0;
+      if (strstr(fields, "ultrasonic")) options.fields |= STREAM_FIELD_ULTRASONIC;
+      if (strstr(fields, "smoke")) options.fields |= STREAM_FIELD_SMOKE;
+      if (strstr(fields, "battery")) options.fields |= STREAM_FIELD_BATTERY;
+      if (strstr(fields, "motion")) options.fields |= STREAM_FIELD_MOTION;
+      if (strstr(fields, "events")) options.fields |= STREAM_FIELD_EVENTS;
+    }
+    return true;
+  });
+  
+  telemetryStream.onConnect([](AsyncEventSourceClient *client){
+    StreamOptions options = { nullptr, STREAM_DEFAULT_INTERVAL, STREAM_FIELD_ALL };
+    for (int i = 0; i < STREAM_MAX_CLIENTS; i++) {
+      if (pendingStreams[i].tcp == client->client()) {
+        options = pendingStreams[i];
+        pendingStreams[i].tcp = nullptr;
+        break;
+      }
+    }
+    
+    xSemaphoreTake(streamLock, portMAX_DELAY);
+    int slot = -1;
+    for (int i = 0; i < STREAM_MAX_CLIENTS; i++) {
+      if (streamClients[i].client == nullptr) {
+        slot = i;
+        break;
+      }
+    }
+    if (slot >= 0) {
+      streamClients[slot] = { client, options.interval, options.fields, 0 };
+    }
+    xSemaphoreGive(streamLock);
+    logEvent(EV_STREAM_CONNECT, slot);
+    
+    if (slot < 0) {
+      client->send("stream full", "error");
+      client->client()->close();
+      return;
+    }
+    
+    // Same teardown the event source installs, plus releasing our slot first
+    client->client()->onDisconnect([](void *arg, AsyncClient *tcp){
+      AsyncEventSourceClient *client = (AsyncEventSourceClient *)arg;
+      xSemaphoreTake(streamLock, portMAX_DELAY);
+      for (int i = 0; i < STREAM_MAX_CLIENTS; i++) {
+        if (streamClients[i].client == client) {
+          streamClients[i].client = nullptr;
+          logEvent(EV_STREAM_DISCONNECT, i);
+        }
+      }
+      xSemaphoreGive(streamLock);
+      client->_onDisconnect();
+      delete tcp;
+    }, client);
+  });
+  
+  server.addHandler(&telemetryStream);
+}
+
+void streamTick() {
+  char frame[192];
+  unsigned long now = millis();
+  
+  xSemaphoreTake(streamLock, portMAX_DELAY);
+  for (int i = 0; i < STREAM_MAX_CLIENTS; i++) {
+    StreamClient& stream = streamClients[i];
+    if (stream.client == nullptr || now - stream.lastSent < stream.interval) continue;
+    stream.lastSent = now;
+    if (stream.client->packetsWaiting() > STREAM_MAX_BACKLOG) continue;
+    
+    StaticJsonDocument<192> doc;
+    if (stream.fields & STREAM_FIELD_ULTRASONIC) doc["ultrasonic"] = sensors.distance;
+    if (stream.fields & STREAM_FIELD_SMOKE) {
+      doc["smoke"] = smokeAlarm.active;
+      doc["smokeLevel"] = sensors.smokeLevel;
+    }
+    if (stream.fields & STREAM_FIELD_BATTERY) doc["battery"] = sensors.battery;
+    if (stream.fields & STREAM_FIELD_MOTION) doc["direction"] = directionState(robot.direction);
+    doc["timestamp"] = sensors.timestamp;
+    
+    serializeJson(doc, frame, sizeof(frame));
+    stream.client->send(frame, "telemetry", sensors.timestamp);
+  }
+  xSemaphoreGive(streamLock);
+}
+
+void streamEvent(const char* event, const char* message) {
+  xSemaphoreTake(streamLock, portMAX_DELAY);
+  for (int i = 0; i < STREAM_MAX_CLIENTS; i++) {
+    StreamClient& stream = streamClients[i];
+    if (stream.client != nullptr && (stream.fields & STREAM_FIELD_EVENTS)) {
+      stream.client->send(message, event, millis());
+    }
+  }
+  xSemaphoreGive(streamLock);
+}
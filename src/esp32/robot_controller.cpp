@@ -17,11 +17,17 @@
 #include <ArduinoJson.h>
 #include <Adafruit_SSD1306.h>
 #include <Adafruit_GFX.h>
+#include <Preferences.h>
 
 // Network credentials
 const char* ssid = "YOUR_WIFI_SSID";
 const char* password = "YOUR_WIFI_PASSWORD";
 
+// Fast reconnect: AP channel/BSSID and the last IP lease are cached in NVS
+#define WIFI_FAST_CONNECT_TIMEOUT 3000 // Fall back to scan + DHCP after this (ms)
+#define WIFI_REUSE_IP false            // Skip DHCP on fast connect (the lease is never renewed)
+#define WIFI_CACHE_VERSION 1
+
 // Pin definitions
 #define OLED_SDA 21
 #define OLED_SCL 22
@@ -44,6 +50,7 @@ const char* password = "YOUR_WIFI_PASSWORD";
 Adafruit_SSD1306 display(SCREEN_WIDTH, SCREEN_HEIGHT, &Wire, OLED_RST);
 AsyncWebServer server(80);
 WebSocketsServer webSocket = WebSocketsServer(81);
+Preferences preferences;
 
 // Robot state
 struct RobotState {
@@ -58,8 +65,29 @@ struct RobotState {
   float distance = 0;
   bool smokeDetected = false;
   float smokeLevel = 0;
+  bool displayReady = false;
 } robot;
 
+// Cached WiFi parameters
+struct WifiCache {
+  uint8_t version;
+  int32_t channel;
+  uint8_t bssid[6];
+  uint32_t ip;
+  uint32_t gateway;
+  uint32_t subnet;
+  uint32_t dns;
+};
+
+WifiCache wifiCache;
+bool wifiFastConnect = false;
+bool wifiOnline = false;
+unsigned long wifiAttemptStarted = 0;
+unsigned long bootHardwareReady = 0;
+unsigned long bootWifiConnected = 0;
+unsigned long bootFirstControlTick = 0;
+unsigned long bootFirstFrame = 0;
+
 // Timing
 unsigned long lastSensorRead = 0;
 unsigned long lastWebSocketUpdate = 0;
@@ -106,32 +134,24 @@ void setup() {
   ledcAttachPin(MOTOR_LEFT_PWM, 0);
   ledcAttachPin(MOTOR_RIGHT_PWM, 1);
   
-  // Initialize OLED
+  // Initialize OLED (run headless if the panel is missing)
   Wire.begin(OLED_SDA, OLED_SCL);
-  if(!display.begin(SSD1306_SWITCHCAPVCC, 0x3C)) {
+  robot.displayReady = display.begin(SSD1306_SWITCHCAPVCC, 0x3C);
+  if (robot.displayReady) {
+    display.clearDisplay();
+    display.setTextSize(1);
+    display.setTextColor(WHITE);
+    display.setCursor(0, 0);
+    display.println("Robot Starting...");
+    display.display();
+  } else {
     Serial.println("SSD1306 allocation failed");
-    for(;;);
-  }
-  
-  display.clearDisplay();
-  display.setTextSize(1);
-  display.setTextColor(WHITE);
-  display.setCursor(0, 0);
-  display.println("Robot Starting...");
-  display.display();
-  
-  // Connect to WiFi
-  WiFi.begin(ssid, password);
-  Serial.print("Connecting to WiFi");
-  
-  while (WiFi.status() != WL_CONNECTED) {
-    delay(500);
-    Serial.print(".");
   }
+  bootHardwareReady = millis();
   
-  Serial.println();
-  Serial.print("Connected! IP address: ");
-  Serial.println(WiFi.localIP());
+  // Connect to WiFi in the background so sensors and motors run immediately
+  startWiFi();
+  Serial.println("Connecting to WiFi");
   
   // Initialize WebSocket
   webSocket.begin();
@@ -149,6 +169,8 @@ void setup() {
 }
 
 void loop() {
+  if (bootFirstControlTick == 0) bootFirstControlTick = millis();
+  wifiTick();
   webSocket.loop();
   
   unsigned long currentTime = millis();
@@ -179,6 +201,66 @@ void loop() {
   }
 }
 
+void startWiFi() {
+  WiFi.mode(WIFI_STA);
+  WiFi.persistent(false);
+  WiFi.setAutoReconnect(true);
+  
+  preferences.begin("wifi", false);
+  wifiFastConnect = preferences.getBytes("cache", &wifiCache, sizeof(wifiCache)) == sizeof(wifiCache) &&
+                    wifiCache.version == WIFI_CACHE_VERSION;
+  
+  if (wifiFastConnect) {
+    if (WIFI_REUSE_IP) {
+      WiFi.config(IPAddress(wifiCache.ip), IPAddress(wifiCache.gateway),
+                  IPAddress(wifiCache.subnet), IPAddress(wifiCache.dns));
+    }
+    WiFi.begin(ssid, password, wifiCache.channel, wifiCache.bssid);
+  } else {
+    WiFi.begin(ssid, password);
+  }
+  wifiAttemptStarted = millis();
+}
+
+void wifiTick() {
+  bool connected = WiFi.status() == WL_CONNECTED;
+  
+  if (connected && !wifiOnline) {
+    wifiOnline = true;
+    if (bootWifiConnected == 0) bootWifiConnected = millis();
+    Serial.print("Connected! IP address: ");
+    Serial.println(WiFi.localIP());
+    
+    WifiCache cache;
+    memset(&cache, 0, sizeof(cache));
+    cache.version = WIFI_CACHE_VERSION;
+    cache.channel = WiFi.channel();
+    memcpy(cache.bssid, WiFi.BSSID(), sizeof(cache.bssid));
+    cache.ip = WiFi.localIP();
+    cache.gateway = WiFi.gatewayIP();
+    cache.subnet = WiFi.subnetMask();
+    cache.dns = WiFi.dnsIP();
+    if (!wifiFastConnect || memcmp(&cache, &wifiCache, sizeof(cache)) != 0) {
+      wifiCache = cache;
+      preferences.putBytes("cache", &cache, sizeof(cache));
+    }
+  }
+  else if (!connected && wifiOnline) {
+    wifiOnline = false;
+    Serial.println("WiFi lost, reconnecting...");
+  }
+  else if (!connected && wifiFastConnect && millis() - wifiAttemptStarted > WIFI_FAST_CONNECT_TIMEOUT) {
+    // Stale cache: forget it and do a normal scan + DHCP
+    Serial.println("Fast connect failed, scanning...");
+    wifiFastConnect = false;
+    preferences.remove("cache");
+    WiFi.disconnect();
+    WiFi.config(INADDR_NONE, INADDR_NONE, INADDR_NONE);
+    WiFi.begin(ssid, password);
+    wifiAttemptStarted = millis();
+  }
+}
+
 void readSensors() {
   // Read ultrasonic sensor
   if (robot.ultrasonicEnabled) {
@@ -213,6 +295,13 @@ void sendSensorData() {
   String message;
   serializeJson(doc, message);
   webSocket.broadcastTXT(message);
+  
+  if (bootFirstFrame == 0 && webSocket.connectedClients() > 0) {
+    bootFirstFrame = millis();
+    Serial.printf("Boot: hardware %lums, control loop %lums, WiFi %lums (%s), first frame %lums\n",
+                  bootHardwareReady, bootFirstControlTick, bootWifiConnected,
+                  wifiFastConnect ? "fast" : "scan", bootFirstFrame);
+  }
 }
 
 void webSocketEvent(uint8_t num, WStype_t type, uint8_t * payload, size_t length) {
@@ -341,6 +430,8 @@ void setBuzzer(bool state) {
 }
 
 void updateOLED() {
+  if (!robot.displayReady) return;
+  
   display.clearDisplay();
   
   // Draw eyes based on expression
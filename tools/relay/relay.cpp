@@ -0,0 +1,749 @@
+/*
+  EMU Telemetry Relay
+
+  Holds a single WebSocket connection to each robot and fans its telemetry out to any
+  number of local subscribers (dashboards, loggers, backends). Commands from subscribers
+  are merged and forwarded upstream at the pace the robot's link can take, so the
+  robot sees one client and constant airtime no matter how many consumers attach.
+
+  Build:  g++ -std=c++17 -O2 -Wall -o emu-relay relay.cpp
+  Run:    ./emu-relay --listen 9000 front=192.168.1.50 rear=192.168.1.51:81
+  Test:   ./emu-sim --port 8181 --count 2 &
+          ./emu-relay --listen 9000 a=127.0.0.1:8181 b=127.0.0.1:8182
+
+  Subscribers connect to ws://<relay>:<listen>/<robot name>; "/" selects the first robot.
+  Everything the robot sends is forwarded unchanged, plus a "relay_status" frame whenever
+  the upstream link goes up or down. New subscribers immediately receive the robot's last
+  status_update, sensor_data and scan_map so they don't wait for the next broadcast.
+
+  Back-pressure:
+  - Upstream: commands wait in a per-robot queue and are released only while less than
+    UPSTREAM_WINDOW bytes are unacknowledged on the robot socket. While queued, a newer
+    command for the same setting (move, speed, buzzer, oled, expression, teleop) replaces
+    the older one; its sender gets an error frame naming the superseded commandId. If the
+    queue still grows past COMMAND_QUEUE_HIGH, reading from that robot's subscribers is
+    paused until it drains to COMMAND_QUEUE_LOW.
+  - Downstream: a subscriber with more than SUBSCRIBER_SOFT_LIMIT bytes buffered skips
+    sensor_data and scan_progress frames (events, acks and status still go through); past
+    SUBSCRIBER_HARD_LIMIT it is disconnected.
+
+  Clock sync: the relay sends each robot a time_sync probe every SYNC_INTERVAL and fits
+  the robot's clock against its own wall clock (see "Clock sync" below). Once it has an
+  estimate, relay_status carries it as "clock": {offsetUs, referenceUs, driftPpm,
+  roundTripUs, robotRttUs, samples}, re-sent every SYNC_REPORT_INTERVAL. A robot time t in
+  microseconds (a frame's "timestamp" * 1000) is Unix time in microseconds
+      t - offsetUs - driftPpm * (t - offsetUs - referenceUs) / 1e6
+  The estimate is dropped when the link goes down, since the robot may have rebooted.
+  The relay's own probes are answered to it alone; subscribers may send their own.
+*/
+
+#include "websocket.h"
+
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <linux/sockios.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+using Clock = std::chrono::steady_clock;
+using std::chrono::milliseconds;
+
+// Configuration
+#define DEFAULT_LISTEN_PORT 9000
+#define DEFAULT_ROBOT_PORT 81
+#define UPSTREAM_WINDOW 1024            // Unacknowledged bytes allowed in flight to a robot
+#define COMMAND_QUEUE_HIGH 32           // Pause subscriber reads above this many queued commands
+#define COMMAND_QUEUE_LOW 8             // ...and resume below this
+#define SUBSCRIBER_SOFT_LIMIT (64 * 1024)
+#define SUBSCRIBER_HARD_LIMIT (1024 * 1024)
+#define CONNECT_TIMEOUT 3000            // ms to complete TCP + upgrade handshake
+#define UPSTREAM_SILENCE_PING 2000      // Robot broadcasts every 500ms; ping after this much quiet
+#define UPSTREAM_SILENCE_LIMIT 5000     // ...and reconnect after this much
+#define RECONNECT_MIN 500
+#define RECONNECT_MAX 10000
+#define STATS_INTERVAL 30000
+#define SYNC_INTERVAL 2000              // ms between clock probes to a robot
+#define SYNC_FAST_INTERVAL 250          // ...until SYNC_FAST_SAMPLES have come back
+#define SYNC_FAST_SAMPLES 8
+#define SYNC_TIMEOUT 2000               // A probe unanswered this long is given up
+#define SYNC_WINDOW 64                  // Probes kept for the fit (~2 minutes)
+#define SYNC_SLACK_US 2000              // Probes within max(this, half the best) of the best round trip are fitted
+#define SYNC_DRIFT_SPAN 20000           // ms of samples needed before drift is fitted
+#define SYNC_REPORT_INTERVAL 10000
+#define SYNC_ID_PREFIX "relay-"
+
+// Binary command opcodes (see ESP32Controller.cpp)
+#define BIN_MOVE 0x01
+#define BIN_SET_SPEED 0x02
+#define BIN_BUZZER 0x03
+#define BIN_EXPRESSION 0x04
+#define BIN_TELEOP 0x07
+#define BIN_HEADER_SIZE 3
+
+struct Robot;
+
+struct Subscriber {
+  std::unique_ptr<ws::Connection> conn;
+  Robot* robot = nullptr;
+  bool paused = false;
+  uint64_t telemetrySkipped = 0;
+};
+
+struct QueuedCommand {
+  uint8_t opcode;          // ws::OP_TEXT or ws::OP_BINARY
+  std::string payload;
+  std::string mergeKey;    // Empty when the command must not be merged
+  std::string commandId;   // For telling the sender when it's superseded
+  Subscriber* origin;
+};
+
+struct SyncSample {
+  int64_t wallUs;        // Relay clock halfway between sending the probe and reading the reply
+  int64_t offsetUs;      // Robot clock minus relay clock
+  int64_t roundTripUs;   // t3 - t0, robot loop delay included
+};
+
+struct ClockSync {
+  std::deque<SyncSample> samples;
+  uint32_t nextId = 1;
+  uint32_t probeId = 0;  // Of the probe in flight, 0 = none
+  int64_t probeSentUs = 0;
+  Clock::time_point lastProbe;
+  Clock::time_point lastReport;
+  uint64_t probes = 0;
+
+  bool valid = false;
+  int64_t offsetUs = 0;  // Robot minus relay at referenceUs
+  int64_t referenceUs = 0;
+  double driftPpm = 0;
+  int64_t roundTripUs = 0;
+  uint32_t robotRttUs = 0; // The robot's own ping-measured round trip to the relay
+};
+
+struct Robot {
+  std::string name;
+  std::string host;
+  uint16_t port = DEFAULT_ROBOT_PORT;
+
+  std::unique_ptr<ws::Connection> upstream;
+  bool online = false;
+  Clock::time_point connectStarted;
+  Clock::time_point nextConnect;
+  Clock::time_point lastHeard;
+  bool pingSent = false;
+  int backoff = RECONNECT_MIN;
+
+  std::string lastStatus;
+  std::string lastTelemetry;
+  std::string lastScanMap;
+  std::vector<Subscriber*> subscribers;
+  std::deque<QueuedCommand> commands;
+  bool throttled = false;
+  ClockSync clock;
+
+  uint64_t framesIn = 0;
+  uint64_t commandsForwarded = 0;
+  uint64_t commandsMerged = 0;
+};
+
+enum EndpointKind { LISTENER, UPSTREAM, SUBSCRIBER };
+
+struct Endpoint {
+  EndpointKind kind;
+  Robot* robot;
+  Subscriber* subscriber;
+};
+
+static int epollFd = -1;
+static int listenFd = -1;
+static std::vector<std::unique_ptr<Robot>> robots;
+static std::unordered_map<int, Endpoint> endpoints;
+static std::vector<std::unique_ptr<Subscriber>> subscribers;
+static std::vector<int> resumedSubscribers;   // fds to service once the current event batch is done
+static volatile sig_atomic_t running = 1;
+
+void watch(int fd, Endpoint endpoint) {
+  epoll_event event;
+  memset(&event, 0, sizeof(event));
+  // Edge-triggered: every handler drains its socket until EAGAIN
+  event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+  event.data.fd = fd;
+  epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event);
+  endpoints[fd] = endpoint;
+}
+
+void unwatch(int fd) {
+  epoll_ctl(epollFd, EPOLL_CTL_DEL, fd, nullptr);
+  endpoints.erase(fd);
+}
+
+long elapsedMs(Clock::time_point since) {
+  return std::chrono::duration_cast<milliseconds>(Clock::now() - since).count();
+}
+
+std::string jsonEscape(const std::string& text) {
+  std::string out;
+  for (char c : text) {
+    if (c == '"' || c == '\\') out += '\\';
+    if ((unsigned char)c >= 0x20) out += c;
+  }
+  return out;
+}
+
+// --- Subscribers ---
+
+void deliver(Subscriber* subscriber, const std::string& frame, bool telemetry) {
+  ws::Connection& conn = *subscriber->conn;
+  if (conn.pendingBytes() > SUBSCRIBER_HARD_LIMIT) {
+    fprintf(stderr, "[%s] dropping slow subscriber (fd %d, %zu bytes queued)\n",
+            subscriber->robot->name.c_str(), conn.fd(), conn.pendingBytes());
+    conn.closeWithStatus(1008);
+    return;
+  }
+  if (telemetry && conn.pendingBytes() > SUBSCRIBER_SOFT_LIMIT) {
+    subscriber->telemetrySkipped++;
+    return;
+  }
+  conn.sendEncoded(frame);
+  conn.onWritable();
+}
+
+void broadcast(Robot& robot, uint8_t opcode, const std::string& payload, bool telemetry) {
+  std::string frame = ws::encodeFrame(opcode, payload, false);
+  for (Subscriber* subscriber : robot.subscribers) deliver(subscriber, frame, telemetry);
+}
+
+void sendRelayStatus(Robot& robot, Subscriber* only = nullptr) {
+  std::string status = "{\"type\":\"relay_status\",\"data\":{\"robot\":\"" + jsonEscape(robot.name) +
+                       "\",\"connected\":" + (robot.online ? "true" : "false") +
+                       ",\"subscribers\":" + std::to_string(robot.subscribers.size());
+  const ClockSync& clock = robot.clock;
+  if (clock.valid) {
+    char estimate[224];
+    snprintf(estimate, sizeof(estimate),
+             ",\"clock\":{\"offsetUs\":%lld,\"referenceUs\":%lld,\"driftPpm\":%.3f,\"roundTripUs\":%lld,"
+             "\"robotRttUs\":%u,\"samples\":%zu}",
+             (long long)clock.offsetUs, (long long)clock.referenceUs, clock.driftPpm, (long long)clock.roundTripUs,
+             clock.robotRttUs, clock.samples.size());
+    status += estimate;
+  }
+  status += "}}";
+  if (only) deliver(only, ws::encodeFrame(ws::OP_TEXT, status, false), false);
+  else broadcast(robot, ws::OP_TEXT, status, false);
+}
+
+void sendCommandError(Subscriber* subscriber, const std::string& commandId, const std::string& message) {
+  if (!subscriber) return;
+  std::string error = "{\"type\":\"error\",\"data\":{\"commandId\":\"" + jsonEscape(commandId) +
+                      "\",\"message\":\"" + jsonEscape(message) + "\"}}";
+  deliver(subscriber, ws::encodeFrame(ws::OP_TEXT, error, false), false);
+}
+
+void setPaused(Subscriber* subscriber, bool paused);
+void serviceSubscriber(Subscriber* subscriber);
+
+void removeSubscriber(Subscriber* subscriber) {
+  Robot* robot = subscriber->robot;
+  if (robot) {
+    robot->subscribers.erase(std::remove(robot->subscribers.begin(), robot->subscribers.end(), subscriber),
+                             robot->subscribers.end());
+    for (QueuedCommand& command : robot->commands) {
+      if (command.origin == subscriber) command.origin = nullptr;
+    }
+  }
+  unwatch(subscriber->conn->fd());
+  subscribers.erase(std::remove_if(subscribers.begin(), subscribers.end(),
+                                   [subscriber](const std::unique_ptr<Subscriber>& s) { return s.get() == subscriber; }),
+                    subscribers.end());
+}
+
+// --- Commands ---
+
+std::string binaryMergeKey(const std::string& payload) {
+  if (payload.size() < BIN_HEADER_SIZE) return "";
+  switch ((uint8_t)payload[0]) {
+    case BIN_MOVE: return "move";
+    case BIN_SET_SPEED: return "speed";
+    case BIN_BUZZER: return "buzzer";
+    case BIN_EXPRESSION: return "expression";
+    case BIN_TELEOP: return "teleop";
+    default: return "";
+  }
+}
+
+std::string textMergeKey(const std::string& payload) {
+  static const char* const mergeable[] = { "move", "speed", "buzzer", "oled", "expression", "teleop" };
+  if (ws::jsonField(payload, "type") != "command") return "";
+  std::string action = ws::jsonField(payload, "action");
+  for (const char* name : mergeable) {
+    if (action == name) return action;
+  }
+  return "";
+}
+
+void pumpCommands(Robot& robot) {
+  if (!robot.online) return;
+  ws::Connection& conn = *robot.upstream;
+
+  while (!robot.commands.empty()) {
+    int unsent = 0;
+    ioctl(conn.fd(), SIOCOUTQ, &unsent);
+    if (conn.pendingBytes() + (size_t)unsent >= UPSTREAM_WINDOW) break;
+
+    QueuedCommand& command = robot.commands.front();
+    conn.send(command.opcode, command.payload);
+    robot.commands.pop_front();
+    robot.commandsForwarded++;
+    if (!conn.onWritable()) break;
+  }
+
+  if (robot.throttled && robot.commands.size() <= COMMAND_QUEUE_LOW) {
+    robot.throttled = false;
+    for (Subscriber* subscriber : robot.subscribers) setPaused(subscriber, false);
+  }
+}
+
+void enqueueCommand(Robot& robot, Subscriber* origin, uint8_t opcode, const std::string& payload) {
+  QueuedCommand command;
+  command.opcode = opcode;
+  command.payload = payload;
+  command.origin = origin;
+  if (opcode == ws::OP_BINARY) {
+    command.mergeKey = binaryMergeKey(payload);
+    if (payload.size() >= BIN_HEADER_SIZE) {
+      uint16_t seq = (uint8_t)payload[1] | ((uint8_t)payload[2] << 8);
+      if (seq != 0) command.commandId = std::to_string(seq);
+    }
+  } else {
+    command.mergeKey = textMergeKey(payload);
+    command.commandId = ws::jsonField(payload, "id");
+  }
+
+  if (!robot.online) {
+    // Never replay stale commands to a robot after it reconnects
+    sendCommandError(origin, command.commandId, "Robot " + robot.name + " is offline");
+    return;
+  }
+
+  if (!command.mergeKey.empty()) {
+    for (QueuedCommand& queued : robot.commands) {
+      if (queued.mergeKey != command.mergeKey) continue;
+      sendCommandError(queued.origin, queued.commandId, "Superseded by a newer " + command.mergeKey + " command");
+      queued = std::move(command);
+      robot.commandsMerged++;
+      pumpCommands(robot);
+      return;
+    }
+  }
+
+  robot.commands.push_back(std::move(command));
+  pumpCommands(robot);
+
+  if (!robot.throttled && robot.commands.size() >= COMMAND_QUEUE_HIGH) {
+    robot.throttled = true;
+    for (Subscriber* subscriber : robot.subscribers) setPaused(subscriber, true);
+  }
+}
+
+// --- Subscriber I/O ---
+
+void serviceSubscriber(Subscriber* subscriber) {
+  ws::Connection& conn = *subscriber->conn;
+  bool wasOpen = conn.isOpen();
+  if (!subscriber->paused && !conn.onReadable()) {
+    removeSubscriber(subscriber);
+    return;
+  }
+
+  if (!wasOpen && conn.isOpen()) {
+    // Handshake just completed: route by path
+    std::string name = conn.path().substr(conn.path().find_last_of('/') + 1);
+    Robot* robot = nullptr;
+    for (auto& candidate : robots) {
+      if (candidate->name == name || (name.empty() && !robot)) robot = candidate.get();
+    }
+    if (!robot) {
+      conn.closeWithStatus(1008);
+      removeSubscriber(subscriber);
+      return;
+    }
+    subscriber->robot = robot;
+    robot->subscribers.push_back(subscriber);
+    subscriber->paused = robot->throttled;
+    sendRelayStatus(*robot, subscriber);
+    if (!robot->lastStatus.empty()) deliver(subscriber, ws::encodeFrame(ws::OP_TEXT, robot->lastStatus, false), false);
+    if (!robot->lastTelemetry.empty()) deliver(subscriber, ws::encodeFrame(ws::OP_TEXT, robot->lastTelemetry, false), false);
+    if (!robot->lastScanMap.empty()) deliver(subscriber, ws::encodeFrame(ws::OP_TEXT, robot->lastScanMap, false), false);
+    printf("[%s] subscriber connected (fd %d, %zu total)\n", robot->name.c_str(), conn.fd(), robot->subscribers.size());
+  }
+
+  ws::Frame message;
+  while (!subscriber->paused && conn.nextMessage(message)) {
+    if (subscriber->robot) enqueueCommand(*subscriber->robot, subscriber, message.opcode, message.payload);
+  }
+
+  if (!conn.onWritable() || conn.state() == ws::Connection::CLOSED) {
+    if (subscriber->robot) {
+      printf("[%s] subscriber disconnected (fd %d)\n", subscriber->robot->name.c_str(), conn.fd());
+    }
+    removeSubscriber(subscriber);
+  }
+}
+
+void setPaused(Subscriber* subscriber, bool paused) {
+  if (subscriber->paused == paused) return;
+  subscriber->paused = paused;
+  // Edge-triggered epoll won't re-report data that arrived while paused
+  if (!paused) resumedSubscribers.push_back(subscriber->conn->fd());
+}
+
+// Services resumed subscribers and reaps the ones closed while delivering to them
+void subscriberHousekeeping() {
+  std::vector<int> resumed;
+  resumed.swap(resumedSubscribers);
+  for (int fd : resumed) {
+    auto found = endpoints.find(fd);
+    if (found != endpoints.end() && found->second.kind == SUBSCRIBER) serviceSubscriber(found->second.subscriber);
+  }
+
+  std::vector<Subscriber*> closed;
+  for (auto& subscriber : subscribers) {
+    if (subscriber->conn->state() == ws::Connection::CLOSED) closed.push_back(subscriber.get());
+  }
+  for (Subscriber* subscriber : closed) removeSubscriber(subscriber);
+}
+
+void acceptSubscribers() {
+  for (;;) {
+    int fd = accept(listenFd, nullptr, nullptr);
+    if (fd < 0) break;
+    int yes = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+    ws::setNonBlocking(fd);
+
+    auto subscriber = std::make_unique<Subscriber>();
+    subscriber->conn = std::make_unique<ws::Connection>(fd, ws::Connection::SERVER);
+    watch(fd, { SUBSCRIBER, nullptr, subscriber.get() });
+    subscribers.push_back(std::move(subscriber));
+  }
+}
+
+// --- Clock sync ---
+// NTP's four timestamps: t0 and t3 are the relay's wall clock when the probe is sent and
+// the reply read, t1 and t2 the robot's esp_timer clock when it read the probe and sent
+// the reply. Each probe gives offset = ((t1 - t0) + (t2 - t3)) / 2. Queueing only ever
+// lengthens a round trip, and the robot's loop reads probes on its own schedule, which
+// t3 - t0 sees but NTP's delay (t3 - t0) - (t2 - t1) would not, so only the probes close
+// to the shortest t3 - t0 in the window are trusted. A least-squares line through them
+// gives the offset at the newest one and the drift as its slope.
+
+int64_t wallMicros() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+      std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+void updateClockEstimate(ClockSync& clock) {
+  int64_t best = INT64_MAX;
+  for (const SyncSample& sample : clock.samples) best = std::min(best, sample.roundTripUs);
+  int64_t limit = best + std::max<int64_t>(best / 2, SYNC_SLACK_US);
+
+  // Relative to the newest sample and the best offset, so the sums stay precise in doubles
+  const SyncSample& newest = clock.samples.back();
+  int64_t baseOffset = 0;
+  for (const SyncSample& sample : clock.samples) {
+    if (sample.roundTripUs == best) baseOffset = sample.offsetUs;
+  }
+  double n = 0, sx = 0, sy = 0, sxx = 0, sxy = 0;
+  int64_t earliest = newest.wallUs;
+  for (const SyncSample& sample : clock.samples) {
+    if (sample.roundTripUs > limit) continue;
+    double x = (double)(sample.wallUs - newest.wallUs);
+    double y = (double)(sample.offsetUs - baseOffset);
+    n++;
+    sx += x;
+    sy += y;
+    sxx += x * x;
+    sxy += x * y;
+    earliest = std::min(earliest, sample.wallUs);
+  }
+
+  double slope = 0;
+  double spread = n * sxx - sx * sx;
+  if (newest.wallUs - earliest >= (int64_t)SYNC_DRIFT_SPAN * 1000 && spread > 0) slope = (n * sxy - sx * sy) / spread;
+  clock.offsetUs = baseOffset + (int64_t)llround((sy - slope * sx) / n);
+  clock.referenceUs = newest.wallUs;
+  clock.driftPpm = slope * 1e6;
+  clock.roundTripUs = best;
+  clock.valid = true;
+}
+
+// Probes go straight out, only when no commands are waiting, so they don't time the queue
+void sendSyncProbe(Robot& robot) {
+  ClockSync& clock = robot.clock;
+  if (clock.probeId != 0 && elapsedMs(clock.lastProbe) < SYNC_TIMEOUT) return;
+  long interval = clock.samples.size() < SYNC_FAST_SAMPLES ? SYNC_FAST_INTERVAL : SYNC_INTERVAL;
+  if (elapsedMs(clock.lastProbe) < interval || !robot.commands.empty()) return;
+
+  clock.probeId = clock.nextId++;
+  clock.lastProbe = Clock::now();
+  clock.probes++;
+  std::string probe = "{\"type\":\"time_sync\",\"id\":\"" SYNC_ID_PREFIX + std::to_string(clock.probeId) + "\"}";
+  clock.probeSentUs = wallMicros();
+  robot.upstream->sendText(probe);
+  robot.upstream->onWritable();
+}
+
+void handleSyncReply(Robot& robot, const std::string& payload, int64_t receivedUs) {
+  ClockSync& clock = robot.clock;
+  std::string id = ws::jsonField(payload, "id");
+  if (clock.probeId == 0 || id != SYNC_ID_PREFIX + std::to_string(clock.probeId)) return; // Late or foreign
+  clock.probeId = 0;
+
+  int64_t t1 = atoll(ws::jsonField(payload, "t1").c_str());
+  int64_t t2 = atoll(ws::jsonField(payload, "t2").c_str());
+  SyncSample sample;
+  sample.roundTripUs = receivedUs - clock.probeSentUs;
+  sample.wallUs = clock.probeSentUs + sample.roundTripUs / 2;
+  sample.offsetUs = ((t1 - clock.probeSentUs) + (t2 - receivedUs)) / 2;
+  clock.robotRttUs = (uint32_t)atol(ws::jsonField(payload, "rttUs").c_str());
+  clock.samples.push_back(sample);
+  if (clock.samples.size() > SYNC_WINDOW) clock.samples.pop_front();
+
+  bool first = !clock.valid;
+  updateClockEstimate(clock);
+  if (first || elapsedMs(clock.lastReport) >= SYNC_REPORT_INTERVAL) {
+    clock.lastReport = Clock::now();
+    sendRelayStatus(robot);
+  }
+}
+
+// --- Upstream ---
+
+void dropUpstream(Robot& robot, const char* reason) {
+  if (robot.upstream) {
+    unwatch(robot.upstream->fd());
+    robot.upstream.reset();
+  }
+  bool wasOnline = robot.online;
+  robot.online = false;
+  robot.nextConnect = Clock::now() + milliseconds(robot.backoff);
+  robot.backoff = std::min(robot.backoff * 2, RECONNECT_MAX);
+
+  for (QueuedCommand& command : robot.commands) {
+    sendCommandError(command.origin, command.commandId, "Robot " + robot.name + " disconnected");
+  }
+  robot.commands.clear();
+  robot.clock = ClockSync();
+  if (robot.throttled) {
+    robot.throttled = false;
+    for (Subscriber* subscriber : robot.subscribers) setPaused(subscriber, false);
+  }
+
+  if (wasOnline) {
+    printf("[%s] upstream lost: %s\n", robot.name.c_str(), reason);
+    sendRelayStatus(robot);
+  }
+}
+
+void connectUpstream(Robot& robot) {
+  int fd = ws::connectTo(robot.host, robot.port);
+  if (fd < 0) {
+    dropUpstream(robot, "connect failed");
+    return;
+  }
+  robot.upstream = std::make_unique<ws::Connection>(fd, ws::Connection::CLIENT);
+  robot.connectStarted = Clock::now();
+  watch(fd, { UPSTREAM, &robot, nullptr });
+}
+
+void serviceUpstream(Robot& robot, uint32_t events) {
+  ws::Connection& conn = *robot.upstream;
+
+  if (conn.state() == ws::Connection::CONNECTING) {
+    if (!(events & (EPOLLOUT | EPOLLERR | EPOLLHUP))) return;
+    conn.startClientHandshake(robot.host, robot.port);
+  }
+  if (!conn.onWritable() || !conn.onReadable()) {
+    dropUpstream(robot, "connection closed");
+    return;
+  }
+
+  if (conn.isOpen() && !robot.online) {
+    robot.online = true;
+    robot.backoff = RECONNECT_MIN;
+    robot.lastHeard = Clock::now();
+    printf("[%s] upstream connected to %s:%u\n", robot.name.c_str(), robot.host.c_str(), robot.port);
+    sendRelayStatus(robot);
+  }
+
+  ws::Frame message;
+  std::string pong;
+  if (conn.takePong(pong)) robot.lastHeard = Clock::now();
+  int64_t receivedUs = wallMicros();
+
+  while (conn.nextMessage(message)) {
+    robot.framesIn++;
+    robot.lastHeard = Clock::now();
+    robot.pingSent = false;
+
+    bool telemetry = false;
+    if (message.opcode == ws::OP_TEXT) {
+      std::string type = ws::jsonField(message.payload, "type");
+      if (type == "sensor_data") {
+        robot.lastTelemetry = message.payload;
+        telemetry = true;
+      } else if (type == "status_update") {
+        robot.lastStatus = message.payload;
+      } else if (type == "scan_progress") {
+        telemetry = true; // Superseded by the scan_map that ends the scan
+      } else if (type == "scan_map") {
+        robot.lastScanMap = message.payload;
+      } else if (type == "time_sync" && ws::jsonField(message.payload, "id").rfind(SYNC_ID_PREFIX, 0) == 0) {
+        handleSyncReply(robot, message.payload, receivedUs);
+        continue;
+      }
+    }
+    broadcast(robot, message.opcode, message.payload, telemetry);
+  }
+
+  if (conn.state() == ws::Connection::CLOSED) dropUpstream(robot, "closed by robot");
+  else pumpCommands(robot);
+}
+
+void upstreamTimers(Robot& robot) {
+  if (!robot.upstream) {
+    if (Clock::now() >= robot.nextConnect) connectUpstream(robot);
+    return;
+  }
+  if (!robot.online) {
+    if (elapsedMs(robot.connectStarted) > CONNECT_TIMEOUT) dropUpstream(robot, "connect timeout");
+    return;
+  }
+
+  long silent = elapsedMs(robot.lastHeard);
+  if (silent > UPSTREAM_SILENCE_LIMIT) {
+    dropUpstream(robot, "no data from robot");
+  } else if (silent > UPSTREAM_SILENCE_PING && !robot.pingSent) {
+    robot.upstream->sendPing();
+    robot.upstream->onWritable();
+    robot.pingSent = true;
+  } else {
+    pumpCommands(robot);
+    sendSyncProbe(robot);
+  }
+}
+
+void printStats() {
+  for (auto& robot : robots) {
+    uint64_t skipped = 0;
+    for (Subscriber* subscriber : robot->subscribers) skipped += subscriber->telemetrySkipped;
+    printf("[%s] %s, %zu subscribers, %llu frames in, %llu commands forwarded, %llu merged, %zu queued, %llu telemetry skipped\n",
+           robot->name.c_str(), robot->online ? "online" : "offline", robot->subscribers.size(),
+           (unsigned long long)robot->framesIn, (unsigned long long)robot->commandsForwarded,
+           (unsigned long long)robot->commandsMerged, robot->commands.size(), (unsigned long long)skipped);
+    const ClockSync& clock = robot->clock;
+    if (clock.valid) {
+      printf("[%s] clock offset %lldus, drift %.2fppm, best round trip %lldus, robot rtt %uus, %llu probes\n",
+             robot->name.c_str(), (long long)clock.offsetUs, clock.driftPpm, (long long)clock.roundTripUs,
+             clock.robotRttUs, (unsigned long long)clock.probes);
+    }
+  }
+  fflush(stdout);
+}
+
+bool parseRobot(const char* arg) {
+  std::string spec = arg;
+  size_t equals = spec.find('=');
+  if (equals == std::string::npos || equals == 0) return false;
+
+  auto robot = std::make_unique<Robot>();
+  robot->name = spec.substr(0, equals);
+  std::string address = spec.substr(equals + 1);
+  size_t colon = address.find(':');
+  robot->host = address.substr(0, colon);
+  if (colon != std::string::npos) robot->port = (uint16_t)atoi(address.c_str() + colon + 1);
+  if (robot->host.empty() || robot->port == 0) return false;
+  robot->nextConnect = Clock::now();
+  robots.push_back(std::move(robot));
+  return true;
+}
+
+void onSignal(int) { running = 0; }
+
+int main(int argc, char** argv) {
+  uint16_t listenPort = DEFAULT_LISTEN_PORT;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--listen") == 0 && i + 1 < argc) {
+      listenPort = (uint16_t)atoi(argv[++i]);
+    } else if (!parseRobot(argv[i])) {
+      fprintf(stderr, "usage: %s [--listen PORT] NAME=HOST[:PORT]...\n", argv[0]);
+      return 2;
+    }
+  }
+  if (robots.empty()) {
+    fprintf(stderr, "usage: %s [--listen PORT] NAME=HOST[:PORT]...\n", argv[0]);
+    return 2;
+  }
+
+  setvbuf(stdout, nullptr, _IOLBF, 0);
+  signal(SIGPIPE, SIG_IGN);
+  signal(SIGINT, onSignal);
+  signal(SIGTERM, onSignal);
+
+  epollFd = epoll_create1(0);
+  listenFd = ws::listenOn(listenPort);
+  if (epollFd < 0 || listenFd < 0) {
+    perror("relay");
+    return 1;
+  }
+  watch(listenFd, { LISTENER, nullptr, nullptr });
+  printf("Relay listening on port %u for %zu robot(s)\n", listenPort, robots.size());
+
+  Clock::time_point lastStats = Clock::now();
+  epoll_event events[64];
+
+  while (running) {
+    bool backlog = false;
+    for (auto& robot : robots) backlog |= !robot->commands.empty();
+
+    // Short tick while commands wait for the robot to acknowledge earlier ones
+    int count = epoll_wait(epollFd, events, 64, backlog ? 10 : 100);
+    for (int i = 0; i < count; i++) {
+      auto found = endpoints.find(events[i].data.fd);
+      if (found == endpoints.end()) continue;
+      Endpoint endpoint = found->second;
+
+      switch (endpoint.kind) {
+        case LISTENER:
+          acceptSubscribers();
+          break;
+        case UPSTREAM:
+          serviceUpstream(*endpoint.robot, events[i].events);
+          break;
+        case SUBSCRIBER:
+          serviceSubscriber(endpoint.subscriber);
+          break;
+      }
+    }
+
+    for (auto& robot : robots) upstreamTimers(*robot);
+    subscriberHousekeeping();
+
+    if (elapsedMs(lastStats) > STATS_INTERVAL) {
+      lastStats = Clock::now();
+      printStats();
+    }
+  }
+
+  printStats();
+  return 0;
+}
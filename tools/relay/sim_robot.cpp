@@ -0,0 +1,289 @@
+/*
+  EMU Simulated Robot
+
+  Stands in for one or more ESP32 robots on a development machine so the relay (and
+  dashboards) can be exercised without hardware. Each simulated robot speaks the same
+  WebSocket protocol as ESP32Controller.cpp: a status_update on connect, sensor_data
+  broadcast every 500ms, command_ack/error replies for JSON and binary commands, a
+  scan_map right away for "scan", time_sync replies (microseconds since the simulator
+  started), and at most WEBSOCKETS_SERVER_CLIENT_MAX clients. Like the firmware's loop(), it handles at
+  most one message per client per 50ms tick, so a command flood backs up into TCP the
+  way it does over Wi-Fi.
+
+  Build:  g++ -std=c++17 -O2 -Wall -o emu-sim sim_robot.cpp
+  Run:    ./emu-sim --port 8181 --count 3     (robots on 8181, 8182, 8183)
+*/
+
+#include "websocket.h"
+
+#include <signal.h>
+#include <sys/epoll.h>
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <memory>
+#include <random>
+#include <vector>
+
+using Clock = std::chrono::steady_clock;
+
+#define WEBSOCKETS_SERVER_CLIENT_MAX 5
+#define LOOP_TICK 50
+#define SENSOR_BROADCAST_INTERVAL 500
+
+#define BIN_MOVE 0x01
+#define BIN_SET_SPEED 0x02
+#define BIN_BUZZER 0x03
+#define BIN_EXPRESSION 0x04
+#define BIN_MISSION_START 0x05
+#define BIN_MISSION_ABORT 0x06
+#define BIN_TELEOP 0x07
+#define BIN_HEADER_SIZE 3
+#define SCAN_SECTORS 36
+
+struct SimRobot {
+  uint16_t port;
+  int listenFd;
+  std::vector<std::unique_ptr<ws::Connection>> clients;
+  std::string direction = "stop";
+  int speed = 200;
+  float distance = 120.0f;
+  float battery = 100.0f;
+  uint64_t commandsHandled = 0;
+  uint64_t framesSent = 0;
+};
+
+static volatile sig_atomic_t running = 1;
+static Clock::time_point started = Clock::now();
+static std::mt19937 rng(42);
+
+unsigned long millisSinceStart() {
+  return std::chrono::duration_cast<std::chrono::milliseconds>(Clock::now() - started).count();
+}
+
+int64_t microsSinceStart() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - started).count();
+}
+
+void broadcastText(SimRobot& robot, const std::string& text) {
+  for (auto& client : robot.clients) {
+    if (!client->isOpen()) continue;
+    client->sendText(text);
+    client->onWritable();
+    robot.framesSent++;
+  }
+}
+
+void sendAck(SimRobot& robot, const std::string& commandId, const std::string& message) {
+  if (commandId.empty()) return;
+  broadcastText(robot, "{\"type\":\"command_ack\",\"data\":{\"commandId\":\"" + commandId + "\",\"message\":\"" +
+                       message + "\"},\"timestamp\":" + std::to_string(millisSinceStart()) + "}");
+}
+
+void sendError(SimRobot& robot, const std::string& commandId, const std::string& message) {
+  broadcastText(robot, "{\"type\":\"error\",\"data\":{\"commandId\":\"" + commandId + "\",\"message\":\"" +
+                       message + "\"},\"timestamp\":" + std::to_string(millisSinceStart()) + "}");
+}
+
+std::string statusUpdate(const SimRobot& robot) {
+  return "{\"type\":\"status_update\",\"data\":{\"connected\":true,\"direction\":\"" + robot.direction +
+         "\",\"speed\":" + std::to_string(robot.speed) + ",\"battery\":" + std::to_string((int)robot.battery) +
+         ",\"simulated\":true,\"port\":" + std::to_string(robot.port) + "}}";
+}
+
+// Like the firmware: to the sender only, t1 when the message was picked up, t2 as it goes out
+void sendTimeSync(ws::Connection& client, const std::string& id, int64_t receivedAt) {
+  client.sendText("{\"type\":\"time_sync\",\"data\":{\"id\":\"" + id + "\",\"t1\":" + std::to_string(receivedAt) +
+                  ",\"t2\":" + std::to_string(microsSinceStart()) + ",\"rttUs\":0}}");
+  client.onWritable();
+}
+
+// The whole turn at once: a rectangular room around the robot, with the current reading ahead
+std::string scanMap(const SimRobot& robot) {
+  std::string minimum, median, samples;
+  for (int sector = 0; sector < SCAN_SECTORS; sector++) {
+    double angle = (sector + 0.5) * 2 * M_PI / SCAN_SECTORS;
+    double wall = std::fmin(150.0 / std::fabs(std::cos(angle)), 100.0 / std::fabs(std::sin(angle)));
+    int range = sector == 0 ? (int)robot.distance : (int)std::fmin(wall, 400.0);
+    const char* comma = sector ? "," : "";
+    minimum += comma + std::to_string(range);
+    median += comma + std::to_string(range + (int)(rng() % 5));
+    samples += comma + std::to_string(1 + (int)(rng() % 2));
+  }
+  return "{\"type\":\"scan_map\",\"data\":{\"complete\":true,\"sectorDegrees\":" + std::to_string(360 / SCAN_SECTORS) +
+         ",\"turnRate\":90,\"durationMs\":4000,\"min\":[" + minimum + "],\"median\":[" + median + "],\"samples\":[" +
+         samples + "]},\"timestamp\":" + std::to_string(millisSinceStart()) + "}";
+}
+
+void handleMessage(SimRobot& robot, ws::Connection& client, const ws::Frame& message) {
+  int64_t receivedAt = microsSinceStart();
+  static const char* const directions[] = { "stop", "forward", "backward", "left", "right" };
+  robot.commandsHandled++;
+
+  if (message.opcode == ws::OP_BINARY) {
+    const std::string& p = message.payload;
+    if (p.size() < BIN_HEADER_SIZE) {
+      sendError(robot, "", "Malformed binary command");
+      return;
+    }
+    uint16_t seq = (uint8_t)p[1] | ((uint8_t)p[2] << 8);
+    std::string id = seq ? std::to_string(seq) : "";
+    switch ((uint8_t)p[0]) {
+      case BIN_MOVE:
+        if (p.size() < BIN_HEADER_SIZE + 3 || (uint8_t)p[3] > 4) break;
+        robot.direction = directions[(uint8_t)p[3]];
+        sendAck(robot, id, "Movement command executed");
+        return;
+      case BIN_SET_SPEED:
+        if (p.size() < BIN_HEADER_SIZE + 1) break;
+        robot.speed = (uint8_t)p[3];
+        sendAck(robot, id, "Speed set to " + std::to_string(robot.speed));
+        return;
+      case BIN_TELEOP: {
+        // Setpoints are never acked; the simulator only reports the motion they imply
+        if (p.size() < BIN_HEADER_SIZE + 8) break;
+        int16_t left = (int16_t)((uint8_t)p[3] | ((uint8_t)p[4] << 8));
+        int16_t right = (int16_t)((uint8_t)p[5] | ((uint8_t)p[6] << 8));
+        robot.direction = left + right > 0 ? "forward" : left + right < 0 ? "backward"
+                        : left < right ? "left" : left > right ? "right" : "stop";
+        return;
+      }
+      case BIN_BUZZER:
+      case BIN_EXPRESSION:
+      case BIN_MISSION_START:
+      case BIN_MISSION_ABORT:
+        sendAck(robot, id, "OK");
+        return;
+    }
+    sendError(robot, "", "Malformed binary command");
+    return;
+  }
+
+  std::string type = ws::jsonField(message.payload, "type");
+  if (type == "time_sync") {
+    sendTimeSync(client, ws::jsonField(message.payload, "id"), receivedAt);
+    return;
+  }
+  if (type != "command") return;
+  std::string id = ws::jsonField(message.payload, "id");
+  std::string action = ws::jsonField(message.payload, "action");
+  if (action == "move") {
+    std::string direction = ws::jsonField(message.payload, "direction");
+    robot.direction = direction.empty() ? "stop" : direction;
+    sendAck(robot, id, "Movement command executed");
+  } else if (action == "teleop") {
+    return;
+  } else if (action == "scan") {
+    sendAck(robot, id, "Scan started");
+    broadcastText(robot, scanMap(robot));
+  } else if (action == "speed") {
+    robot.speed = atoi(ws::jsonField(message.payload, "speed").c_str());
+    sendAck(robot, id, "Speed set to " + std::to_string(robot.speed));
+  } else {
+    sendAck(robot, id, action + " OK");
+  }
+}
+
+void sendSensorData(SimRobot& robot) {
+  std::normal_distribution<float> noise(0.0f, 2.0f);
+  float drift = robot.direction == "forward" ? -3.0f : robot.direction == "backward" ? 3.0f : 0.0f;
+  robot.distance = std::fmax(2.0f, std::fmin(400.0f, robot.distance + drift + noise(rng)));
+  robot.battery = std::fmax(0.0f, robot.battery - 0.01f);
+
+  char frame[192];
+  snprintf(frame, sizeof(frame),
+           "{\"type\":\"sensor_data\",\"data\":{\"ultrasonic\":%.1f,\"smoke\":false,\"smokeLevel\":%d,"
+           "\"battery\":%.0f,\"timestamp\":%lu}}",
+           robot.distance, 300 + (int)(rng() % 40), robot.battery, millisSinceStart());
+  broadcastText(robot, frame);
+}
+
+void acceptClients(SimRobot& robot) {
+  for (;;) {
+    int fd = accept(robot.listenFd, nullptr, nullptr);
+    if (fd < 0) break;
+    if (robot.clients.size() >= WEBSOCKETS_SERVER_CLIENT_MAX) {
+      close(fd);
+      continue;
+    }
+    ws::setNonBlocking(fd);
+    robot.clients.push_back(std::make_unique<ws::Connection>(fd, ws::Connection::SERVER));
+  }
+}
+
+void loopTick(SimRobot& robot) {
+  acceptClients(robot);
+
+  for (size_t i = 0; i < robot.clients.size();) {
+    ws::Connection& client = *robot.clients[i];
+    bool wasOpen = client.isOpen();
+    bool alive = client.onReadable();
+    if (alive && !wasOpen && client.isOpen()) {
+      client.sendText(statusUpdate(robot));
+      printf("[sim %u] client connected (%zu)\n", robot.port, robot.clients.size());
+    }
+
+    ws::Frame message;
+    if (alive && client.nextMessage(message)) handleMessage(robot, client, message);
+    alive = alive && client.onWritable() && client.state() != ws::Connection::CLOSED;
+
+    if (!alive) {
+      printf("[sim %u] client disconnected\n", robot.port);
+      robot.clients.erase(robot.clients.begin() + i);
+    } else {
+      i++;
+    }
+  }
+}
+
+void onSignal(int) { running = 0; }
+
+int main(int argc, char** argv) {
+  uint16_t port = 8181;
+  int count = 1;
+  for (int i = 1; i + 1 < argc; i += 2) {
+    if (strcmp(argv[i], "--port") == 0) port = (uint16_t)atoi(argv[i + 1]);
+    else if (strcmp(argv[i], "--count") == 0) count = atoi(argv[i + 1]);
+  }
+
+  setvbuf(stdout, nullptr, _IOLBF, 0);
+  signal(SIGPIPE, SIG_IGN);
+  signal(SIGINT, onSignal);
+  signal(SIGTERM, onSignal);
+
+  std::vector<SimRobot> robots(count);
+  for (int i = 0; i < count; i++) {
+    robots[i].port = port + i;
+    robots[i].listenFd = ws::listenOn(robots[i].port);
+    if (robots[i].listenFd < 0) {
+      perror("listen");
+      return 1;
+    }
+    printf("[sim %u] simulated robot ready\n", robots[i].port);
+  }
+  fflush(stdout);
+
+  unsigned long lastBroadcast = 0;
+  unsigned long lastReport = 0;
+  while (running) {
+    for (SimRobot& robot : robots) loopTick(robot);
+
+    unsigned long now = millisSinceStart();
+    if (now - lastBroadcast >= SENSOR_BROADCAST_INTERVAL) {
+      lastBroadcast = now;
+      for (SimRobot& robot : robots) sendSensorData(robot);
+    }
+    if (now - lastReport >= 10000) {
+      lastReport = now;
+      for (SimRobot& robot : robots) {
+        printf("[sim %u] %zu clients, %llu commands handled, %llu frames sent\n", robot.port,
+               robot.clients.size(), (unsigned long long)robot.commandsHandled, (unsigned long long)robot.framesSent);
+      }
+      fflush(stdout);
+    }
+
+    usleep(LOOP_TICK * 1000);
+  }
+  return 0;
+}
@@ -0,0 +1,462 @@
+/*
+  Minimal WebSocket (RFC 6455) support for the EMU host tools.
+
+  Just enough of the protocol to talk to the robot firmware's WebSocketsServer and to
+  browser/backend clients: the HTTP upgrade handshake, frame encode/decode (with
+  continuation reassembly) and a non-blocking socket connection with buffered I/O.
+  Header-only so each tool stays a single translation unit.
+*/
+
+#pragma once
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <cstdint>
+#include <cstring>
+#include <random>
+#include <string>
+
+namespace ws {
+
+enum Opcode : uint8_t {
+  OP_CONTINUATION = 0x0,
+  OP_TEXT = 0x1,
+  OP_BINARY = 0x2,
+  OP_CLOSE = 0x8,
+  OP_PING = 0x9,
+  OP_PONG = 0xA
+};
+
+const size_t MAX_MESSAGE = 1 << 20; // Reject anything bigger than 1 MiB
+
+// --- SHA-1 / Base64 (handshake only) ---
+
+inline uint32_t rotl(uint32_t value, int bits) { return (value << bits) | (value >> (32 - bits)); }
+
+inline std::string sha1(const std::string& input) {
+  uint32_t h[5] = { 0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0 };
+  std::string data = input;
+  uint64_t bitLength = (uint64_t)input.size() * 8;
+  data += (char)0x80;
+  while (data.size() % 64 != 56) data += (char)0x00;
+  for (int i = 7; i >= 0; i--) data += (char)((bitLength >> (i * 8)) & 0xFF);
+
+  for (size_t chunk = 0; chunk < data.size(); chunk += 64) {
+    uint32_t w[80];
+    for (int i = 0; i < 16; i++) {
+      const uint8_t* p = (const uint8_t*)&data[chunk + i * 4];
+      w[i] = (p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+    }
+    for (int i = 16; i < 80; i++) w[i] = rotl(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+
+    uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+    for (int i = 0; i < 80; i++) {
+      uint32_t f, k;
+      if (i < 20) { f = (b & c) | (~b & d); k = 0x5A827999; }
+      else if (i < 40) { f = b ^ c ^ d; k = 0x6ED9EBA1; }
+      else if (i < 60) { f = (b & c) | (b & d) | (c & d); k = 0x8F1BBCDC; }
+      else { f = b ^ c ^ d; k = 0xCA62C1D6; }
+      uint32_t temp = rotl(a, 5) + f + e + k + w[i];
+      e = d; d = c; c = rotl(b, 30); b = a; a = temp;
+    }
+    h[0] += a; h[1] += b; h[2] += c; h[3] += d; h[4] += e;
+  }
+
+  std::string digest;
+  for (uint32_t word : h) {
+    for (int i = 3; i >= 0; i--) digest += (char)((word >> (i * 8)) & 0xFF);
+  }
+  return digest;
+}
+
+inline std::string base64(const std::string& input) {
+  static const char* table = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  std::string out;
+  size_t i = 0;
+  for (; i + 2 < input.size(); i += 3) {
+    uint32_t n = ((uint8_t)input[i] << 16) | ((uint8_t)input[i + 1] << 8) | (uint8_t)input[i + 2];
+    out += table[(n >> 18) & 63]; out += table[(n >> 12) & 63]; out += table[(n >> 6) & 63]; out += table[n & 63];
+  }
+  if (i + 1 == input.size()) {
+    uint32_t n = (uint8_t)input[i] << 16;
+    out += table[(n >> 18) & 63]; out += table[(n >> 12) & 63]; out += "==";
+  } else if (i + 2 == input.size()) {
+    uint32_t n = ((uint8_t)input[i] << 16) | ((uint8_t)input[i + 1] << 8);
+    out += table[(n >> 18) & 63]; out += table[(n >> 12) & 63]; out += table[(n >> 6) & 63]; out += '=';
+  }
+  return out;
+}
+
+inline std::string acceptKey(const std::string& key) {
+  return base64(sha1(key + "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"));
+}
+
+inline std::string randomKey() {
+  static std::mt19937 rng(std::random_device{}());
+  std::string raw;
+  for (int i = 0; i < 16; i++) raw += (char)(rng() & 0xFF);
+  return base64(raw);
+}
+
+// Case-insensitive header lookup in a raw HTTP head; returns "" when missing
+inline std::string headerValue(const std::string& head, const std::string& name) {
+  size_t pos = 0;
+  while ((pos = head.find("\r\n", pos)) != std::string::npos) {
+    pos += 2;
+    size_t colon = head.find(':', pos);
+    size_t lineEnd = head.find("\r\n", pos);
+    if (colon == std::string::npos || lineEnd == std::string::npos || colon > lineEnd) continue;
+    if (strncasecmp(head.c_str() + pos, name.c_str(), name.size()) == 0 && colon - pos == name.size()) {
+      size_t start = head.find_first_not_of(' ', colon + 1);
+      return head.substr(start, lineEnd - start);
+    }
+  }
+  return "";
+}
+
+// --- Frames ---
+
+inline std::string encodeFrame(uint8_t opcode, const std::string& payload, bool mask) {
+  std::string frame;
+  frame += (char)(0x80 | opcode);
+  uint8_t maskBit = mask ? 0x80 : 0x00;
+  if (payload.size() < 126) {
+    frame += (char)(maskBit | payload.size());
+  } else if (payload.size() <= 0xFFFF) {
+    frame += (char)(maskBit | 126);
+    frame += (char)(payload.size() >> 8);
+    frame += (char)(payload.size() & 0xFF);
+  } else {
+    frame += (char)(maskBit | 127);
+    for (int i = 7; i >= 0; i--) frame += (char)(((uint64_t)payload.size() >> (i * 8)) & 0xFF);
+  }
+
+  if (!mask) return frame + payload;
+
+  static std::mt19937 rng(std::random_device{}());
+  uint8_t key[4];
+  for (uint8_t& k : key) k = rng() & 0xFF;
+  frame.append((const char*)key, 4);
+  size_t start = frame.size();
+  frame += payload;
+  for (size_t i = 0; i < payload.size(); i++) frame[start + i] ^= key[i % 4];
+  return frame;
+}
+
+struct Frame {
+  bool fin;
+  uint8_t opcode;
+  std::string payload;
+};
+
+// Returns bytes consumed, 0 if the buffer holds no complete frame yet, -1 on a protocol error
+inline long decodeFrame(const std::string& buffer, Frame& frame) {
+  if (buffer.size() < 2) return 0;
+  const uint8_t* p = (const uint8_t*)buffer.data();
+  frame.fin = p[0] & 0x80;
+  frame.opcode = p[0] & 0x0F;
+  bool masked = p[1] & 0x80;
+  uint64_t length = p[1] & 0x7F;
+  size_t offset = 2;
+
+  if (length == 126) {
+    if (buffer.size() < 4) return 0;
+    length = (p[2] << 8) | p[3];
+    offset = 4;
+  } else if (length == 127) {
+    if (buffer.size() < 10) return 0;
+    length = 0;
+    for (int i = 0; i < 8; i++) length = (length << 8) | p[2 + i];
+    offset = 10;
+  }
+  if (length > MAX_MESSAGE) return -1;
+
+  uint8_t key[4] = { 0, 0, 0, 0 };
+  if (masked) {
+    if (buffer.size() < offset + 4) return 0;
+    memcpy(key, p + offset, 4);
+    offset += 4;
+  }
+  if (buffer.size() < offset + length) return 0;
+
+  frame.payload.assign(buffer, offset, length);
+  if (masked) {
+    for (size_t i = 0; i < length; i++) frame.payload[i] ^= key[i % 4];
+  }
+  return offset + length;
+}
+
+// --- Sockets ---
+
+inline bool setNonBlocking(int fd) {
+  int flags = fcntl(fd, F_GETFL, 0);
+  return flags >= 0 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) == 0;
+}
+
+inline int listenOn(uint16_t port) {
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd < 0) return -1;
+  int yes = 1;
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+
+  sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_ANY);
+  addr.sin_port = htons(port);
+  if (bind(fd, (sockaddr*)&addr, sizeof(addr)) < 0 || listen(fd, 64) < 0 || !setNonBlocking(fd)) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+// Starts a non-blocking connect; completion is signalled by the socket becoming writable
+inline int connectTo(const std::string& host, uint16_t port) {
+  addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+  addrinfo* result = nullptr;
+  if (getaddrinfo(host.c_str(), std::to_string(port).c_str(), &hints, &result) != 0) return -1;
+
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd >= 0) {
+    int yes = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+    if (!setNonBlocking(fd) ||
+        (connect(fd, result->ai_addr, result->ai_addrlen) < 0 && errno != EINPROGRESS)) {
+      close(fd);
+      fd = -1;
+    }
+  }
+  freeaddrinfo(result);
+  return fd;
+}
+
+// One WebSocket endpoint over a non-blocking socket. The owner drives it from an event
+// loop: call onReadable()/onWritable() when the fd is ready, then drain messages with
+// nextMessage(). Outgoing data is buffered; pendingBytes() is the back-pressure signal.
+class Connection {
+ public:
+  enum Role { SERVER, CLIENT };
+  enum State { CONNECTING, HANDSHAKE, OPEN, CLOSED };
+
+  Connection(int fd, Role role) : fd_(fd), role_(role), state_(role == SERVER ? HANDSHAKE : CONNECTING) {}
+  ~Connection() { if (fd_ >= 0) close(fd_); }
+
+  int fd() const { return fd_; }
+  State state() const { return state_; }
+  bool isOpen() const { return state_ == OPEN; }
+  const std::string& path() const { return path_; }
+  size_t pendingBytes() const { return out_.size() - outOffset_; }
+  bool wantsWrite() const { return pendingBytes() > 0 || state_ == CONNECTING; }
+
+  // Client side: called once the connect() completed
+  void startClientHandshake(const std::string& host, uint16_t port, const std::string& path = "/") {
+    int error = 0;
+    socklen_t length = sizeof(error);
+    if (getsockopt(fd_, SOL_SOCKET, SO_ERROR, &error, &length) < 0 || error != 0) {
+      state_ = CLOSED;
+      return;
+    }
+    key_ = randomKey();
+    out_ += "GET " + path + " HTTP/1.1\r\nHost: " + host + ":" + std::to_string(port) +
+            "\r\nUpgrade: websocket\r\nConnection: Upgrade\r\nSec-WebSocket-Key: " + key_ +
+            "\r\nSec-WebSocket-Version: 13\r\n\r\n";
+    state_ = HANDSHAKE;
+  }
+
+  void sendText(const std::string& text) { send(OP_TEXT, text); }
+  void sendBinary(const std::string& data) { send(OP_BINARY, data); }
+  void sendPing(const std::string& data = "") { send(OP_PING, data); }
+
+  void send(uint8_t opcode, const std::string& payload) {
+    if (state_ != OPEN) return;
+    out_ += encodeFrame(opcode, payload, role_ == CLIENT);
+  }
+
+  // Queues an already-encoded frame; lets a server encode once and fan out to many clients
+  void sendEncoded(const std::string& frame) {
+    if (state_ != OPEN || role_ != SERVER) return;
+    out_ += frame;
+  }
+
+  void closeWithStatus(uint16_t code) {
+    if (state_ == OPEN) {
+      std::string payload;
+      payload += (char)(code >> 8);
+      payload += (char)(code & 0xFF);
+      out_ += encodeFrame(OP_CLOSE, payload, role_ == CLIENT);
+      onWritable();
+    }
+    state_ = CLOSED;
+  }
+
+  // Returns false once the connection is dead
+  bool onReadable() {
+    char buffer[16384];
+    for (;;) {
+      ssize_t n = recv(fd_, buffer, sizeof(buffer), 0);
+      if (n > 0) {
+        in_.append(buffer, n);
+        if (in_.size() > MAX_MESSAGE * 2) state_ = CLOSED;
+        continue;
+      }
+      if (n == 0) state_ = CLOSED;
+      else if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) state_ = CLOSED;
+      break;
+    }
+    if (state_ == HANDSHAKE) processHandshake();
+    return state_ != CLOSED;
+  }
+
+  bool onWritable() {
+    while (pendingBytes() > 0) {
+      ssize_t n = ::send(fd_, out_.data() + outOffset_, pendingBytes(), MSG_NOSIGNAL);
+      if (n > 0) {
+        outOffset_ += n;
+        continue;
+      }
+      if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) break;
+      state_ = CLOSED;
+      return false;
+    }
+    if (outOffset_ == out_.size()) {
+      out_.clear();
+      outOffset_ = 0;
+    } else if (outOffset_ > 65536) {
+      out_.erase(0, outOffset_);
+      outOffset_ = 0;
+    }
+    return state_ != CLOSED;
+  }
+
+  // Pops the next complete data message (text or binary); control frames are handled here
+  bool nextMessage(Frame& message) {
+    while (state_ == OPEN) {
+      Frame frame;
+      long used = decodeFrame(in_, frame);
+      if (used == 0) return false;
+      if (used < 0) {
+        closeWithStatus(1002);
+        return false;
+      }
+      in_.erase(0, used);
+
+      switch (frame.opcode) {
+        case OP_PING:
+          send(OP_PONG, frame.payload);
+          break;
+        case OP_PONG:
+          lastPong_ = frame.payload;
+          pongReceived_ = true;
+          break;
+        case OP_CLOSE:
+          closeWithStatus(1000);
+          return false;
+        case OP_CONTINUATION:
+          fragments_ += frame.payload;
+          if (frame.fin) {
+            message.fin = true;
+            message.opcode = fragmentOpcode_;
+            message.payload.swap(fragments_);
+            fragments_.clear();
+            return true;
+          }
+          break;
+        default:
+          if (!frame.fin) {
+            fragmentOpcode_ = frame.opcode;
+            fragments_ = frame.payload;
+            break;
+          }
+          message = std::move(frame);
+          return true;
+      }
+    }
+    return false;
+  }
+
+  // Set when a pong arrives; the owner clears it via takePong()
+  bool takePong(std::string& payload) {
+    if (!pongReceived_) return false;
+    pongReceived_ = false;
+    payload = lastPong_;
+    return true;
+  }
+
+ private:
+  void processHandshake() {
+    size_t end = in_.find("\r\n\r\n");
+    if (end == std::string::npos) return;
+    std::string head = in_.substr(0, end + 2);
+    in_.erase(0, end + 4);
+
+    if (role_ == SERVER) {
+      size_t space = head.find(' ');
+      size_t pathEnd = head.find(' ', space + 1);
+      std::string key = headerValue(head, "Sec-WebSocket-Key");
+      if (head.compare(0, 4, "GET ") != 0 || key.empty() || space == std::string::npos || pathEnd == std::string::npos) {
+        out_ += "HTTP/1.1 400 Bad Request\r\nConnection: close\r\n\r\n";
+        onWritable();
+        state_ = CLOSED;
+        return;
+      }
+      path_ = head.substr(space + 1, pathEnd - space - 1);
+      out_ += "HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n"
+              "Sec-WebSocket-Accept: " + acceptKey(key) + "\r\n\r\n";
+    } else {
+      if (head.compare(0, 12, "HTTP/1.1 101") != 0 || headerValue(head, "Sec-WebSocket-Accept") != acceptKey(key_)) {
+        state_ = CLOSED;
+        return;
+      }
+    }
+    state_ = OPEN;
+  }
+
+  int fd_;
+  Role role_;
+  State state_;
+  std::string key_;
+  std::string path_;
+  std::string in_;
+  std::string out_;
+  size_t outOffset_ = 0;
+  uint8_t fragmentOpcode_ = OP_TEXT;
+  std::string fragments_;
+  std::string lastPong_;
+  bool pongReceived_ = false;
+};
+
+// Pulls the string (or bare number/bool) value of a top-level or nested key out of a
+// compact JSON text without a full parser. Good enough for the firmware's own frames.
+inline std::string jsonField(const std::string& json, const std::string& key) {
+  std::string needle = "\"" + key + "\"";
+  size_t pos = json.find(needle);
+  if (pos == std::string::npos) return "";
+  pos = json.find_first_not_of(" \t\r\n", pos + needle.size());
+  if (pos == std::string::npos || json[pos] != ':') return "";
+  pos = json.find_first_not_of(" \t\r\n", pos + 1);
+  if (pos == std::string::npos) return "";
+
+  if (json[pos] == '"') {
+    std::string value;
+    for (size_t i = pos + 1; i < json.size() && json[i] != '"'; i++) {
+      if (json[i] == '\\' && i + 1 < json.size()) i++;
+      value += json[i];
+    }
+    return value;
+  }
+  size_t end = json.find_first_of(",}] \t\r\n", pos);
+  return json.substr(pos, end == std::string::npos ? std::string::npos : end - pos);
+}
+
+} // namespace ws
@@ -0,0 +1,15 @@
+#!/bin/sh
+# Fetch the ArduinoJson release the replay tools are built against into ./ArduinoJson.
+# ESP32Controller.cpp is written for the 6.x API (StaticJsonDocument, containsKey);
+# 7.x doesn't build it, and other 6.x releases aren't what the scenarios were run with.
+#
+# Usage: sh fetch_arduinojson.sh
+set -e
+
+VERSION=v6.21.5
+DIR="$(dirname "$0")/ArduinoJson"
+
+if [ ! -d "$DIR" ]; then
+  git clone --quiet --depth 1 --branch "$VERSION" https://github.com/bblanchon/ArduinoJson.git "$DIR"
+fi
+git -C "$DIR" describe --tags
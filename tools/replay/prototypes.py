@@ -0,0 +1,55 @@
+#!/usr/bin/env python3
+"""Turn an Arduino sketch source into plain C++, the way the Arduino builder does.
+
+The firmware calls functions before defining them and relies on the builder's generated
+prototypes. This script inserts one prototype per top-level function definition ahead
+of the first definition, carrying any default arguments over to the prototype (C++
+allows them in one place only), and writes the result to stdout.
+
+Usage: python3 prototypes.py ESP32Controller.cpp > controller_native.cpp
+"""
+
+import re
+import sys
+
+DEFINITION = re.compile(r'^([A-Za-z_][\w:<>*& ]*?[\s*&]+)([A-Za-z_]\w*)\s*\(([^;{}]*)\)\s*(const)?\s*\{\s*$')
+KEYWORDS = ('if', 'else', 'for', 'while', 'switch', 'return', 'struct', 'class', 'enum', 'union', 'namespace')
+DEFAULT_ARG = re.compile(r'\s*=\s*[^,]+')
+
+
+def code_only(line):
+    line = re.sub(r'"(\\.|[^"\\])*"', '""', line)
+    line = re.sub(r"'(\\.|[^'\\])*'", "''", line)
+    return line.split('//')[0]
+
+
+def main(path):
+    with open(path) as source:
+        lines = source.read().split('\n')
+
+    prototypes = []
+    out = []
+    first_definition = None
+    depth = 0
+    for line in lines:
+        match = DEFINITION.match(line) if depth == 0 else None
+        if match and match.group(1).split()[0] not in KEYWORDS:
+            if first_definition is None:
+                first_definition = len(out)
+            returns, name, args = match.group(1), match.group(2), match.group(3)
+            prototypes.append('%s%s(%s);' % (returns, name, args))
+            line = '%s%s(%s) {' % (returns, name, DEFAULT_ARG.sub('', args))
+        code = code_only(line)
+        depth += code.count('{') - code.count('}')
+        out.append(line)
+
+    if first_definition is None:
+        first_definition = 0
+    out[first_definition:first_definition] = prototypes + ['']
+    sys.stdout.write('\n'.join(out))
+
+
+if __name__ == '__main__':
+    if len(sys.argv) != 2:
+        sys.exit(__doc__)
+    main(sys.argv[1])
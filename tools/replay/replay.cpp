@@ -0,0 +1,449 @@
+/*
+  EMU Capture Replay
+
+  Runs a capture taken on the robot (GET /capture.bin, see "Capture" in
+  ESP32Controller.cpp) back through the unmodified controller source, compiled for the
+  host against the stand-ins in shims/. Each recorded loop pass becomes one loop() call
+  at the recorded time. The echo times, ADC readings, Wi-Fi link changes and WebSocket
+  traffic that pass consumed are fed back in the order the firmware asked for them, and
+  the ADC calibration read from the robot's eFuse is handed back to the firmware.
+
+  The replayed firmware keeps its own capture, which is compared byte for byte with the
+  recorded one. Matching logs mean the same inputs were consumed, in the same order, on
+  the same passes, with the same motor and buzzer outputs. The first difference is
+  reported. Frames sent to WebSocket clients go to an optional trace file. An FNV-1a
+  hash of that trace makes a quick regression check (--expect).
+
+  Only the loop task is replayed. REST handlers, event streams, the OLED flush task and
+  the flight log writer don't run, and their effects aren't in the capture.
+
+  Build:  sh fetch_arduinojson.sh   # ArduinoJson v6.21.5 into ./ArduinoJson
+          python3 prototypes.py ../../src/components/ESP32Controller.cpp > controller_native.cpp
+          g++ -std=gnu++17 -O2 -Wall -I shims -I ArduinoJson/src -o emu-replay replay.cpp
+  Run:    ./emu-replay capture.bin [--trace frames.txt] [--expect <hash>]
+
+  scenarios.cpp reuses these stand-ins (built with REPLAY_NO_MAIN) to script traffic
+  and check the controller's state instead of comparing a capture.
+*/
+
+#include "controller_native.cpp"
+
+#if ARDUINOJSON_VERSION_MAJOR != 6
+#error "Build against ArduinoJson 6 (fetch_arduinojson.sh)"
+#endif
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <vector>
+
+HardwareSerial Serial;
+EspClass ESP;
+TwoWire Wire;
+WiFiClass WiFi;
+
+namespace replay {
+
+struct Record {
+  uint8_t type;
+  size_t offset;                // In the capture file, for divergence reports
+  std::vector<uint8_t> fields;  // Everything after the type byte
+};
+
+struct Pass {
+  uint32_t at;                  // ms since boot
+  size_t offset;
+  std::vector<Record> inputs;   // What the firmware read, in the order it read it
+};
+
+struct Divergence {
+  unsigned count = 0;
+  char first[160] = {};
+};
+
+uint64_t nowUs = 0;
+const Pass* current = nullptr;
+size_t nextInput = 0;
+Divergence divergence;
+bool linkUp = false;
+std::vector<uint16_t> adcCalibration; // mV at raw = i << ADC_TABLE_SHIFT
+uint32_t randomState = 1;
+WiFiClient clients[WEBSOCKETS_SERVER_CLIENT_MAX];
+int devNull = -1;
+
+FILE* trace = nullptr;
+uint64_t traceHash = 1469598103934665603ULL;
+
+void diverge(const char* format, ...) {
+  if (divergence.count++ > 0) return;
+  int written = snprintf(divergence.first, sizeof(divergence.first), "pass at %lums: ", (unsigned long)(nowUs / 1000));
+  va_list args;
+  va_start(args, format);
+  vsnprintf(divergence.first + written, sizeof(divergence.first) - written, format, args);
+  va_end(args);
+}
+
+bool isInput(uint8_t type) {
+  return type == CAP_ECHO || type == CAP_ADC || type == CAP_WIFI || type == CAP_WS_CONNECT ||
+         type == CAP_WS_DISCONNECT || type == CAP_WS_TEXT || type == CAP_WS_BIN || type == CAP_WS_BLOCKED ||
+         type == CAP_WS_DROPPED || type == CAP_WS_PONG;
+}
+
+size_t fieldsSize(uint8_t type, const uint8_t* fields, size_t available) {
+  switch (type) {
+    case CAP_TICK: return 2;
+    case CAP_TICK_FAR: return 4;
+    case CAP_ECHO: return 2;
+    case CAP_ADC: return 3;
+    case CAP_MOTOR: return 3;
+    case CAP_DRIVE: return 4;
+    case CAP_WS_TEXT:
+    case CAP_WS_BIN:
+    case CAP_WS_PONG:
+      return available < 3 ? 3 : 3 + (fields[1] | (fields[2] << 8));
+    case CAP_ADC_CAL:
+      return available < 1 ? 1 : 1 + 2 * fields[0];
+    case CAP_WS_CONNECT:
+    case CAP_WS_DISCONNECT:
+    case CAP_WS_BLOCKED:
+    case CAP_WS_DROPPED:
+    case CAP_BUZZER:
+    case CAP_WIFI:
+      return 1;
+  }
+  return SIZE_MAX;
+}
+
+// Splits the log into passes. A torn final record (download taken mid-write) ends the log.
+bool parse(const std::vector<uint8_t>& log, std::vector<Pass>& passes) {
+  uint32_t magic;
+  if (log.size() < 8 || (memcpy(&magic, log.data(), 4), magic != CAPTURE_MAGIC)) {
+    fprintf(stderr, "not a capture log\n");
+    return false;
+  }
+  if (log[4] != CAPTURE_VERSION) {
+    fprintf(stderr, "capture version %u, this build reads %u\n", log[4], CAPTURE_VERSION);
+    return false;
+  }
+
+  uint32_t at = 0;
+  size_t offset = 8;
+  while (offset < log.size()) {
+    uint8_t type = log[offset];
+    if (type & CAPTURE_SHORT_TICK) {
+      at += type & ~CAPTURE_SHORT_TICK;
+      passes.push_back({ at, offset, {} });
+      offset++;
+      continue;
+    }
+
+    const uint8_t* fields = &log[offset + 1];
+    size_t available = log.size() - offset - 1;
+    size_t size = fieldsSize(type, fields, available);
+    if (size == SIZE_MAX) {
+      fprintf(stderr, "unknown record type %u at offset %zu\n", type, offset);
+      return false;
+    }
+    if (size > available) {
+      fprintf(stderr, "log ends inside a record at offset %zu, ignoring it\n", offset);
+      break;
+    }
+
+    if (type == CAP_ADC_CAL) {
+      adcCalibration.resize(fields[0]);
+      memcpy(adcCalibration.data(), fields + 1, 2 * fields[0]);
+    } else if (type == CAP_TICK || type == CAP_TICK_FAR) {
+      uint32_t value = 0;
+      memcpy(&value, fields, size);
+      at = type == CAP_TICK ? at + value : value;
+      passes.push_back({ at, offset, {} });
+    } else if (passes.empty()) {
+      fprintf(stderr, "record before the first pass at offset %zu\n", offset);
+      return false;
+    } else if (isInput(type)) {
+      passes.back().inputs.push_back({ type, offset, std::vector<uint8_t>(fields, fields + size) });
+    }
+    offset += 1 + size;
+  }
+  return true;
+}
+
+// The pass's next input if it is of this type (and client, for WebSocket records)
+const Record* take(uint8_t type, int num = -1) {
+  if (current == nullptr || nextInput >= current->inputs.size()) return nullptr;
+  const Record& record = current->inputs[nextInput];
+  if (record.type != type || (num >= 0 && record.fields[0] != num)) return nullptr;
+  nextInput++;
+  return &record;
+}
+
+uint8_t nextInputType() {
+  if (current == nullptr || nextInput >= current->inputs.size()) return 0;
+  return current->inputs[nextInput].type;
+}
+
+void traceLine(const char* format, ...) {
+  char line[WS_MESSAGE_CAPACITY + 64];
+  va_list args;
+  va_start(args, format);
+  int length = vsnprintf(line, sizeof(line), format, args);
+  va_end(args);
+  length = min(length, (int)sizeof(line) - 1);
+  for (int i = 0; i < length; i++) {
+    traceHash ^= (uint8_t)line[i];
+    traceHash *= 1099511628211ULL;
+  }
+  if (trace != nullptr) fwrite(line, 1, length, trace);
+}
+
+}  // namespace replay
+
+// Arduino core
+
+unsigned long millis() { return replay::nowUs / 1000; }
+unsigned long micros() { return replay::nowUs; }
+int64_t esp_timer_get_time() { return replay::nowUs; }
+void delay(unsigned long ms) { replay::nowUs += ms * 1000; }
+void delayMicroseconds(unsigned int us) { replay::nowUs += us; }
+
+unsigned long pulseIn(uint8_t, uint8_t, unsigned long timeout) {
+  const replay::Record* record = replay::take(CAP_ECHO);
+  if (record == nullptr) {
+    replay::diverge("pulseIn() with no echo recorded here");
+    return 0;
+  }
+  unsigned long echo = record->fields[0] | (record->fields[1] << 8);
+  replay::nowUs += echo != 0 ? echo : timeout; // pulseIn() blocks for the pulse or the timeout
+  return echo;
+}
+
+uint16_t analogRead(uint8_t pin) {
+  const replay::Record* record = replay::take(CAP_ADC);
+  if (record == nullptr || record->fields[0] != pin) {
+    replay::diverge("analogRead(%u) with no reading recorded here", pin);
+    return 0;
+  }
+  return record->fields[1] | (record->fields[2] << 8);
+}
+
+// Park-Miller; the device uses its hardware RNG, which only times the idle blink
+long random(long howBig) {
+  replay::randomState = (uint64_t)replay::randomState * 48271 % 2147483647;
+  return howBig > 0 ? replay::randomState % howBig : 0;
+}
+
+long random(long howSmall, long howBig) {
+  return howBig > howSmall ? howSmall + random(howBig - howSmall) : howSmall;
+}
+
+// The firmware only asks for the points of its ADC table, which the capture holds
+esp_adc_cal_value_t esp_adc_cal_characterize(adc_unit_t, adc_atten_t, adc_bits_width_t, uint32_t defaultVref,
+                                             esp_adc_cal_characteristics_t* characteristics) {
+  characteristics->vref = defaultVref;
+  return ESP_ADC_CAL_VAL_EFUSE_TP;
+}
+
+uint32_t esp_adc_cal_raw_to_voltage(uint32_t raw, const esp_adc_cal_characteristics_t*) {
+  size_t point = (raw + (1 << ADC_TABLE_SHIFT) - 1) >> ADC_TABLE_SHIFT;
+  if (point < replay::adcCalibration.size()) return replay::adcCalibration[point];
+  return 142 + raw * 2308 / 4095; // Typical 11dB response
+}
+
+// FreeRTOS
+
+TaskHandle_t xTaskGetCurrentTaskHandle() {
+  static int loopTask;
+  return &loopTask;
+}
+
+BaseType_t xTaskCreatePinnedToCore(void (*)(void*), const char*, uint32_t, void*, UBaseType_t,
+                                   TaskHandle_t* handle, BaseType_t) {
+  static int parkedTasks[8];
+  static size_t created = 0;
+  if (handle != nullptr) *handle = &parkedTasks[created++ % 8];
+  return pdPASS;
+}
+
+SemaphoreHandle_t xSemaphoreCreateMutex() {
+  static int mutexes[8];
+  static size_t created = 0;
+  return &mutexes[created++ % 8];
+}
+
+// Wi-Fi and sockets
+
+wl_status_t WiFiClass::status() {
+  if (const replay::Record* record = replay::take(CAP_WIFI)) replay::linkUp = record->fields[0];
+  return replay::linkUp ? WL_CONNECTED : WL_DISCONNECTED;
+}
+
+// canWrite() selects on this; a recorded stall hands out no socket for that one check
+int WiFiClient::fd() const {
+  if (replay::take(CAP_WS_BLOCKED, this - replay::clients) != nullptr) return -1;
+  return replay::devNull;
+}
+
+// Delivers the client events at the head of the pass, the way the library's loop() does.
+// A handler may read sensors in between, so the head is re-checked after each event.
+void WebSocketsServer::loop() {
+  for (;;) {
+    uint8_t type = replay::nextInputType();
+    if (type != CAP_WS_CONNECT && type != CAP_WS_DISCONNECT && type != CAP_WS_TEXT && type != CAP_WS_BIN &&
+        type != CAP_WS_PONG) {
+      return;
+    }
+    const replay::Record* record = replay::take(type);
+    uint8_t num = record->fields[0];
+    if (num >= WEBSOCKETS_SERVER_CLIENT_MAX) {
+      replay::diverge("event for client %u", num);
+      continue;
+    }
+
+    if (type == CAP_WS_CONNECT) {
+      replayConnect(num);
+    } else if (type == CAP_WS_DISCONNECT) {
+      replayDisconnect(num);
+    } else {
+      const uint8_t* payload = record->fields.data() + 3;
+      WStype_t event = type == CAP_WS_TEXT ? WStype_TEXT : type == CAP_WS_BIN ? WStype_BIN : WStype_PONG;
+      replayMessage(num, event, payload, record->fields.size() - 3);
+    }
+  }
+}
+
+void WebSocketsServer::replayConnect(uint8_t num) {
+  _clients[num].tcp = &replay::clients[num];
+  replay::traceLine("%lu ws%u connected\n", millis(), num);
+  uint8_t url[] = "/";
+  if (onEventCallback) onEventCallback(num, WStype_CONNECTED, url, 1);
+}
+
+void WebSocketsServer::replayDisconnect(uint8_t num) {
+  if (_clients[num].tcp == nullptr) return;
+  _clients[num].tcp = nullptr;
+  replay::traceLine("%lu ws%u disconnected\n", millis(), num);
+  if (onEventCallback) onEventCallback(num, WStype_DISCONNECTED, nullptr, 0);
+}
+
+void WebSocketsServer::replayMessage(uint8_t num, WStype_t type, const uint8_t* payload, size_t length) {
+  // The library hands over a NUL-terminated buffer the handler may parse in place
+  std::vector<uint8_t> buffer(payload, payload + length);
+  buffer.push_back('\0');
+  if (onEventCallback) onEventCallback(num, type, buffer.data(), length);
+}
+
+// The firmware drops a client itself when it is slow; the recorded drop is consumed here
+void WebSocketsServer::disconnect(uint8_t num) {
+  if (replay::take(CAP_WS_DROPPED, num) == nullptr) replay::diverge("client %u dropped, not in the capture", num);
+  replayDisconnect(num);
+}
+
+// A write that failed on the device shows up as a drop recorded during this send
+bool WebSocketsServer::sendTXT(uint8_t num, uint8_t* payload, size_t length, bool headerToPayload) {
+  if (!clientIsConnected(num)) return false;
+  if (replay::take(CAP_WS_DROPPED, num) != nullptr) {
+    replayDisconnect(num);
+    return false;
+  }
+  const char* text = (const char*)payload + (headerToPayload ? WEBSOCKETS_MAX_HEADER_SIZE : 0);
+  replay::traceLine("%lu ws%u %.*s\n", millis(), num, (int)length, text);
+  return true;
+}
+
+bool WebSocketsServer::sendPing(uint8_t num, uint8_t* payload, size_t length) {
+  if (!clientIsConnected(num)) return false;
+  if (replay::take(CAP_WS_DROPPED, num) != nullptr) {
+    replayDisconnect(num);
+    return false;
+  }
+  uint32_t sequence = 0;
+  memcpy(&sequence, payload, std::min(length, sizeof(sequence)));
+  replay::traceLine("%lu ws%u ping %u\n", millis(), num, sequence);
+  return true;
+}
+
+int WebSocketsServer::connectedClients(bool) {
+  int count = 0;
+  for (uint8_t num = 0; num < WEBSOCKETS_SERVER_CLIENT_MAX; num++) {
+    if (clientIsConnected(num)) count++;
+  }
+  return count;
+}
+
+// Driver
+
+#ifndef REPLAY_NO_MAIN
+int main(int argc, char** argv) {
+  const char* path = nullptr;
+  const char* tracePath = nullptr;
+  const char* expect = nullptr;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) tracePath = argv[++i];
+    else if (strcmp(argv[i], "--expect") == 0 && i + 1 < argc) expect = argv[++i];
+    else path = argv[i];
+  }
+  if (path == nullptr) {
+    fprintf(stderr, "usage: %s capture.bin [--trace frames.txt] [--expect <hash>]\n", argv[0]);
+    return 2;
+  }
+
+  FILE* file = fopen(path, "rb");
+  if (file == nullptr) {
+    perror(path);
+    return 2;
+  }
+  std::vector<uint8_t> recorded;
+  uint8_t chunk[4096];
+  for (size_t got; (got = fread(chunk, 1, sizeof(chunk), file)) > 0;) recorded.insert(recorded.end(), chunk, chunk + got);
+  fclose(file);
+
+  std::vector<replay::Pass> passes;
+  if (!replay::parse(recorded, passes)) return 2;
+  if (tracePath != nullptr && (replay::trace = fopen(tracePath, "w")) == nullptr) {
+    perror(tracePath);
+    return 2;
+  }
+  replay::devNull = open("/dev/null", O_WRONLY);
+
+  setup();
+  for (const replay::Pass& pass : passes) {
+    replay::nowUs = std::max<uint64_t>(replay::nowUs, (uint64_t)pass.at * 1000);
+    replay::current = &pass;
+    replay::nextInput = 0;
+    loop();
+    if (replay::nextInput < pass.inputs.size()) {
+      replay::diverge("%zu recorded inputs not consumed, first at offset %zu", pass.inputs.size() - replay::nextInput,
+                      pass.inputs[replay::nextInput].offset);
+    }
+  }
+
+  // The replay's own capture covers the same passes; the device's may have stopped early
+  size_t compared = min((size_t)capture.length, recorded.size());
+  size_t mismatch = 0;
+  while (mismatch < compared && capture.buffer[mismatch] == recorded[mismatch]) mismatch++;
+  bool logsMatch = mismatch == compared && capture.length >= recorded.size();
+
+  printf("%zu passes, %.1fs of robot time, %zu bytes\n", passes.size(),
+         passes.empty() ? 0.0 : passes.back().at / 1000.0, recorded.size());
+  if (logsMatch) {
+    printf("capture reproduced exactly\n");
+  } else {
+    size_t pass = 0;
+    while (pass + 1 < passes.size() && passes[pass + 1].offset <= mismatch) pass++;
+    printf("capture differs from offset %zu", mismatch);
+    if (!passes.empty()) printf(", in the pass at %ums", passes[pass].at);
+    printf("\n");
+  }
+  if (replay::divergence.count > 0) printf("%u divergences, first: %s\n", replay::divergence.count, replay::divergence.first);
+  printf("trace hash %016llx\n", (unsigned long long)replay::traceHash);
+
+  if (replay::trace != nullptr) fclose(replay::trace);
+  char hash[17];
+  snprintf(hash, sizeof(hash), "%016llx", (unsigned long long)replay::traceHash);
+  if (expect != nullptr && strcmp(expect, hash) != 0) {
+    printf("expected trace hash %s\n", expect);
+    return 1;
+  }
+  return logsMatch && replay::divergence.count == 0 ? 0 : 1;
+}
+#endif
@@ -0,0 +1,196 @@
+/*
+  EMU Controller Scenarios
+
+  Scripted runs of the controller on the replay stand-ins (replay.cpp, shims/). Each
+  scenario queues WebSocket events on chosen loop passes, the way a capture would, and
+  then checks the controller's state. Sensor reads find nothing recorded and come back
+  empty (no echo, ADC 0), so the robot always sees a clear path.
+
+  Build:  sh fetch_arduinojson.sh   # ArduinoJson v6.21.5 into ./ArduinoJson
+          python3 prototypes.py ../../src/components/ESP32Controller.cpp > controller_native.cpp
+          g++ -std=gnu++17 -O2 -Wall -I shims -I ArduinoJson/src -o emu-scenarios scenarios.cpp
+  Run:    ./emu-scenarios
+*/
+
+#define REPLAY_NO_MAIN
+#include "replay.cpp"
+
+#define SCENARIO_PASS_INTERVAL 5 // ms between loop passes
+
+unsigned failures = 0;
+
+void check(bool ok, const char* what) {
+  printf("  %s %s\n", ok ? "ok  " : "FAIL", what);
+  if (!ok) failures++;
+}
+
+// One loop() call at the given time, with these client events at the head of the pass
+void runPass(uint32_t at, std::vector<replay::Record> inputs = {}) {
+  static replay::Pass pass;
+  pass = { at, 0, std::move(inputs) };
+  replay::nowUs = std::max<uint64_t>(replay::nowUs, (uint64_t)at * 1000);
+  replay::current = &pass;
+  replay::nextInput = 0;
+  loop();
+}
+
+void runUntil(uint32_t until) {
+  while (millis() + SCENARIO_PASS_INTERVAL <= until) runPass(millis() + SCENARIO_PASS_INTERVAL);
+}
+
+replay::Record connectEvent(uint8_t num) {
+  return { CAP_WS_CONNECT, 0, { num } };
+}
+
+replay::Record binaryFrame(uint8_t num, std::vector<uint8_t> payload) {
+  std::vector<uint8_t> fields = { num, (uint8_t)payload.size(), (uint8_t)(payload.size() >> 8) };
+  fields.insert(fields.end(), payload.begin(), payload.end());
+  return { CAP_WS_BIN, 0, fields };
+}
+
+replay::Record textFrame(uint8_t num, const char* json) {
+  size_t length = strlen(json);
+  std::vector<uint8_t> fields = { num, (uint8_t)length, (uint8_t)(length >> 8) };
+  fields.insert(fields.end(), json, json + length);
+  return { CAP_WS_TEXT, 0, fields };
+}
+
+std::vector<uint8_t> teleopFrame(int16_t left, int16_t right, uint16_t lease, uint16_t sequence) {
+  return { BIN_TELEOP, 0, 0, (uint8_t)left, (uint8_t)(left >> 8), (uint8_t)right, (uint8_t)(right >> 8),
+           (uint8_t)lease, (uint8_t)(lease >> 8), (uint8_t)sequence, (uint8_t)(sequence >> 8) };
+}
+
+std::vector<uint8_t> speedFrame(uint8_t speed) {
+  return { BIN_SET_SPEED, 0, 0, speed };
+}
+
+// A speed change after the last setpoint must leave the lease to stop the robot
+void speedDuringTeleop() {
+  printf("speed during teleop\n");
+  uint32_t start = millis();
+  uint32_t expired = teleop.expired;
+  uint16_t sequence = 0;
+  for (uint32_t at = start + SCENARIO_PASS_INTERVAL; at <= start + 200; at += SCENARIO_PASS_INTERVAL) {
+    std::vector<replay::Record> inputs;
+    if (at - start <= 160 && (at - start) % 40 == 0) inputs.push_back(binaryFrame(0, teleopFrame(150, 150, 300, ++sequence)));
+    if (at - start == 180) inputs.push_back(binaryFrame(0, speedFrame(255)));
+    runPass(at, inputs);
+  }
+  check(teleop.active && robot.leftMotorSpeed == 150 && robot.rightMotorSpeed == 150, "teleop keeps its setpoint");
+
+  runUntil(start + 160 + 300 + 200); // Lease from the last setpoint, then the ramp down
+  check(teleop.expired == expired + 1, "lease expired");
+  check(!teleop.active && robot.leftMotorSpeed == 0 && robot.rightMotorSpeed == 0, "motors stopped");
+}
+
+// A speed change mid-turn must not change the duty the heading estimate assumes
+void speedDuringScan() {
+  printf("speed during scan\n");
+  uint32_t completed = scan.completed;
+  Command command;
+  clearCommand(command);
+  command.action = CMD_SCAN;
+  command.name = commandNames[CMD_SCAN];
+  handleCommand(command);
+  runUntil(millis() + 300);
+  runPass(millis() + SCENARIO_PASS_INTERVAL, { binaryFrame(0, speedFrame(255)) });
+  check(scan.running && robot.leftMotorSpeed == SCAN_TURN_DUTY && robot.rightMotorSpeed == -SCAN_TURN_DUTY,
+        "scan keeps its turn duty");
+
+  runUntil(scan.endsAt + SCENARIO_PASS_INTERVAL);
+  check(!scan.running && scan.completed == completed + 1, "scan completed");
+  check(robot.leftMotorSpeed == 0 && robot.rightMotorSpeed == 0, "motors stopped");
+}
+
+// A speed change must not turn a timed move into an endless one
+void speedDuringTimedMove() {
+  printf("speed during a timed move\n");
+  uint32_t start = millis();
+  runPass(start + SCENARIO_PASS_INTERVAL, { binaryFrame(0, { BIN_MOVE, 0, 0, DIR_FORWARD, 0xF4, 0x01 }) }); // 500ms
+  runPass(start + 100, { binaryFrame(0, speedFrame(255)) });
+  check(robot.direction == DIR_FORWARD && robot.leftMotorSpeed == 255, "new speed applied");
+
+  runUntil(start + 600);
+  check(robot.direction == DIR_STOP && robot.leftMotorSpeed == 0, "move ended on time");
+}
+
+// The same through JSON command frames, as the dashboard sends them
+void jsonSpeedDuringTimedMove() {
+  printf("JSON speed during a timed move\n");
+  uint32_t start = millis();
+  runPass(start + SCENARIO_PASS_INTERVAL,
+          { textFrame(0, "{\"type\":\"command\",\"id\":\"j1\",\"data\":{\"action\":\"move\",\"direction\":\"forward\",\"duration\":500}}") });
+  check(robot.direction == DIR_FORWARD, "move started");
+  runPass(start + 100, { textFrame(0, "{\"type\":\"command\",\"id\":\"j2\",\"data\":{\"action\":\"speed\",\"speed\":255}}") });
+  check(robot.direction == DIR_FORWARD && robot.leftMotorSpeed == 255, "new speed applied");
+
+  runUntil(start + 600);
+  check(robot.direction == DIR_STOP && robot.leftMotorSpeed == 0, "move ended on time");
+}
+
+// A set_thresholds that fails validation must leave every threshold as it was
+void invalidThresholds() {
+  printf("invalid thresholds\n");
+  float warning = robot.ultrasonicWarning;
+  float hysteresis = robot.smokeHysteresis;
+  unsigned long debounce = robot.eventDebounce;
+  Command command;
+  clearCommand(command);
+  command.action = CMD_SET_THRESHOLDS;
+  command.name = commandNames[CMD_SET_THRESHOLDS];
+  command.ultrasonicWarning = robot.ultrasonicDanger; // Danger no longer below warning
+  command.smokeHysteresis = 1.0;
+  handleCommand(command);
+  check(robot.ultrasonicWarning == warning && robot.smokeHysteresis == hysteresis, "danger >= warning rejected");
+
+  clearCommand(command);
+  command.action = CMD_SET_THRESHOLDS;
+  command.name = commandNames[CMD_SET_THRESHOLDS];
+  command.eventDebounce = -1;
+  command.smokeHysteresis = 1.0;
+  handleCommand(command);
+  check(robot.eventDebounce == debounce && robot.smokeHysteresis == hysteresis, "negative debounce rejected");
+
+  command.eventDebounce = NAN;
+  command.batteryHysteresis = -2;
+  handleCommand(command);
+  check(robot.smokeHysteresis == hysteresis, "negative hysteresis rejected");
+
+  command.batteryHysteresis = NAN;
+  handleCommand(command);
+  check(robot.smokeHysteresis == 1.0f, "valid thresholds applied");
+  robot.smokeHysteresis = hysteresis;
+}
+
+// A JSON duration past the u16 field must be rejected, not wrapped into a shorter move
+void durationOutOfRange() {
+  printf("JSON duration out of range\n");
+  uint32_t start = millis();
+  runPass(start + SCENARIO_PASS_INTERVAL,
+          { textFrame(0, "{\"type\":\"command\",\"id\":\"d1\",\"data\":{\"action\":\"move\",\"direction\":\"forward\",\"duration\":70000}}") });
+  check(robot.direction == DIR_STOP, "70000ms rejected");
+  runPass(start + 2 * SCENARIO_PASS_INTERVAL,
+          { textFrame(0, "{\"type\":\"command\",\"id\":\"d2\",\"data\":{\"action\":\"move\",\"direction\":\"forward\",\"duration\":-1}}") });
+  check(robot.direction == DIR_STOP, "-1ms rejected");
+  runPass(start + 3 * SCENARIO_PASS_INTERVAL,
+          { textFrame(0, "{\"type\":\"command\",\"id\":\"d3\",\"data\":{\"action\":\"move\",\"direction\":\"forward\",\"duration\":65535}}") });
+  check(robot.direction == DIR_FORWARD && robot.stopAt == millis() + 65535, "65535ms accepted");
+  moveRobot(DIR_STOP);
+}
+
+int main() {
+  replay::devNull = open("/dev/null", O_WRONLY);
+  setup();
+  runPass(1000, { connectEvent(0) });
+
+  speedDuringTeleop();
+  speedDuringScan();
+  speedDuringTimedMove();
+  jsonSpeedDuringTimedMove();
+  invalidThresholds();
+  durationOutOfRange();
+
+  if (failures > 0) printf("%u checks failed\n", failures);
+  else printf("all checks passed\n");
+  return failures > 0 ? 1 : 0;
+}
@@ -0,0 +1,35 @@
+// Host stand-in: a frame buffer with the drawing calls as no-ops, so the display code
+// runs as on the device without rendering anything
+#pragma once
+
+#include "Adafruit_GFX.h"
+#include "Wire.h"
+
+#define SSD1306_SWITCHCAPVCC 0x02
+#define SSD1306_WHITE 1
+#define SSD1306_BLACK 0
+#define SSD1306_COLUMNADDR 0x21
+#define SSD1306_PAGEADDR 0x22
+
+class Adafruit_SSD1306 : public Print {
+ public:
+  Adafruit_SSD1306(int width, int height, TwoWire*, int, uint32_t = 400000, uint32_t = 100000)
+      : w(width), h(height) {}
+  bool begin(int, int, bool = true, bool = true) { return true; }
+  uint8_t* getBuffer() { return buffer; }
+  void clearDisplay() { memset(buffer, 0, sizeof(buffer)); }
+  void display() {}
+  void setTextSize(int) {}
+  void setTextColor(int) {}
+  void setCursor(int, int) {}
+  void drawPixel(int, int, int) {}
+  void drawCircle(int, int, int, int) {}
+  void fillRect(int, int, int, int, int) {}
+  void drawBitmap(int, int, const uint8_t*, int, int, int) {}
+  int width() const { return w; }
+  int height() const { return h; }
+
+ private:
+  int w, h;
+  uint8_t buffer[128 * 64 / 8] = {};
+};
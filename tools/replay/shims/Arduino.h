@@ -0,0 +1,195 @@
+// Host stand-in for the Arduino-ESP32 core, just wide enough for ESP32Controller.cpp.
+// Time, pins and inputs are defined in replay.cpp and driven from the capture.
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdarg>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+// ArduinoJson keys these off ARDUINO, which a host build doesn't define
+#define ARDUINOJSON_ENABLE_ARDUINO_STRING 1
+#define ARDUINOJSON_ENABLE_ARDUINO_STREAM 0
+#define ARDUINOJSON_ENABLE_ARDUINO_PRINT 0
+#define ARDUINOJSON_ENABLE_PROGMEM 0
+
+using std::isnan;
+using std::max;
+using std::min;
+
+typedef uint8_t byte;
+
+#define HIGH 1
+#define LOW 0
+#define INPUT 0
+#define OUTPUT 1
+#define INPUT_PULLUP 2
+#define A0 36
+#define PROGMEM
+#define IRAM_ATTR
+#define __NOINIT_ATTR
+#define F(x) x
+#define constrain(amt, low, high) ((amt) < (low) ? (low) : ((amt) > (high) ? (high) : (amt)))
+
+class String {
+ public:
+  String() {}
+  String(const char* text) : s(text ? text : "") {}
+  String(const std::string& text) : s(text) {}
+  String(char c) : s(1, c) {}
+  String(int value) : s(std::to_string(value)) {}
+  String(unsigned value) : s(std::to_string(value)) {}
+  String(long value) : s(std::to_string(value)) {}
+  String(unsigned long value) : s(std::to_string(value)) {}
+  String(double value, int decimals = 2) {
+    char text[32];
+    snprintf(text, sizeof(text), "%.*f", decimals, value);
+    s = text;
+  }
+
+  const char* c_str() const { return s.c_str(); }
+  size_t length() const { return s.size(); }
+  bool isEmpty() const { return s.empty(); }
+  bool reserve(size_t size) { s.reserve(size); return true; }
+  bool concat(const char* text) { s += text; return true; }
+  bool concat(const char* text, size_t length) { s.append(text, length); return true; }
+  bool concat(char c) { s += c; return true; }
+  int toInt() const { return atoi(s.c_str()); }
+  float toFloat() const { return atof(s.c_str()); }
+  bool startsWith(const String& prefix) const { return s.rfind(prefix.s, 0) == 0; }
+  String substring(size_t from, size_t to = std::string::npos) const {
+    if (from > s.size()) return String();
+    return String(s.substr(from, to == std::string::npos ? to : to - from));
+  }
+  char operator[](size_t i) const { return s[i]; }
+  bool operator==(const String& other) const { return s == other.s; }
+  bool operator==(const char* other) const { return s == other; }
+  bool operator!=(const String& other) const { return s != other.s; }
+  bool operator!=(const char* other) const { return s != other; }
+  String& operator+=(const String& other) { s += other.s; return *this; }
+  String operator+(const String& other) const { return String(s + other.s); }
+
+ private:
+  std::string s;
+};
+class StringSumHelper : public String {
+ public:
+  using String::String;
+};
+inline String operator+(const char* a, const String& b) { return String(a) + b; }
+
+class Print {
+ public:
+  virtual ~Print() {}
+  virtual size_t write(uint8_t) { return 1; }
+  virtual size_t write(const uint8_t*, size_t size) { return size; }
+  size_t write(const char* text) { return write((const uint8_t*)text, strlen(text)); }
+  template <typename T> size_t print(const T&) { return 0; }
+  template <typename T> size_t println(const T&) { return 0; }
+  size_t println() { return 0; }
+  size_t printf(const char*, ...) { return 0; }
+};
+
+class HardwareSerial : public Print {
+ public:
+  void begin(unsigned long) {}
+  int availableForWrite() { return 128; }
+};
+extern HardwareSerial Serial;
+
+class IPAddress {
+ public:
+  IPAddress() {}
+  IPAddress(uint32_t address) { memcpy(bytes, &address, 4); }
+  IPAddress(uint8_t a, uint8_t b, uint8_t c, uint8_t d) : bytes{ a, b, c, d } {}
+  uint8_t operator[](int i) const { return bytes[i]; }
+  operator uint32_t() const {
+    uint32_t address;
+    memcpy(&address, bytes, 4);
+    return address;
+  }
+
+ private:
+  uint8_t bytes[4] = {};
+};
+
+class EspClass {
+ public:
+  uint32_t getFreeHeap() { return 200000; }
+  uint32_t getMinFreeHeap() { return 180000; }
+  uint32_t getMaxAllocHeap() { return 110000; }
+  uint32_t getHeapSize() { return 320000; }
+};
+extern EspClass ESP;
+
+unsigned long millis();
+unsigned long micros();
+int64_t esp_timer_get_time();
+void delay(unsigned long ms);
+void delayMicroseconds(unsigned int us);
+inline void yield() {}
+
+inline void pinMode(uint8_t, uint8_t) {}
+inline void digitalWrite(uint8_t, uint8_t) {}
+inline int digitalRead(uint8_t) { return LOW; }
+uint16_t analogRead(uint8_t pin);
+unsigned long pulseIn(uint8_t pin, uint8_t state, unsigned long timeout = 1000000);
+inline void ledcSetup(uint8_t, double, uint8_t) {}
+inline void ledcAttachPin(uint8_t, uint8_t) {}
+inline void ledcWrite(uint8_t, uint32_t) {}
+inline bool setCpuFrequencyMhz(uint32_t) { return true; }
+inline uint32_t getCpuFrequencyMhz() { return 240; }
+
+long random(long howBig);
+long random(long howSmall, long howBig);
+inline void randomSeed(unsigned long) {}
+inline long map(long x, long inMin, long inMax, long outMin, long outMax) {
+  return (x - inMin) * (outMax - outMin) / (inMax - inMin) + outMin;
+}
+
+// FreeRTOS: the replay runs the loop task alone. Other tasks are created but never
+// scheduled, locks are always free and notifications don't block.
+typedef void* TaskHandle_t;
+typedef void* SemaphoreHandle_t;
+typedef uint32_t TickType_t;
+typedef int BaseType_t;
+typedef unsigned UBaseType_t;
+typedef int portMUX_TYPE;
+
+#define pdTRUE 1
+#define pdFALSE 0
+#define pdPASS 1
+#define portMAX_DELAY 0xffffffff
+#define portTICK_PERIOD_MS 1
+#define pdMS_TO_TICKS(ms) (ms)
+#define tskIDLE_PRIORITY 0
+#define portMUX_INITIALIZER_UNLOCKED 0
+#define portENTER_CRITICAL(mux) (void)(mux)
+#define portEXIT_CRITICAL(mux) (void)(mux)
+#define portENTER_CRITICAL_ISR(mux) (void)(mux)
+#define portEXIT_CRITICAL_ISR(mux) (void)(mux)
+
+TaskHandle_t xTaskGetCurrentTaskHandle();
+BaseType_t xTaskCreatePinnedToCore(void (*task)(void*), const char* name, uint32_t stack, void* arg,
+                                   UBaseType_t priority, TaskHandle_t* handle, BaseType_t core);
+inline BaseType_t xTaskNotifyGive(TaskHandle_t) { return pdPASS; }
+inline uint32_t ulTaskNotifyTake(BaseType_t, TickType_t) { return 0; }
+inline void vTaskDelay(TickType_t) {}
+inline TickType_t xTaskGetTickCount() { return millis(); }
+SemaphoreHandle_t xSemaphoreCreateMutex();
+inline BaseType_t xSemaphoreTake(SemaphoreHandle_t, TickType_t) { return pdTRUE; }
+inline BaseType_t xSemaphoreGive(SemaphoreHandle_t) { return pdTRUE; }
+
+inline size_t strlcpy(char* dest, const char* src, size_t size) {
+  size_t length = strlen(src);
+  if (size > 0) {
+    size_t copied = length < size - 1 ? length : size - 1;
+    memcpy(dest, src, copied);
+    dest[copied] = '\0';
+  }
+  return length;
+}
@@ -0,0 +1,84 @@
+// Host stand-in: REST requests and event streams run on the async TCP task, which the
+// capture doesn't record, so handlers are registered and never called
+#pragma once
+
+#include "Arduino.h"
+
+#include <functional>
+
+typedef enum { HTTP_GET = 1, HTTP_POST = 2, HTTP_ANY = 255 } WebRequestMethod;
+
+class AsyncClient {
+ public:
+  typedef std::function<void(void*, AsyncClient*)> AcConnectHandler;
+  void onDisconnect(AcConnectHandler, void* = nullptr) {}
+  void close(bool = false) {}
+};
+
+class AsyncWebParameter {
+ public:
+  const String& value() const { return text; }
+
+ private:
+  String text;
+};
+
+class AsyncWebServerResponse {
+ public:
+  void addHeader(const String&, const String&) {}
+};
+
+typedef std::function<size_t(uint8_t*, size_t, size_t)> AwsResponseFiller;
+
+class AsyncWebServerRequest {
+ public:
+  bool hasParam(const String&, bool = false) const { return false; }
+  AsyncWebParameter* getParam(const String&, bool = false) const { return nullptr; }
+  void send(int, const String& = String(), const String& = String()) {}
+  void send(AsyncWebServerResponse*) {}
+  AsyncWebServerResponse* beginResponse(const String&, size_t, AwsResponseFiller) { return nullptr; }
+  AsyncClient* client() { return nullptr; }
+  const String& url() const { return path; }
+
+ private:
+  String path;
+};
+
+typedef std::function<void(AsyncWebServerRequest*)> ArRequestHandlerFunction;
+
+class AsyncWebHandler {
+ public:
+  virtual ~AsyncWebHandler() {}
+  void setFilter(std::function<bool(AsyncWebServerRequest*)>) {}
+};
+
+class AsyncEventSourceClient {
+ public:
+  void send(const char*, const char* = nullptr, uint32_t = 0, uint32_t = 0) {}
+  AsyncClient* client() { return nullptr; }
+  size_t packetsWaiting() const { return 0; }
+  void _onDisconnect() {}
+};
+
+class AsyncEventSource : public AsyncWebHandler {
+ public:
+  AsyncEventSource(const String&) {}
+  void onConnect(std::function<void(AsyncEventSourceClient*)>) {}
+};
+
+class DefaultHeaders {
+ public:
+  static DefaultHeaders& Instance() {
+    static DefaultHeaders headers;
+    return headers;
+  }
+  void addHeader(const String&, const String&) {}
+};
+
+class AsyncWebServer {
+ public:
+  AsyncWebServer(uint16_t) {}
+  void begin() {}
+  void on(const char*, int, ArRequestHandlerFunction) {}
+  AsyncWebHandler& addHandler(AsyncWebHandler* handler) { return *handler; }
+};
@@ -0,0 +1,24 @@
+// Host stand-in: an empty store, except that capture reads as armed so the replayed
+// firmware records its own log for comparison
+#pragma once
+
+#include "Arduino.h"
+
+class Preferences {
+ public:
+  bool begin(const char* name, bool = false) {
+    capture = strcmp(name, "capture") == 0;
+    return true;
+  }
+  void end() {}
+  bool getBool(const char* key, bool fallback = false) {
+    return capture && strcmp(key, "armed") == 0 ? true : fallback;
+  }
+  size_t putBool(const char*, bool) { return 1; }
+  size_t getBytes(const char*, void*, size_t) { return 0; }
+  size_t putBytes(const char*, const void*, size_t size) { return size; }
+  bool remove(const char*) { return true; }
+
+ private:
+  bool capture = false;
+};
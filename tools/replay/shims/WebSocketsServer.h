@@ -0,0 +1,52 @@
+// Host stand-in for links2004/WebSockets: loop() delivers the capture's client events,
+// and frames the firmware sends are written to the replay trace
+#pragma once
+
+#include "Arduino.h"
+#include "WiFi.h"
+
+#define WEBSOCKETS_SERVER_CLIENT_MAX 5
+#define WEBSOCKETS_MAX_HEADER_SIZE 14
+
+typedef enum {
+  WStype_ERROR,
+  WStype_DISCONNECTED,
+  WStype_CONNECTED,
+  WStype_TEXT,
+  WStype_BIN,
+  WStype_FRAGMENT_TEXT_START,
+  WStype_FRAGMENT_BIN_START,
+  WStype_FRAGMENT,
+  WStype_FRAGMENT_FIN,
+  WStype_PING,
+  WStype_PONG
+} WStype_t;
+
+class WebSocketsServer {
+ public:
+  typedef void (*WebSocketServerEvent)(uint8_t num, WStype_t type, uint8_t* payload, size_t length);
+
+  WebSocketsServer(uint16_t, const String& = "", const String& = "arduino") {}
+  void begin() {}
+  void onEvent(WebSocketServerEvent event) { onEventCallback = event; }
+  void loop();
+  bool sendTXT(uint8_t num, uint8_t* payload, size_t length = 0, bool headerToPayload = false);
+  bool sendPing(uint8_t num, uint8_t* payload = nullptr, size_t length = 0);
+  void disconnect(uint8_t num);
+  bool clientIsConnected(uint8_t num) { return num < WEBSOCKETS_SERVER_CLIENT_MAX && _clients[num].tcp != nullptr; }
+  int connectedClients(bool = false);
+  IPAddress remoteIP(uint8_t num) { return IPAddress(192, 168, 4, 100 + num); }
+
+  // Replay side
+  void replayConnect(uint8_t num);
+  void replayDisconnect(uint8_t num);
+  void replayMessage(uint8_t num, WStype_t type, const uint8_t* payload, size_t length);
+
+ protected:
+  struct WSclient_t {
+    WiFiClient* tcp = nullptr;
+  } _clients[WEBSOCKETS_SERVER_CLIENT_MAX];
+
+ private:
+  WebSocketServerEvent onEventCallback = nullptr;
+};
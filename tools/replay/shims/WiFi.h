@@ -0,0 +1,38 @@
+// Host stand-in: link state comes from the capture's CAP_WIFI records (see replay.cpp)
+#pragma once
+
+#include "Arduino.h"
+
+typedef enum { WL_IDLE_STATUS = 0, WL_CONNECTED = 3, WL_DISCONNECTED = 6 } wl_status_t;
+typedef enum { WIFI_OFF, WIFI_STA, WIFI_AP, WIFI_AP_STA } wifi_mode_t;
+
+#define INADDR_NONE IPAddress(0, 0, 0, 0)
+
+class WiFiClass {
+ public:
+  wl_status_t status();
+  wl_status_t begin(const char*, const char* = nullptr, int32_t = 0, const uint8_t* = nullptr, bool = true) {
+    return WL_DISCONNECTED;
+  }
+  bool config(IPAddress, IPAddress, IPAddress, IPAddress = IPAddress(), IPAddress = IPAddress()) { return true; }
+  bool disconnect(bool = false, bool = false) { return true; }
+  bool mode(wifi_mode_t) { return true; }
+  bool persistent(bool) { return true; }
+  bool setAutoReconnect(bool) { return true; }
+  bool setSleep(bool) { return true; }
+  IPAddress localIP() { return IPAddress(192, 168, 4, 2); }
+  IPAddress gatewayIP() { return IPAddress(192, 168, 4, 1); }
+  IPAddress subnetMask() { return IPAddress(255, 255, 255, 0); }
+  IPAddress dnsIP(uint8_t = 0) { return IPAddress(192, 168, 4, 1); }
+  int32_t channel() { return 1; }
+  uint8_t* BSSID() { return bssid; }
+
+ private:
+  uint8_t bssid[6] = {};
+};
+extern WiFiClass WiFi;
+
+class WiFiClient {
+ public:
+  int fd() const;
+};
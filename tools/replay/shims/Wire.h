@@ -0,0 +1,15 @@
+// Host stand-in: the OLED flush task never runs in a replay, so the bus is never driven
+#pragma once
+
+#include "Arduino.h"
+
+class TwoWire : public Print {
+ public:
+  bool begin(int = -1, int = -1, uint32_t = 0) { return true; }
+  void setClock(uint32_t) {}
+  void beginTransmission(uint8_t) {}
+  uint8_t endTransmission(bool = true) { return 0; }
+  size_t write(uint8_t) override { return 1; }
+  size_t write(const uint8_t*, size_t size) override { return size; }
+};
+extern TwoWire Wire;
@@ -0,0 +1,22 @@
+// Host stand-in: fixed figures, so heap reports are identical between replays
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#define MALLOC_CAP_8BIT (1 << 2)
+#define MALLOC_CAP_DEFAULT (1 << 12)
+
+typedef struct {
+  size_t total_free_bytes;
+  size_t total_allocated_bytes;
+  size_t largest_free_block;
+  size_t minimum_free_bytes;
+  size_t allocated_blocks;
+  size_t free_blocks;
+  size_t total_blocks;
+} multi_heap_info_t;
+
+inline void heap_caps_get_info(multi_heap_info_t* info, uint32_t) {
+  *info = { 200000, 120000, 110000, 180000, 400, 12, 412 };
+}